@@ -18,6 +18,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "trace.h"
 #ifdef CONFIG_EPOLL
 #include <sys/epoll.h>
 #endif
@@ -27,6 +28,7 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     bool is_external;
@@ -202,12 +204,13 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        bool is_external,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        void *opaque)
+void aio_set_fd_handler_poll(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             AioPollFn *io_poll,
+                             void *opaque)
 {
     AioHandler *node;
     bool is_new = false;
@@ -220,6 +223,10 @@ void aio_set_fd_handler(AioContext *ctx,
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
 
+            if (!node->io_poll) {
+                ctx->poll_disable_cnt--;
+            }
+
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
@@ -242,10 +249,18 @@ void aio_set_fd_handler(AioContext *ctx,
 
             g_source_add_poll(&ctx->source, &node->pfd);
             is_new = true;
+        } else if (!node->io_poll) {
+            /* Counted again below if it still has no poll function */
+            ctx->poll_disable_cnt--;
+        }
+        if (!io_poll) {
+            ctx->poll_disable_cnt++;
         }
+
         /* Update handler with latest information */
         node->io_read = io_read;
         node->io_write = io_write;
+        node->io_poll = io_poll;
         node->opaque = opaque;
         node->is_external = is_external;
 
@@ -260,13 +275,34 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 }
 
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        bool is_external,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        void *opaque)
+{
+    aio_set_fd_handler_poll(ctx, fd, is_external, io_read, io_write, NULL,
+                            opaque);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 bool is_external,
+                                 EventNotifierHandler *io_read,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_handler_poll(ctx, event_notifier_get_fd(notifier),
+                            is_external, (IOHandler *)io_read, NULL,
+                            io_read ? io_poll : NULL, notifier);
+}
+
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             bool is_external,
                             EventNotifierHandler *io_read)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier),
-                       is_external, (IOHandler *)io_read, NULL, notifier);
+    aio_set_event_notifier_poll(ctx, notifier, is_external, io_read, NULL);
 }
 
 bool aio_prepare(AioContext *ctx)
@@ -401,12 +437,121 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+/* Calls the .io_poll() callback of each handler once; they handle whatever
+ * events they find.  Returns true if any of them made progress.
+ *
+ * The caller must have incremented ctx->walking_handlers.
+ */
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+
+        /* Deleted nodes are freed by the caller, not here */
+    }
+
+    return progress;
+}
+
+/* Busy waits for up to @max_ns nanoseconds until a handler makes progress.
+ * ctx->notify_me must be set so that aio_notify(), e.g. for a new bottom
+ * half, is seen by the poll function of ctx->notifier.
+ *
+ * The caller must have incremented ctx->walking_handlers.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    bool progress;
+    int64_t end_time;
+
+    assert(ctx->notify_me);
+    assert(ctx->walking_handlers > 0);
+
+    trace_run_poll_handlers_begin(ctx, max_ns);
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && ctx->poll_disable_cnt == 0 &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    trace_run_poll_handlers_end(ctx, progress);
+
+    return progress;
+}
+
+/* Polls instead of blocking, if all handlers can be polled and there is
+ * enough time left until the next timer expires.  Returns true if progress
+ * was made, in which case ppoll()/epoll_wait() is skipped.
+ */
+static bool try_poll_mode(AioContext *ctx, bool blocking)
+{
+    int64_t max_ns;
+
+    if (!blocking || !ctx->poll_max_ns || ctx->poll_disable_cnt) {
+        return false;
+    }
+
+    /* aio_compute_timeout() returns -1 for no timeout; the unsigned
+     * comparison makes that "infinite", as in qemu_soonest_timeout() */
+    max_ns = MIN((uint64_t)aio_compute_timeout(ctx), (uint64_t)ctx->poll_ns);
+    if (!max_ns) {
+        return false;
+    }
+
+    return run_poll_handlers(ctx, max_ns);
+}
+
+/* Adapts the polling time to how long aio_poll() had to wait for an event
+ * (@block_ns): polling longer is only worth it if events tend to come in
+ * shortly after poll_ns, and it is a waste of CPU time if they don't come in
+ * within poll_max_ns anyway.
+ */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (ctx->poll_ns) {
+            ctx->poll_ns *= grow;
+        } else {
+            ctx->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
-    int i, ret;
+    int i, ret = 0;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -426,37 +571,50 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->pfd.events
-            && !aio_epoll_enabled(ctx)
-            && aio_node_check(ctx, node->is_external)) {
-            add_pollfd(node);
-        }
+    if (blocking && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+    if (try_poll_mode(ctx, blocking)) {
+        progress = true;
+    } else {
+        /* fill pollfds */
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->pfd.events
+                && !aio_epoll_enabled(ctx)
+                && aio_node_check(ctx, node->is_external)) {
+                add_pollfd(node);
+            }
+        }
 
-    /* wait until next event */
-    if (timeout) {
-        aio_context_release(ctx);
-    }
-    if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
-        AioHandler epoll_handler;
-
-        epoll_handler.pfd.fd = ctx->epollfd;
-        epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
-        npfd = 0;
-        add_pollfd(&epoll_handler);
-        ret = aio_epoll(ctx, pollfds, npfd, timeout);
-    } else  {
-        ret = qemu_poll_ns(pollfds, npfd, timeout);
+        timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+        /* wait until next event */
+        if (timeout) {
+            aio_context_release(ctx);
+        }
+        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+            AioHandler epoll_handler;
+
+            epoll_handler.pfd.fd = ctx->epollfd;
+            epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
+            npfd = 0;
+            add_pollfd(&epoll_handler);
+            ret = aio_epoll(ctx, pollfds, npfd, timeout);
+        } else  {
+            ret = qemu_poll_ns(pollfds, npfd, timeout);
+        }
+        if (timeout) {
+            aio_context_acquire(ctx);
+        }
     }
+
     if (blocking) {
         atomic_sub(&ctx->notify_me, 2);
     }
-    if (timeout) {
-        aio_context_acquire(ctx);
+
+    if (blocking && ctx->poll_max_ns) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
     }
 
     aio_notify_accept(ctx);
@@ -493,3 +651,17 @@ void aio_context_setup(AioContext *ctx, Error **errp)
     }
 #endif
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect value
+     * is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
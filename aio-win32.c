@@ -20,6 +20,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -100,6 +101,27 @@ void aio_set_fd_handler(AioContext *ctx,
     aio_notify(ctx);
 }
 
+/* Polling is not implemented on Windows, @io_poll is never called */
+void aio_set_fd_handler_poll(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             AioPollFn *io_poll,
+                             void *opaque)
+{
+    aio_set_fd_handler(ctx, fd, is_external, io_read, io_write, opaque);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 bool is_external,
+                                 EventNotifierHandler *io_read,
+                                 AioPollFn *io_poll)
+{
+    aio_set_event_notifier(ctx, notifier, is_external, io_read);
+}
+
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *e,
                             bool is_external,
@@ -374,3 +396,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
 void aio_context_setup(AioContext *ctx, Error **errp)
 {
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
@@ -40,6 +40,7 @@
 #include "qemu/timer.h"
 #include "qapi-event.h"
 #include "block/throttle-groups.h"
+#include "qapi/util.h"
 
 #ifdef CONFIG_BSD
 #include <sys/ioctl.h>
@@ -67,6 +68,7 @@ struct BdrvDirtyBitmap {
     char *name;                 /* Optional non-empty unique ID */
     int64_t size;               /* Size of the bitmap (Number of sectors) */
     bool disabled;              /* Bitmap is read-only */
+    bool persistent;            /* Bitmap is stored in the image on close */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -896,6 +898,21 @@ static QemuOptsList bdrv_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Ignore flush requests",
         },
+        {
+            .name = "cor-prefetch",
+            .type = QEMU_OPT_STRING,
+            .help = "Copy-on-read prefetch policy (off, sequential, adjacent)",
+        },
+        {
+            .name = "cor-prefetch-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of data to prefetch ahead of a read",
+        },
+        {
+            .name = "cor-prefetch-speed",
+            .type = QEMU_OPT_SIZE,
+            .help = "Prefetch rate limit in bytes per second",
+        },
         { /* end of list */ }
     },
 };
@@ -914,6 +931,7 @@ static int bdrv_open_common(BlockDriverState *bs, BdrvChild *file,
     const char *node_name = NULL;
     QemuOpts *opts;
     BlockDriver *drv;
+    BlockdevCorPrefetchPolicy cor_prefetch;
     Error *local_err = NULL;
 
     assert(bs->file == NULL);
@@ -980,6 +998,23 @@ static int bdrv_open_common(BlockDriverState *bs, BdrvChild *file,
         }
     }
 
+    cor_prefetch = qapi_enum_parse(BlockdevCorPrefetchPolicy_lookup,
+                                   qemu_opt_get(opts, "cor-prefetch"),
+                                   BLOCKDEV_COR_PREFETCH_POLICY__MAX,
+                                   BLOCKDEV_COR_PREFETCH_POLICY_OFF,
+                                   &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail_opts;
+    }
+    if (cor_prefetch != BLOCKDEV_COR_PREFETCH_POLICY_OFF &&
+        !bs->copy_on_read) {
+        error_setg(errp, "cor-prefetch requires copy-on-read");
+        ret = -EINVAL;
+        goto fail_opts;
+    }
+
     if (filename != NULL) {
         pstrcpy(bs->filename, sizeof(bs->filename), filename);
     } else {
@@ -1046,6 +1081,10 @@ static int bdrv_open_common(BlockDriverState *bs, BdrvChild *file,
     assert(bdrv_min_mem_align(bs) != 0);
     assert((bs->request_alignment != 0) || bdrv_is_sg(bs));
 
+    bdrv_cor_prefetch_enable(bs, cor_prefetch,
+                             qemu_opt_get_size(opts, "cor-prefetch-size", 0),
+                             qemu_opt_get_size(opts, "cor-prefetch-speed", 0));
+
     qemu_opts_del(opts);
     return 0;
 
@@ -1759,6 +1798,7 @@ int bdrv_open(BlockDriverState **pbs, const char *filename,
 
 typedef struct BlockReopenQueueEntry {
      bool prepared;
+     bool was_read_only;
      BDRVReopenState state;
      QSIMPLEQ_ENTRY(BlockReopenQueueEntry) entry;
 } BlockReopenQueueEntry;
@@ -1922,9 +1962,27 @@ int bdrv_reopen_multiple(BlockReopenQueue *bs_queue, Error **errp)
      * changes
      */
     QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        bs_entry->was_read_only = bdrv_is_read_only(bs_entry->state.bs);
         bdrv_reopen_commit(&bs_entry->state);
     }
 
+    /* Children are committed after their parents, so only now can drivers
+     * write to images that became writable */
+    QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        BlockDriverState *bs = bs_entry->state.bs;
+
+        if (bs_entry->was_read_only && !bdrv_is_read_only(bs) &&
+            bs->drv->bdrv_reopen_bitmaps_rw) {
+            bs->drv->bdrv_reopen_bitmaps_rw(bs, &local_err);
+            if (local_err) {
+                error_reportf_err(local_err, "%s: Failed to make dirty "
+                                  "bitmaps writable: ",
+                                  bdrv_get_device_or_node_name(bs));
+                local_err = NULL;
+            }
+        }
+    }
+
     ret = 0;
 
 cleanup:
@@ -2150,6 +2208,19 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
+    if (bs->drv && !bdrv_is_read_only(bs) &&
+        !(bs->open_flags & BDRV_O_INACTIVE))
+    {
+        Error *local_err = NULL;
+
+        bdrv_store_persistent_dirty_bitmaps(bs, &local_err);
+        if (local_err) {
+            error_reportf_err(local_err, "Could not store persistent dirty "
+                              "bitmaps of '%s': ",
+                              bdrv_get_device_or_node_name(bs));
+        }
+    }
+
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
@@ -2182,6 +2253,7 @@ static void bdrv_close(BlockDriverState *bs)
         g_free(bs->opaque);
         bs->opaque = NULL;
         bs->copy_on_read = 0;
+        bdrv_cor_prefetch_disable(bs);
         bs->backing_file[0] = '\0';
         bs->backing_format[0] = '\0';
         bs->total_sectors = 0;
@@ -2270,6 +2342,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     /* dev info */
     bs_dest->copy_on_read       = bs_src->copy_on_read;
+    bs_dest->cor_prefetch       = bs_src->cor_prefetch;
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
@@ -3326,8 +3399,17 @@ void bdrv_invalidate_cache_all(Error **errp)
 
 static int bdrv_inactivate(BlockDriverState *bs)
 {
+    Error *local_err = NULL;
     int ret;
 
+    if (!bdrv_is_read_only(bs)) {
+        bdrv_store_persistent_dirty_bitmaps(bs, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            return -EIO;
+        }
+    }
+
     if (bs->drv->bdrv_inactivate) {
         ret = bs->drv->bdrv_inactivate(bs);
         if (ret < 0) {
@@ -3556,6 +3638,8 @@ BdrvDirtyBitmap *bdrv_dirty_bitmap_abdicate(BlockDriverState *bs,
     name = bitmap->name;
     bitmap->name = NULL;
     successor->name = name;
+    successor->persistent = bitmap->persistent;
+    bitmap->persistent = false;
     bitmap->successor = NULL;
     bdrv_release_dirty_bitmap(bs, bitmap);
 
@@ -3637,6 +3721,68 @@ static void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs)
     bdrv_do_release_matching_dirty_bitmap(bs, NULL, true);
 }
 
+const char *bdrv_dirty_bitmap_name(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+/* Returns the bitmap after @bitmap in the list of @bs, or the first one if
+ * @bitmap is NULL */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list)
+                  : QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
+void bdrv_dirty_bitmap_set_persistence(BdrvDirtyBitmap *bitmap,
+                                       bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_dirty_bitmap_get_persistence(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+/**
+ * Checks whether a new persistent bitmap with the given name and granularity
+ * could be stored in the image of @bs.
+ */
+bool bdrv_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                     uint32_t granularity, Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        error_setg(errp, "Can't store persistent bitmaps to %s",
+                   bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+
+    if (!drv->bdrv_can_store_new_dirty_bitmap) {
+        error_setg_errno(errp, ENOTSUP, "Can't store persistent bitmaps to %s",
+                         bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+
+    return drv->bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp);
+}
+
+/**
+ * Writes all persistent dirty bitmaps of @bs to its image. Called when the
+ * image is closed or handed over to a migration target.
+ */
+void bdrv_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_store_persistent_dirty_bitmaps) {
+        drv->bdrv_store_persistent_dirty_bitmaps(bs, errp);
+    }
+}
+
 void bdrv_disable_dirty_bitmap(BdrvDirtyBitmap *bitmap)
 {
     assert(!bdrv_dirty_bitmap_frozen(bitmap));
@@ -3663,6 +3809,8 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->has_name = !!bm->name;
         info->name = g_strdup(bm->name);
         info->status = bdrv_dirty_bitmap_status(bm);
+        info->has_persistent = bm->persistent;
+        info->persistent = bm->persistent;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
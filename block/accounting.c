@@ -27,6 +27,7 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "sysemu/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
@@ -37,6 +38,8 @@ void block_acct_init(BlockAcctStats *stats, bool account_invalid,
 {
     stats->account_invalid = account_invalid;
     stats->account_failed = account_failed;
+    block_acct_set_histogram(stats, BLOCK_ACCT_HISTOGRAM_MIN_ORDER_DEFAULT,
+                             BLOCK_ACCT_HISTOGRAM_MAX_ORDER_DEFAULT);
 
     if (qtest_enabled()) {
         clock_type = QEMU_CLOCK_VIRTUAL;
@@ -76,6 +79,54 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+/*
+ * Changes the histogram boundaries to 2^min_order, 2^(min_order + 1), ...,
+ * 2^max_order nanoseconds and clears the histograms.
+ */
+int block_acct_set_histogram(BlockAcctStats *stats, unsigned min_order,
+                             unsigned max_order)
+{
+    if (min_order > max_order || max_order > BLOCK_ACCT_HISTOGRAM_MAX_ORDER) {
+        return -EINVAL;
+    }
+
+    stats->histogram_min_order = min_order;
+    stats->histogram_nb_buckets = max_order - min_order + 2;
+    block_acct_reset_histograms(stats);
+    return 0;
+}
+
+void block_acct_reset_histograms(BlockAcctStats *stats)
+{
+    memset(stats->histogram, 0, sizeof(stats->histogram));
+}
+
+/* Returns the lower boundary of bucket @i, which must not be the first one */
+int64_t block_acct_histogram_boundary(BlockAcctStats *stats, unsigned i)
+{
+    assert(i > 0 && i < stats->histogram_nb_buckets);
+    return 1LL << (stats->histogram_min_order + i - 1);
+}
+
+static void block_acct_histogram_account(BlockAcctStats *stats,
+                                         enum BlockAcctType type,
+                                         int64_t latency_ns)
+{
+    unsigned i = 0;
+
+    if (stats->histogram_nb_buckets == 0) {
+        return; /* block_acct_init() has not been called */
+    }
+
+    if (latency_ns >= 1LL << stats->histogram_min_order) {
+        /* floor(log2(latency_ns)) - min_order + 1 */
+        i = 64 - clz64(latency_ns) - stats->histogram_min_order;
+        i = MIN(i, stats->histogram_nb_buckets - 1);
+    }
+
+    stats->histogram[type][i]++;
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -102,6 +153,7 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     stats->nr_ops[cookie->type]++;
     stats->total_time_ns[cookie->type] += latency_ns;
     stats->last_access_time_ns = time_ns;
+    block_acct_histogram_account(stats, cookie->type, latency_ns);
 
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
@@ -125,6 +177,7 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
 
         stats->total_time_ns[cookie->type] += latency_ns;
         stats->last_access_time_ns = time_ns;
+        block_acct_histogram_account(stats, cookie->type, latency_ns);
 
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
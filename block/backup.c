@@ -24,6 +24,9 @@
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
 #define SLICE_TIME 100000000ULL /* ns */
 
+/* Adjacent clusters are copied with one request of up to this size */
+#define BACKUP_MAX_CHUNK (1 << 20)
+
 typedef struct CowRequest {
     int64_t start;
     int64_t end;
@@ -44,9 +47,28 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     HBitmap *bitmap;
     int64_t cluster_size;
+    int64_t max_chunk;          /* clusters per request */
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Background copy operations */
+    int max_in_flight;
+    int in_flight;
+    bool waiting_for_io;
+    int op_ret;                 /* first error of an operation, or 0 */
+    bool op_error_is_read;
+    int64_t op_error_cluster;   /* first cluster of the failed operations */
+
+    /* Bytes not read from the source because they read as zeroes */
+    int64_t bytes_skipped;
 } BackupBlockJob;
 
+typedef struct BackupOp {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int64_t nb_clusters;
+    bool zero;                  /* the source clusters read as zeroes */
+} BackupOp;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -90,6 +112,59 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Whether all clusters in [start, end) have been copied already */
+static bool backup_range_copied(BackupBlockJob *job, int64_t start,
+                                int64_t end)
+{
+    for (; start < end; start++) {
+        if (!hbitmap_get(job->bitmap, start)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Writes @buf to the target. Zero areas (at cluster granularity) are written
+ * with write_zeroes, so the target can keep them sparse, and everything else
+ * with one write per data run.
+ */
+static int coroutine_fn backup_write_target(BackupBlockJob *job,
+                                            int64_t sector_num, int nb_sectors,
+                                            void *buf)
+{
+    size_t len = nb_sectors * BDRV_SECTOR_SIZE;
+    size_t pos, n;
+    bool is_zero;
+    int ret;
+
+    for (pos = 0; pos < len; pos += n) {
+        int64_t sector = sector_num + (pos >> BDRV_SECTOR_BITS);
+
+        n = buffer_zero_run(buf + pos, len - pos, job->cluster_size, &is_zero);
+        if (is_zero) {
+            ret = bdrv_co_write_zeroes(job->target, sector,
+                                       n >> BDRV_SECTOR_BITS,
+                                       BDRV_REQ_MAY_UNMAP);
+        } else {
+            struct iovec iov = {
+                .iov_base = buf + pos,
+                .iov_len  = n,
+            };
+            QEMUIOVector qiov;
+
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(job->target, sector, n >> BDRV_SECTOR_BITS,
+                                 &qiov);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -102,33 +177,49 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
+    int64_t start, end, run;
     int n;
 
-    qemu_co_rwlock_rdlock(&job->flush_rwlock);
-
     start = sector_num / sectors_per_cluster;
     end = DIV_ROUND_UP(sector_num + nb_sectors, sectors_per_cluster);
 
+    /* Fast path for guest writes to areas that are backed up already */
+    if (backup_range_copied(job, start, end)) {
+        trace_backup_do_cow_skip(job, start);
+        return 0;
+    }
+
+    qemu_co_rwlock_rdlock(&job->flush_rwlock);
+
     trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
 
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    while (start < end) {
         if (hbitmap_get(job->bitmap, start)) {
             trace_backup_do_cow_skip(job, start);
+            start++;
             continue; /* already copied */
         }
 
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(sectors_per_cluster,
+        /* Copy the clusters that follow with the same request */
+        for (run = 1; run < job->max_chunk && start + run < end; run++) {
+            if (hbitmap_get(job->bitmap, start + run)) {
+                break;
+            }
+        }
+
+        n = MIN(run * sectors_per_cluster,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
         if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, job->cluster_size);
+            bounce_buffer = qemu_blockalign(bs, MIN(end - start,
+                                                    job->max_chunk) *
+                                                job->cluster_size);
         }
         iov.iov_base = bounce_buffer;
         iov.iov_len = n * BDRV_SECTOR_SIZE;
@@ -150,15 +241,8 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = bdrv_co_write_zeroes(job->target,
-                                       start * sectors_per_cluster,
-                                       n, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = bdrv_co_writev(job->target,
-                                 start * sectors_per_cluster, n,
-                                 &bounce_qiov);
-        }
+        ret = backup_write_target(job, start * sectors_per_cluster, n,
+                                  bounce_buffer);
         if (ret < 0) {
             trace_backup_do_cow_write_fail(job, start, ret);
             if (error_is_read) {
@@ -167,13 +251,14 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
-        hbitmap_set(job->bitmap, start, 1);
+        hbitmap_set(job->bitmap, start, run);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
          */
         job->sectors_read += n;
         job->common.offset += n * BDRV_SECTOR_SIZE;
+        start += run;
     }
 
 out:
@@ -190,6 +275,66 @@ out:
     return ret;
 }
 
+/*
+ * Writes zeroes to the target for the clusters in [start, end) that have not
+ * been copied yet, without reading them. The caller has found the source to
+ * read as zeroes there; clusters that the guest has written since then have
+ * been copied by the before-write notifier and are skipped.
+ */
+static int coroutine_fn backup_do_zero(BackupBlockJob *job,
+                                       int64_t start, int64_t end)
+{
+    CowRequest cow_request;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t total_sectors = DIV_ROUND_UP(job->common.len, BDRV_SECTOR_SIZE);
+    int64_t run;
+    int n;
+    int ret = 0;
+
+    qemu_co_rwlock_rdlock(&job->flush_rwlock);
+
+    wait_for_overlapping_requests(job, start, end);
+    cow_request_begin(&cow_request, job, start, end);
+
+    while (start < end) {
+        if (hbitmap_get(job->bitmap, start)) {
+            start++;
+            continue; /* already copied */
+        }
+
+        for (run = 1; start + run < end &&
+             (run + 1) * sectors_per_cluster <= BDRV_REQUEST_MAX_SECTORS;
+             run++) {
+            if (hbitmap_get(job->bitmap, start + run)) {
+                break;
+            }
+        }
+
+        n = MIN(run * sectors_per_cluster,
+                total_sectors - start * sectors_per_cluster);
+
+        ret = bdrv_co_write_zeroes(job->target, start * sectors_per_cluster,
+                                   n, BDRV_REQ_MAY_UNMAP);
+        trace_backup_do_zero(job, start, run, ret);
+        if (ret < 0) {
+            break;
+        }
+
+        hbitmap_set(job->bitmap, start, run);
+
+        /* Progress, but nothing was read, so no rate limiting */
+        job->common.offset += n * BDRV_SECTOR_SIZE;
+        job->bytes_skipped += n * BDRV_SECTOR_SIZE;
+        start += run;
+    }
+
+    cow_request_end(&cow_request);
+
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+
+    return ret;
+}
+
 static int coroutine_fn backup_before_write_notify(
         NotifierWithReturn *notifier,
         void *opaque)
@@ -256,6 +401,14 @@ static void backup_abort(BlockJob *job)
     }
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    info->has_skipped = true;
+    info->skipped = s->bytes_skipped;
+}
+
 static const BlockJobDriver backup_job_driver = {
     .instance_size  = sizeof(BackupBlockJob),
     .job_type       = BLOCK_JOB_TYPE_BACKUP,
@@ -263,6 +416,7 @@ static const BlockJobDriver backup_job_driver = {
     .iostatus_reset = backup_iostatus_reset,
     .commit         = backup_commit,
     .abort          = backup_abort,
+    .query          = backup_query,
 };
 
 static BlockErrorAction backup_error_action(BackupBlockJob *job,
@@ -317,9 +471,118 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
+static inline void coroutine_fn backup_wait_for_io(BackupBlockJob *job)
+{
+    assert(!job->waiting_for_io);
+    job->waiting_for_io = true;
+    qemu_coroutine_yield();
+    job->waiting_for_io = false;
+}
+
+static void coroutine_fn backup_op_co(void *opaque)
+{
+    BackupOp *op = opaque;
+    BackupBlockJob *job = op->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool error_is_read = false;
+    int ret;
+
+    if (op->zero) {
+        ret = backup_do_zero(job, op->cluster, op->cluster + op->nb_clusters);
+    } else {
+        ret = backup_do_cow(job->common.bs, op->cluster * sectors_per_cluster,
+                            op->nb_clusters * sectors_per_cluster,
+                            &error_is_read, false);
+    }
+    trace_backup_op_complete(job, op->cluster, op->nb_clusters, ret);
+
+    /* Remember the failure closest to the start of the disk, so that a
+     * retry does not skip anything */
+    if (ret < 0 && (!job->op_ret || op->cluster < job->op_error_cluster)) {
+        job->op_ret = ret;
+        job->op_error_is_read = error_is_read;
+        job->op_error_cluster = op->cluster;
+    }
+
+    job->in_flight--;
+    g_free(op);
+
+    if (job->waiting_for_io) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+/*
+ * Starts copying @nb_clusters clusters from @cluster in the background, or
+ * zeroing them on the target if @zero is true
+ */
+static void coroutine_fn backup_issue_copy(BackupBlockJob *job,
+                                           int64_t cluster,
+                                           int64_t nb_clusters, bool zero)
+{
+    BackupOp *op;
+    Coroutine *co;
+
+    while (job->in_flight >= job->max_in_flight) {
+        trace_backup_yield_in_flight(job, cluster, job->in_flight);
+        backup_wait_for_io(job);
+    }
+
+    op = g_new(BackupOp, 1);
+    op->job = job;
+    op->cluster = cluster;
+    op->nb_clusters = nb_clusters;
+    op->zero = zero;
+
+    job->in_flight++;
+    co = qemu_coroutine_create(backup_op_co);
+    qemu_coroutine_enter(co, op);
+}
+
+static void coroutine_fn backup_drain_ops(BackupBlockJob *job)
+{
+    while (job->in_flight > 0) {
+        backup_wait_for_io(job);
+    }
+}
+
+/*
+ * Waits for the remaining operations after one of them failed and applies
+ * the error policy. Returns the error if the job must fail, or 0 with
+ * *@cluster set to the first failed cluster, where the copy resumes.
+ */
+static int coroutine_fn backup_handle_op_error(BackupBlockJob *job,
+                                               int64_t *cluster)
+{
+    int ret;
+
+    backup_drain_ops(job);
+
+    ret = job->op_ret;
+    if (backup_error_action(job, job->op_error_is_read, -ret) ==
+        BLOCK_ERROR_ACTION_REPORT) {
+        return ret;
+    }
+
+    *cluster = job->op_error_cluster;
+    job->op_ret = 0;
+    return 0;
+}
+
+/* Moves @hbi to @sector and returns the first dirty sector from there on */
+static int64_t backup_dirty_iter_seek(BackupBlockJob *job, HBitmapIter *hbi,
+                                      int64_t sector)
+{
+    if (sector >= DIV_ROUND_UP(job->common.len, BDRV_SECTOR_SIZE)) {
+        return -1;
+    }
+
+    bdrv_set_dirty_iter(hbi, sector);
+    return hbitmap_iter_next(hbi);
+}
+
 static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
-    bool error_is_read;
     int ret = 0;
     int clusters_per_iter;
     uint32_t granularity;
@@ -327,8 +590,8 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     int64_t cluster;
     int64_t end;
     int64_t last_cluster = -1;
+    int64_t nb_clusters = DIV_ROUND_UP(job->common.len, job->cluster_size);
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    BlockDriverState *bs = job->common.bs;
     HBitmapIter hbi;
 
     granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
@@ -336,46 +599,212 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
 
     /* Find the next dirty sector(s) */
-    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+    sector = hbitmap_iter_next(&hbi);
+    for (;;) {
+        if (job->op_ret < 0) {
+            ret = backup_handle_op_error(job, &cluster);
+            if (ret < 0) {
+                break;
+            }
+            sector = backup_dirty_iter_seek(job, &hbi,
+                                            cluster * sectors_per_cluster);
+            continue;
+        }
+
+        if (sector == -1) {
+            backup_drain_ops(job);
+            if (job->op_ret < 0) {
+                continue;
+            }
+            break;
+        }
+
+        if (yield_and_check(job)) {
+            break;
+        }
+
         cluster = sector / sectors_per_cluster;
 
-        /* Fake progress updates for any clusters we skipped */
-        if (cluster != last_cluster + 1) {
+        /* Fake progress updates for any clusters we skipped.  After a retry
+         * the clusters up to last_cluster have been accounted already. */
+        if (cluster > last_cluster + 1) {
             job->common.offset += ((cluster - last_cluster - 1) *
                                    job->cluster_size);
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(bs, cluster * sectors_per_cluster,
-                                    sectors_per_cluster, &error_is_read,
-                                    false);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
-                }
-            } while (ret < 0);
+        /* Copy directly following dirty areas with the same request.  This
+         * also moves the iterator past the clusters we copy if the bitmap
+         * granularity is smaller than the backup granularity. */
+        end = MIN(cluster + clusters_per_iter, nb_clusters);
+        for (;;) {
+            sector = backup_dirty_iter_seek(job, &hbi,
+                                            end * sectors_per_cluster);
+            if (sector == -1 || sector / sectors_per_cluster != end ||
+                end - cluster + clusters_per_iter > job->max_chunk) {
+                break;
+            }
+            end = MIN(end + clusters_per_iter, nb_clusters);
         }
 
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
+        backup_issue_copy(job, cluster, end - cluster, false);
+        last_cluster = MAX(last_cluster, end - 1);
+    }
+
+    backup_drain_ops(job);
+
+    /* Play some final catchup with the progress meter */
+    if (last_cluster + 1 < nb_clusters) {
+        job->common.offset += ((nb_clusters - last_cluster - 1) *
+                               job->cluster_size);
+    }
+
+    return ret;
+}
+
+/* Whether sync=top must copy @cluster, i.e. it is not only in the backing
+ * file */
+static bool coroutine_fn backup_cluster_needed(BackupBlockJob *job,
+                                               int64_t cluster)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    if (job->sync_mode != MIRROR_SYNC_MODE_TOP) {
+        return true;
+    }
+
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced = bdrv_is_allocated(bs, cluster * sectors_per_cluster + i,
+                                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
         }
+    }
+
+    /* If the above loop never found any sectors that are in
+     * the topmost image, skip this backup. */
+    return alloced != 0;
+}
 
-        last_cluster = cluster - 1;
+/*
+ * Returns whether the source reads as zeroes from @cluster on, and sets *@n
+ * to the number of clusters (at most @max) known to have the same status.
+ * Clusters that are only partly zero count as data.
+ */
+static bool coroutine_fn backup_range_is_zero(BackupBlockJob *job,
+                                              int64_t cluster, int64_t max,
+                                              int64_t *n)
+{
+    BlockDriverState *file;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t sector = cluster * sectors_per_cluster;
+    int64_t total_sectors = DIV_ROUND_UP(job->common.len, BDRV_SECTOR_SIZE);
+    int64_t ret;
+    int nb_sectors, pnum;
+
+    nb_sectors = MIN(MIN(max * sectors_per_cluster, total_sectors - sector),
+                     BDRV_REQUEST_MAX_SECTORS);
+    ret = bdrv_get_block_status_above(job->common.bs, NULL, sector,
+                                      nb_sectors, &pnum, &file);
+    if (ret < 0 || pnum == 0) {
+        *n = 1;
+        return false;
     }
 
-    /* Play some final catchup with the progress meter */
-    end = DIV_ROUND_UP(job->common.len, job->cluster_size);
-    if (last_cluster + 1 < end) {
-        job->common.offset += ((end - last_cluster - 1) * job->cluster_size);
+    if (!(ret & BDRV_BLOCK_ZERO)) {
+        *n = DIV_ROUND_UP(pnum, sectors_per_cluster);
+        return false;
     }
 
+    if (sector + pnum >= total_sectors) {
+        /* The last cluster may be shorter */
+        *n = DIV_ROUND_UP(pnum, sectors_per_cluster);
+    } else {
+        *n = pnum / sectors_per_cluster;
+    }
+
+    if (*n == 0) {
+        *n = 1;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Copies the whole drive (sync=full) or the top image (sync=top). With
+ * sync=full, areas that read as zeroes in the source are not read but zeroed
+ * on the target.
+ */
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int64_t data_end = 0;
+    int64_t cluster = 0;
+    int64_t n;
+    int ret = 0;
+
+    for (;;) {
+        if (job->op_ret < 0) {
+            /* Depending on error action, fail now or retry cluster */
+            ret = backup_handle_op_error(job, &cluster);
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        if (cluster >= end) {
+            backup_drain_ops(job);
+            if (job->op_ret < 0) {
+                continue;
+            }
+            break;
+        }
+
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        if (hbitmap_get(job->bitmap, cluster) ||
+            !backup_cluster_needed(job, cluster)) {
+            cluster++;
+            continue;
+        }
+
+        if (job->sync_mode == MIRROR_SYNC_MODE_FULL && cluster >= data_end) {
+            if (backup_range_is_zero(job, cluster, end - cluster, &n)) {
+                backup_issue_copy(job, cluster, n, true);
+                cluster += n;
+                continue;
+            }
+            data_end = cluster + n;
+        } else if (job->sync_mode != MIRROR_SYNC_MODE_FULL) {
+            data_end = end;
+        }
+
+        /* Merge the clusters that follow into one request */
+        for (n = 1; n < job->max_chunk && cluster + n < data_end; n++) {
+            if (hbitmap_get(job->bitmap, cluster + n) ||
+                !backup_cluster_needed(job, cluster + n)) {
+                break;
+            }
+        }
+
+        backup_issue_copy(job, cluster, n, false);
+        cluster += n;
+    }
+
+    backup_drain_ops(job);
+
     return ret;
 }
 
@@ -389,14 +818,12 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->bitmap = hbitmap_alloc(end, 0);
@@ -421,58 +848,7 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_full(job);
     }
 
     notifier_with_return_remove(&before_write);
@@ -493,7 +869,8 @@ static void coroutine_fn backup_run(void *opaque)
 }
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
-                  int64_t speed, MirrorSyncMode sync_mode,
+                  int64_t speed, int64_t max_in_flight,
+                  MirrorSyncMode sync_mode,
                   BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
@@ -520,6 +897,12 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (max_in_flight < 1 || max_in_flight > BACKUP_MAX_IN_FLIGHT) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-in-flight",
+                   "a value between 1 and " stringify(BACKUP_MAX_IN_FLIGHT));
+        return;
+    }
+
     if (!bdrv_is_inserted(bs)) {
         error_setg(errp, "Device is not inserted: %s",
                    bdrv_get_device_name(bs));
@@ -596,6 +979,8 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     } else {
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
+    job->max_chunk = MAX(1, BACKUP_MAX_CHUNK / job->cluster_size);
+    job->max_in_flight = max_in_flight;
 
     bdrv_op_block_all(target, job->common.blocker);
     job->common.len = len;
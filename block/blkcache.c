@@ -0,0 +1,678 @@
+/*
+ * Shared in-memory read cache
+ *
+ * The blkcache driver sits between a format driver and its image file and
+ * keeps the data read from the image in memory.  All blkcache nodes with the
+ * same cache id share one cache, so when several disks use the same backing
+ * file, each block of it is read from the storage only once.
+ *
+ * Writes through any of the nodes invalidate the cached data.  Changes made
+ * to the image outside of this process are not detected, so the cache is
+ * meant for images that are not modified, such as backing files.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/util.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "trace.h"
+
+#define BLKCACHE_BLOCK_SIZE     (64 * 1024)
+#define BLKCACHE_DEFAULT_SIZE   (64 * 1024 * 1024)
+
+/*
+ * Lists of the adaptive replacement cache (ARC, Megiddo and Modha).  T1 holds
+ * blocks that were used once recently, T2 blocks that were used at least
+ * twice.  B1 and B2 only remember the offsets of blocks that were evicted
+ * from T1 and T2.  A miss on a block in B1 or B2 moves the target size of T1
+ * towards the list that would have kept the block.  Blocks that are used
+ * repeatedly thus stay in T2 while large amounts of data that are read only
+ * once pass through T1.
+ *
+ * With LRU eviction only T1 is used.
+ */
+enum {
+    BLKCACHE_T1,
+    BLKCACHE_T2,
+    BLKCACHE_B1,
+    BLKCACHE_B2,
+    BLKCACHE_LISTS,
+};
+
+typedef struct BlkcacheEntry {
+    int64_t offset;
+    uint8_t *data;      /* NULL in B1 and B2 */
+    int list;
+    QTAILQ_ENTRY(BlkcacheEntry) next;
+} BlkcacheEntry;
+
+/* Most recently used entries are at the head */
+QTAILQ_HEAD(BlkcacheList, BlkcacheEntry);
+
+typedef struct BlkcacheShared {
+    char *id; /* This is constant during the lifetime of the cache */
+
+    QemuMutex lock; /* This lock protects the following fields */
+    BlockdevCacheEviction eviction;
+    uint64_t max_blocks;
+    uint64_t t1_target;
+    GHashTable *entries;
+    struct BlkcacheList lists[BLKCACHE_LISTS];
+    uint64_t list_len[BLKCACHE_LISTS];
+    uint64_t generation; /* incremented by each invalidation */
+
+    /* These two are protected by the global blkcache_lock */
+    unsigned refcount;
+    QTAILQ_ENTRY(BlkcacheShared) list;
+} BlkcacheShared;
+
+static QemuMutex blkcache_lock;
+static QTAILQ_HEAD(, BlkcacheShared) blkcache_caches =
+    QTAILQ_HEAD_INITIALIZER(blkcache_caches);
+
+typedef struct BDRVBlkcacheState {
+    BlkcacheShared *cache;
+    uint64_t hits;
+    uint64_t misses;
+} BDRVBlkcacheState;
+
+static BlkcacheShared *blkcache_get(const char *id, uint64_t max_blocks,
+                                    BlockdevCacheEviction eviction)
+{
+    BlkcacheShared *c = NULL;
+    BlkcacheShared *iter;
+    int i;
+
+    qemu_mutex_lock(&blkcache_lock);
+
+    QTAILQ_FOREACH(iter, &blkcache_caches, list) {
+        if (!strcmp(id, iter->id)) {
+            c = iter;
+            break;
+        }
+    }
+
+    if (!c) {
+        c = g_new0(BlkcacheShared, 1);
+        c->id = g_strdup(id);
+        qemu_mutex_init(&c->lock);
+        c->eviction = eviction;
+        c->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+        for (i = 0; i < BLKCACHE_LISTS; i++) {
+            QTAILQ_INIT(&c->lists[i]);
+        }
+        QTAILQ_INSERT_TAIL(&blkcache_caches, c, list);
+    }
+
+    qemu_mutex_lock(&c->lock);
+    c->max_blocks = MAX(c->max_blocks, max_blocks);
+    qemu_mutex_unlock(&c->lock);
+
+    c->refcount++;
+
+    qemu_mutex_unlock(&blkcache_lock);
+
+    return c;
+}
+
+static void blkcache_add(BlkcacheShared *c, BlkcacheEntry *e, int list)
+{
+    e->list = list;
+    QTAILQ_INSERT_HEAD(&c->lists[list], e, next);
+    c->list_len[list]++;
+}
+
+static void blkcache_move(BlkcacheShared *c, BlkcacheEntry *e, int list)
+{
+    QTAILQ_REMOVE(&c->lists[e->list], e, next);
+    c->list_len[e->list]--;
+    blkcache_add(c, e, list);
+}
+
+static void blkcache_remove(BlkcacheShared *c, BlkcacheEntry *e)
+{
+    if (!e) {
+        return;
+    }
+
+    QTAILQ_REMOVE(&c->lists[e->list], e, next);
+    c->list_len[e->list]--;
+    g_hash_table_remove(c->entries, &e->offset);
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+static BlkcacheEntry *blkcache_lru(BlkcacheShared *c, int list)
+{
+    return QTAILQ_LAST(&c->lists[list], BlkcacheList);
+}
+
+static void blkcache_put(BlkcacheShared *c)
+{
+    int i;
+
+    qemu_mutex_lock(&blkcache_lock);
+    if (--c->refcount == 0) {
+        QTAILQ_REMOVE(&blkcache_caches, c, list);
+        for (i = 0; i < BLKCACHE_LISTS; i++) {
+            while (!QTAILQ_EMPTY(&c->lists[i])) {
+                blkcache_remove(c, QTAILQ_FIRST(&c->lists[i]));
+            }
+        }
+        g_hash_table_destroy(c->entries);
+        qemu_mutex_destroy(&c->lock);
+        g_free(c->id);
+        g_free(c);
+    }
+    qemu_mutex_unlock(&blkcache_lock);
+}
+
+/*
+ * Makes room for a block by evicting the least recently used block of T1 or
+ * T2 into the corresponding ghost list.  @in_b2 tells whether the new block
+ * was found in B2.
+ */
+static void blkcache_replace(BlkcacheShared *c, bool in_b2)
+{
+    uint64_t t1_len = c->list_len[BLKCACHE_T1];
+    BlkcacheEntry *e;
+
+    if (t1_len > 0 &&
+        (t1_len > c->t1_target || (in_b2 && t1_len == c->t1_target))) {
+        e = blkcache_lru(c, BLKCACHE_T1);
+    } else {
+        e = blkcache_lru(c, BLKCACHE_T2);
+    }
+    if (!e) {
+        return;
+    }
+
+    qemu_vfree(e->data);
+    e->data = NULL;
+    blkcache_move(c, e, e->list == BLKCACHE_T1 ? BLKCACHE_B1 : BLKCACHE_B2);
+}
+
+/*
+ * Inserts the block at @offset with its @data.  Returns false if the block is
+ * already cached, in which case the caller keeps ownership of @data.
+ *
+ * Called with c->lock held.
+ */
+static bool blkcache_insert(BlkcacheShared *c, int64_t offset, uint8_t *data)
+{
+    BlkcacheEntry *e = g_hash_table_lookup(c->entries, &offset);
+    uint64_t cap = c->max_blocks;
+    uint64_t t1_len, l1_len, total, delta;
+    bool full;
+
+    if (e && e->data) {
+        /* Another request read the same block concurrently */
+        return false;
+    }
+
+    if (c->eviction == BLOCKDEV_CACHE_EVICTION_LRU) {
+        if (c->list_len[BLKCACHE_T1] >= cap) {
+            blkcache_remove(c, blkcache_lru(c, BLKCACHE_T1));
+        }
+        goto add_new;
+    }
+
+    full = c->list_len[BLKCACHE_T1] + c->list_len[BLKCACHE_T2] >= cap;
+
+    if (e && e->list == BLKCACHE_B1) {
+        delta = MAX(c->list_len[BLKCACHE_B2] / c->list_len[BLKCACHE_B1], 1);
+        c->t1_target = MIN(c->t1_target + delta, cap);
+        if (full) {
+            blkcache_replace(c, false);
+        }
+        e->data = data;
+        blkcache_move(c, e, BLKCACHE_T2);
+        return true;
+    }
+
+    if (e && e->list == BLKCACHE_B2) {
+        delta = MAX(c->list_len[BLKCACHE_B1] / c->list_len[BLKCACHE_B2], 1);
+        c->t1_target = c->t1_target > delta ? c->t1_target - delta : 0;
+        if (full) {
+            blkcache_replace(c, true);
+        }
+        e->data = data;
+        blkcache_move(c, e, BLKCACHE_T2);
+        return true;
+    }
+
+    /* A block that is not known at all, keep the directory at 2 * cap */
+    t1_len = c->list_len[BLKCACHE_T1];
+    l1_len = t1_len + c->list_len[BLKCACHE_B1];
+    total = l1_len + c->list_len[BLKCACHE_T2] + c->list_len[BLKCACHE_B2];
+
+    if (l1_len >= cap) {
+        if (t1_len < cap) {
+            blkcache_remove(c, blkcache_lru(c, BLKCACHE_B1));
+            if (full) {
+                blkcache_replace(c, false);
+            }
+        } else {
+            blkcache_remove(c, blkcache_lru(c, BLKCACHE_T1));
+        }
+    } else if (total >= cap) {
+        if (total >= 2 * cap) {
+            blkcache_remove(c, blkcache_lru(c, BLKCACHE_B2));
+        }
+        if (full) {
+            blkcache_replace(c, false);
+        }
+    }
+
+add_new:
+    e = g_new(BlkcacheEntry, 1);
+    e->offset = offset;
+    e->data = data;
+    g_hash_table_insert(c->entries, &e->offset, e);
+    blkcache_add(c, e, BLKCACHE_T1);
+    return true;
+}
+
+/* Drops the cached data of the blocks in [@offset, @offset + @bytes) */
+static void blkcache_invalidate(BlkcacheShared *c, int64_t offset,
+                                int64_t bytes)
+{
+    int64_t start = QEMU_ALIGN_DOWN(offset, BLKCACHE_BLOCK_SIZE);
+    int64_t end = bytes > INT64_MAX - offset ? INT64_MAX : offset + bytes;
+    BlkcacheEntry *e, *next;
+    int64_t block;
+    int i;
+
+    trace_blkcache_invalidate(c, offset, bytes);
+
+    qemu_mutex_lock(&c->lock);
+    c->generation++;
+
+    if ((end - start) / BLKCACHE_BLOCK_SIZE >
+        c->list_len[BLKCACHE_T1] + c->list_len[BLKCACHE_T2]) {
+        for (i = BLKCACHE_T1; i <= BLKCACHE_T2; i++) {
+            QTAILQ_FOREACH_SAFE(e, &c->lists[i], next, next) {
+                if (e->offset >= start && e->offset < end) {
+                    blkcache_remove(c, e);
+                }
+            }
+        }
+    } else {
+        for (block = start; block < end; block += BLKCACHE_BLOCK_SIZE) {
+            e = g_hash_table_lookup(c->entries, &block);
+            if (e && e->data) {
+                blkcache_remove(c, e);
+            }
+        }
+    }
+
+    qemu_mutex_unlock(&c->lock);
+}
+
+/* Copies the part of @block that overlaps the request into @qiov */
+static void blkcache_copy_to_qiov(QEMUIOVector *qiov, int64_t offset,
+                                  int64_t end, int64_t block,
+                                  const uint8_t *data)
+{
+    int64_t start = MAX(block, offset);
+    int64_t stop = MIN(block + BLKCACHE_BLOCK_SIZE, end);
+
+    qemu_iovec_from_buf(qiov, start - offset, data + (start - block),
+                        stop - start);
+}
+
+static bool blkcache_read_cached(BlkcacheShared *c, int64_t block,
+                                 int64_t offset, int64_t end,
+                                 QEMUIOVector *qiov)
+{
+    BlkcacheEntry *e;
+    bool hit = false;
+
+    qemu_mutex_lock(&c->lock);
+    e = g_hash_table_lookup(c->entries, &block);
+    if (e && e->data) {
+        blkcache_copy_to_qiov(qiov, offset, end, block, e->data);
+        blkcache_move(c, e, c->eviction == BLOCKDEV_CACHE_EVICTION_LRU
+                            ? BLKCACHE_T1 : BLKCACHE_T2);
+        hit = true;
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    return hit;
+}
+
+/*
+ * Reads the blocks in [@start, @stop) from the image, copies the part that
+ * overlaps the request [@offset, @end) into @qiov and adds them to the cache.
+ */
+static int coroutine_fn blkcache_fill(BlockDriverState *bs, int64_t start,
+                                      int64_t stop, int64_t offset,
+                                      int64_t end, QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheShared *c = s->cache;
+    int nb_blocks = (stop - start) / BLKCACHE_BLOCK_SIZE;
+    QEMUIOVector fill_qiov;
+    uint8_t **blocks;
+    uint64_t generation;
+    int64_t length, read_end, block;
+    int i, ret;
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        return length;
+    }
+    read_end = MIN(stop, length);
+    assert(read_end > start);
+
+    blocks = g_new0(uint8_t *, nb_blocks);
+    qemu_iovec_init(&fill_qiov, nb_blocks);
+
+    for (i = 0; i < nb_blocks; i++) {
+        block = start + (int64_t)i * BLKCACHE_BLOCK_SIZE;
+        blocks[i] = qemu_try_blockalign(bs->file->bs, BLKCACHE_BLOCK_SIZE);
+        if (blocks[i] == NULL) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        if (block + BLKCACHE_BLOCK_SIZE > read_end) {
+            /* The end of the last block is after the end of the image */
+            memset(blocks[i] + (read_end - block), 0,
+                   block + BLKCACHE_BLOCK_SIZE - read_end);
+        }
+        qemu_iovec_add(&fill_qiov, blocks[i],
+                       MIN(BLKCACHE_BLOCK_SIZE, read_end - block));
+    }
+
+    qemu_mutex_lock(&c->lock);
+    generation = c->generation;
+    qemu_mutex_unlock(&c->lock);
+
+    trace_blkcache_fill(bs, c, start, read_end - start);
+    ret = bdrv_co_readv(bs->file->bs, start >> BDRV_SECTOR_BITS,
+                        (read_end - start) >> BDRV_SECTOR_BITS, &fill_qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < nb_blocks; i++) {
+        block = start + (int64_t)i * BLKCACHE_BLOCK_SIZE;
+        blkcache_copy_to_qiov(qiov, offset, end, block, blocks[i]);
+    }
+
+    qemu_mutex_lock(&c->lock);
+    /* A write that completed in the meantime may have made the data stale */
+    if (c->generation == generation) {
+        for (i = 0; i < nb_blocks; i++) {
+            block = start + (int64_t)i * BLKCACHE_BLOCK_SIZE;
+            if (blkcache_insert(c, block, blocks[i])) {
+                blocks[i] = NULL;
+            }
+        }
+    }
+    qemu_mutex_unlock(&c->lock);
+    ret = 0;
+
+out:
+    for (i = 0; i < nb_blocks; i++) {
+        qemu_vfree(blocks[i]);
+    }
+    g_free(blocks);
+    qemu_iovec_destroy(&fill_qiov);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_readv(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    int64_t end = offset + (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    int64_t block;
+    int64_t miss_start = -1;
+    int ret;
+
+    /* Consecutive blocks that are not cached are read with one request */
+    for (block = QEMU_ALIGN_DOWN(offset, BLKCACHE_BLOCK_SIZE); block < end;
+         block += BLKCACHE_BLOCK_SIZE)
+    {
+        if (!blkcache_read_cached(s->cache, block, offset, end, qiov)) {
+            s->misses++;
+            if (miss_start < 0) {
+                miss_start = block;
+            }
+            continue;
+        }
+
+        s->hits++;
+        if (miss_start >= 0) {
+            ret = blkcache_fill(bs, miss_start, block, offset, end, qiov);
+            if (ret < 0) {
+                return ret;
+            }
+            miss_start = -1;
+        }
+    }
+
+    if (miss_start >= 0) {
+        return blkcache_fill(bs, miss_start, block, offset, end, qiov);
+    }
+    return 0;
+}
+
+static int coroutine_fn blkcache_co_writev(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_writev(bs->file->bs, sector_num, nb_sectors, qiov);
+    blkcache_invalidate(s->cache, sector_num * BDRV_SECTOR_SIZE,
+                        (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_write_zeroes(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 int nb_sectors,
+                                                 BdrvRequestFlags flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_write_zeroes(bs->file->bs, sector_num, nb_sectors, flags);
+    blkcache_invalidate(s->cache, sector_num * BDRV_SECTOR_SIZE,
+                        (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_discard(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_discard(bs->file->bs, sector_num, nb_sectors);
+    blkcache_invalidate(s->cache, sector_num * BDRV_SECTOR_SIZE,
+                        (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
+    return ret;
+}
+
+static int64_t coroutine_fn
+blkcache_co_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, int *pnum,
+                             BlockDriverState **file)
+{
+    *pnum = nb_sectors;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | BDRV_BLOCK_DATA |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int blkcache_truncate(BlockDriverState *bs, int64_t offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_truncate(bs->file->bs, offset);
+    blkcache_invalidate(s->cache, 0, INT64_MAX);
+    return ret;
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int blkcache_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    return bdrv_get_info(bs->file->bs, bdi);
+}
+
+static BlockSharedCacheStats *
+blkcache_get_shared_cache_stats(const BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheShared *c = s->cache;
+    BlockSharedCacheStats *stats = g_new0(BlockSharedCacheStats, 1);
+
+    stats->id = g_strdup(c->id);
+    stats->hits = s->hits;
+    stats->misses = s->misses;
+
+    qemu_mutex_lock(&c->lock);
+    stats->eviction = c->eviction;
+    stats->size = c->max_blocks * BLKCACHE_BLOCK_SIZE;
+    stats->used = (c->list_len[BLKCACHE_T1] + c->list_len[BLKCACHE_T2]) *
+                  BLKCACHE_BLOCK_SIZE;
+    qemu_mutex_unlock(&c->lock);
+
+    return stats;
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "blkcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "cache-id",
+            .type = QEMU_OPT_STRING,
+            .help = "Name of the shared cache (default: image filename)",
+        },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum memory used by the shared cache",
+        },
+        {
+            .name = "eviction",
+            .type = QEMU_OPT_STRING,
+            .help = "Eviction policy of the shared cache (lru, arc)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int blkcache_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    BlockdevCacheEviction eviction;
+    const char *id;
+    uint64_t size;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    id = qemu_opt_get(opts, "cache-id");
+    if (!id) {
+        id = bs->file->bs->filename;
+    }
+    if (!id[0]) {
+        error_setg(errp, "blkcache needs a cache-id for images without a "
+                   "filename");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    size = qemu_opt_get_size(opts, "cache-size", BLKCACHE_DEFAULT_SIZE);
+    if (size < BLKCACHE_BLOCK_SIZE) {
+        error_setg(errp, "cache-size must be at least %d bytes",
+                   BLKCACHE_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    eviction = qapi_enum_parse(BlockdevCacheEviction_lookup,
+                               qemu_opt_get(opts, "eviction"),
+                               BLOCKDEV_CACHE_EVICTION__MAX,
+                               BLOCKDEV_CACHE_EVICTION_ARC, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->cache = blkcache_get(id, size / BLKCACHE_BLOCK_SIZE, eviction);
+    ret = 0;
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    blkcache_put(s->cache);
+}
+
+static int blkcache_reopen_prepare(BDRVReopenState *reopen_state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static BlockDriver bdrv_blkcache = {
+    .format_name            = "blkcache",
+    .instance_size          = sizeof(BDRVBlkcacheState),
+
+    .bdrv_open              = blkcache_open,
+    .bdrv_close             = blkcache_close,
+    .bdrv_reopen_prepare    = blkcache_reopen_prepare,
+
+    .bdrv_co_readv          = blkcache_co_readv,
+    .bdrv_co_writev         = blkcache_co_writev,
+    .bdrv_co_write_zeroes   = blkcache_co_write_zeroes,
+    .bdrv_co_discard        = blkcache_co_discard,
+    .bdrv_co_get_block_status = blkcache_co_get_block_status,
+
+    .bdrv_truncate          = blkcache_truncate,
+    .bdrv_getlength         = blkcache_getlength,
+    .bdrv_get_info          = blkcache_get_info,
+    .bdrv_get_shared_cache_stats = blkcache_get_shared_cache_stats,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    qemu_mutex_init(&blkcache_lock);
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
@@ -0,0 +1,425 @@
+/*
+ * QEMU block layer copy-on-read prefetch
+ *
+ * With copy-on-read, every cluster that the guest reads for the first time
+ * costs a round trip to the backing file.  When the backing file is on slow
+ * storage, prefetching the data that the guest is likely to read next hides
+ * most of that latency: the prefetch engine watches the copy-on-read requests
+ * and copies neighbouring clusters into the image in the background.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "trace.h"
+#include "block/block_int.h"
+#include "block/cor-prefetch.h"
+#include "qemu/coroutine.h"
+#include "qemu/ratelimit.h"
+
+#define COR_PREFETCH_DEFAULT_WINDOW (1024 * 1024)
+
+/* Initial read-ahead window of a sequential stream */
+#define COR_PREFETCH_MIN_WINDOW     (64 * 1024)
+
+/* Maximum size of a single copy-on-read request issued by a worker */
+#define COR_PREFETCH_CHUNK          (64 * 1024)
+
+/* Maximum number of concurrent prefetch coroutines */
+#define COR_PREFETCH_MAX_WORKERS    4
+
+/* Number of sequential streams that are tracked at the same time */
+#define COR_PREFETCH_STREAMS        4
+
+/* Consecutive reads after which a stream is considered sequential */
+#define COR_PREFETCH_SEQ_THRESHOLD  2
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct CorPrefetchStream {
+    int64_t next;           /* offset at which the next read is expected */
+    int64_t prefetch_end;   /* end of the range handed to workers so far */
+    uint64_t window;        /* current read-ahead window, 0 if not started */
+    unsigned int seq_reads; /* number of consecutive reads in the stream */
+    uint64_t last_use;
+} CorPrefetchStream;
+
+typedef struct CorPrefetchPolicy {
+    /*
+     * Decides what to prefetch after a copy-on-read request of @bytes at
+     * @offset.  Returns true and stores the range in @pf_offset and @pf_bytes
+     * if something should be prefetched.
+     */
+    bool (*plan)(BdrvCorPrefetch *s, int64_t offset, unsigned int bytes,
+                 bool allocated, int64_t *pf_offset, int64_t *pf_bytes);
+} CorPrefetchPolicy;
+
+struct BdrvCorPrefetch {
+    BlockdevCorPrefetchPolicy policy_type;
+    const CorPrefetchPolicy *policy;
+    uint64_t max_window;
+
+    RateLimit limit;
+    bool limited;
+
+    CorPrefetchStream streams[COR_PREFETCH_STREAMS];
+    uint64_t use_counter;
+
+    /* Workers stop when the generation changes, see
+     * bdrv_cor_prefetch_cancel() */
+    uint64_t generation;
+    unsigned int workers;
+
+    /* Sectors that were prefetched and not read by the guest yet */
+    HBitmap *prefetched;
+    int64_t prefetched_sectors;
+
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+typedef struct CorPrefetchWorker {
+    BlockDriverState *bs;
+    BdrvCorPrefetch *s;
+    int64_t sector_num;
+    int64_t end;
+    uint64_t generation;
+} CorPrefetchWorker;
+
+/*
+ * Returns the stream that a read at @offset continues.  If there is none, the
+ * least recently used stream is restarted.
+ */
+static CorPrefetchStream *cor_prefetch_find_stream(BdrvCorPrefetch *s,
+                                                   int64_t offset)
+{
+    CorPrefetchStream *st, *lru = &s->streams[0];
+    int i;
+
+    for (i = 0; i < COR_PREFETCH_STREAMS; i++) {
+        st = &s->streams[i];
+        /* Skipping ahead within the prefetched range still counts as
+         * sequential */
+        if (st->seq_reads && offset >= st->next &&
+            offset <= MAX(st->next, st->prefetch_end)) {
+            return st;
+        }
+        if (st->last_use < lru->last_use) {
+            lru = st;
+        }
+    }
+
+    memset(lru, 0, sizeof(*lru));
+    return lru;
+}
+
+static bool cor_prefetch_plan_sequential(BdrvCorPrefetch *s, int64_t offset,
+                                         unsigned int bytes, bool allocated,
+                                         int64_t *pf_offset,
+                                         int64_t *pf_bytes)
+{
+    CorPrefetchStream *st = cor_prefetch_find_stream(s, offset);
+    int64_t start, end;
+
+    st->next = offset + bytes;
+    st->seq_reads++;
+    st->last_use = ++s->use_counter;
+
+    if (st->seq_reads < COR_PREFETCH_SEQ_THRESHOLD) {
+        return false;
+    }
+
+    if (!st->window) {
+        st->window = MIN(COR_PREFETCH_MIN_WINDOW, s->max_window);
+    }
+
+    /* Only top up the window once half of it has been consumed, so that the
+     * workers get reasonably large requests */
+    start = MAX(st->next, st->prefetch_end);
+    end = st->next + st->window;
+    if (end - start < st->window / 2) {
+        return false;
+    }
+
+    st->prefetch_end = end;
+    st->window = MIN(st->window * 2, s->max_window);
+
+    *pf_offset = start;
+    *pf_bytes = end - start;
+    return true;
+}
+
+static bool cor_prefetch_plan_adjacent(BdrvCorPrefetch *s, int64_t offset,
+                                       unsigned int bytes, bool allocated,
+                                       int64_t *pf_offset, int64_t *pf_bytes)
+{
+    if (allocated) {
+        return false;
+    }
+
+    *pf_offset = offset + bytes;
+    *pf_bytes = s->max_window;
+    return true;
+}
+
+static const CorPrefetchPolicy
+cor_prefetch_policies[BLOCKDEV_COR_PREFETCH_POLICY__MAX] = {
+    [BLOCKDEV_COR_PREFETCH_POLICY_SEQUENTIAL] = {
+        .plan = cor_prefetch_plan_sequential,
+    },
+    [BLOCKDEV_COR_PREFETCH_POLICY_ADJACENT] = {
+        .plan = cor_prefetch_plan_adjacent,
+    },
+};
+
+static void coroutine_fn cor_prefetch_worker(void *opaque)
+{
+    CorPrefetchWorker *w = opaque;
+    BlockDriverState *bs = w->bs;
+    BdrvCorPrefetch *s = w->s;
+    int64_t sector_num = w->sector_num;
+    uint64_t delay_ns = 0;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    void *buf;
+    int ret = 0;
+    int n;
+
+    buf = qemu_try_blockalign(bs, COR_PREFETCH_CHUNK);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (;;) {
+        if (delay_ns > 0) {
+            co_aio_sleep_ns(bdrv_get_aio_context(bs), QEMU_CLOCK_REALTIME,
+                            delay_ns);
+            delay_ns = 0;
+        }
+        if (sector_num >= w->end || w->generation != s->generation) {
+            break;
+        }
+
+        n = MIN(w->end - sector_num, COR_PREFETCH_CHUNK >> BDRV_SECTOR_BITS);
+        ret = bdrv_is_allocated(bs, sector_num, n, &n);
+        if (ret < 0) {
+            break;
+        } else if (ret) {
+            sector_num += n;
+            continue;
+        }
+
+        /* Don't allocate clusters for what is unallocated in the whole
+         * chain, reading it returns zeroes anyway */
+        ret = bdrv_is_allocated_above(backing_bs(bs), NULL, sector_num, n, &n);
+        if (ret < 0) {
+            break;
+        } else if (!ret) {
+            sector_num += n;
+            continue;
+        }
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        trace_cor_prefetch_copy(bs, sector_num, n);
+        ret = bdrv_co_prefetch_readv(bs, sector_num, n, &qiov);
+        if (ret < 0) {
+            break;
+        }
+
+        s->bytes += n * BDRV_SECTOR_SIZE;
+        if (sector_num < s->prefetched_sectors) {
+            hbitmap_set(s->prefetched, sector_num,
+                        MIN(n, s->prefetched_sectors - sector_num));
+        }
+        sector_num += n;
+
+        if (s->limited) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+        }
+    }
+
+out:
+    trace_cor_prefetch_worker_done(bs, w->sector_num, sector_num, ret);
+    qemu_vfree(buf);
+    s->workers--;
+    g_free(w);
+}
+
+/*
+ * Counts a guest copy-on-read request as a hit if it read data that was
+ * prefetched, or as a miss if it still had to go to the backing file.
+ */
+static void cor_prefetch_account(BdrvCorPrefetch *s, int64_t offset,
+                                 unsigned int bytes, bool allocated)
+{
+    int64_t sector_num = offset >> BDRV_SECTOR_BITS;
+    int64_t nb_sectors;
+    HBitmapIter hbi;
+    int64_t first;
+
+    if (!allocated) {
+        s->misses++;
+        return;
+    }
+
+    if (!s->prefetched || sector_num >= s->prefetched_sectors) {
+        return;
+    }
+    nb_sectors = MIN(bytes >> BDRV_SECTOR_BITS,
+                     s->prefetched_sectors - sector_num);
+
+    hbitmap_iter_init(&hbi, s->prefetched, sector_num);
+    first = hbitmap_iter_next(&hbi);
+    if (first >= 0 && first < sector_num + nb_sectors) {
+        s->hits++;
+        hbitmap_reset(s->prefetched, sector_num, nb_sectors);
+    }
+}
+
+void coroutine_fn bdrv_cor_prefetch_notify_read(BlockDriverState *bs,
+                                                int64_t offset,
+                                                unsigned int bytes,
+                                                bool allocated)
+{
+    BdrvCorPrefetch *s = bs->cor_prefetch;
+    CorPrefetchWorker *w;
+    Coroutine *co;
+    BlockDriverInfo bdi;
+    int64_t pf_offset, pf_bytes, pf_end, length;
+    int cluster_size;
+
+    if (!s) {
+        return;
+    }
+
+    cor_prefetch_account(s, offset, bytes, allocated);
+
+    if (!bs->backing) {
+        return;
+    }
+    if (!s->policy->plan(s, offset, bytes, allocated, &pf_offset, &pf_bytes)) {
+        return;
+    }
+
+    length = bdrv_getlength(bs);
+    if (length < 0) {
+        return;
+    }
+
+    /* The guest request already copied the whole cluster that it ends in */
+    if (bdrv_get_info(bs, &bdi) < 0 || bdi.cluster_size == 0) {
+        cluster_size = BDRV_SECTOR_SIZE;
+    } else {
+        cluster_size = bdi.cluster_size;
+    }
+    pf_end = MIN(QEMU_ALIGN_UP(pf_offset + pf_bytes, cluster_size), length);
+    pf_offset = QEMU_ALIGN_UP(pf_offset, cluster_size);
+    if (pf_offset >= pf_end) {
+        return;
+    }
+
+    if (s->workers >= COR_PREFETCH_MAX_WORKERS) {
+        trace_cor_prefetch_drop(bs, pf_offset, pf_end - pf_offset);
+        return;
+    }
+
+    if (!s->prefetched) {
+        int64_t cluster_sectors = cluster_size >> BDRV_SECTOR_BITS;
+
+        s->prefetched_sectors = length >> BDRV_SECTOR_BITS;
+        s->prefetched = hbitmap_alloc(s->prefetched_sectors,
+                                      ctz64(cluster_sectors));
+    }
+
+    trace_cor_prefetch_start(bs, offset, bytes, pf_offset,
+                             pf_end - pf_offset);
+
+    w = g_new(CorPrefetchWorker, 1);
+    *w = (CorPrefetchWorker) {
+        .bs         = bs,
+        .s          = s,
+        .sector_num = pf_offset >> BDRV_SECTOR_BITS,
+        .end        = pf_end >> BDRV_SECTOR_BITS,
+        .generation = s->generation,
+    };
+    s->workers++;
+
+    co = qemu_coroutine_create(cor_prefetch_worker);
+    qemu_coroutine_enter(co, w);
+}
+
+void bdrv_cor_prefetch_cancel(BlockDriverState *bs)
+{
+    BdrvCorPrefetch *s = bs->cor_prefetch;
+
+    if (s) {
+        s->generation++;
+    }
+}
+
+bool bdrv_cor_prefetch_pending(BlockDriverState *bs)
+{
+    return bs->cor_prefetch && bs->cor_prefetch->workers > 0;
+}
+
+BlockCorPrefetchStats *
+bdrv_cor_prefetch_query_stats(const BlockDriverState *bs)
+{
+    BdrvCorPrefetch *s = bs->cor_prefetch;
+    BlockCorPrefetchStats *stats = g_new0(BlockCorPrefetchStats, 1);
+
+    stats->policy = s->policy_type;
+    stats->prefetched_bytes = s->bytes;
+    stats->hits = s->hits;
+    stats->misses = s->misses;
+
+    return stats;
+}
+
+void bdrv_cor_prefetch_enable(BlockDriverState *bs,
+                              BlockdevCorPrefetchPolicy policy,
+                              uint64_t max_window, uint64_t speed)
+{
+    BdrvCorPrefetch *s;
+
+    assert(!bs->cor_prefetch);
+    if (policy == BLOCKDEV_COR_PREFETCH_POLICY_OFF) {
+        return;
+    }
+
+    s = g_new0(BdrvCorPrefetch, 1);
+    s->policy_type = policy;
+    s->policy = &cor_prefetch_policies[policy];
+    s->max_window = max_window ?: COR_PREFETCH_DEFAULT_WINDOW;
+    s->max_window = MAX(s->max_window, BDRV_SECTOR_SIZE);
+
+    if (speed) {
+        /* The limit counts sectors, like block jobs do */
+        ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+        s->limited = true;
+    }
+
+    bs->cor_prefetch = s;
+}
+
+void bdrv_cor_prefetch_disable(BlockDriverState *bs)
+{
+    BdrvCorPrefetch *s = bs->cor_prefetch;
+
+    if (!s) {
+        return;
+    }
+
+    assert(s->workers == 0);
+    if (s->prefetched) {
+        hbitmap_free(s->prefetched);
+    }
+    g_free(s);
+    bs->cor_prefetch = NULL;
+}
@@ -235,6 +235,9 @@ bool bdrv_requests_pending(BlockDriverState *bs)
     if (!qemu_co_queue_empty(&bs->throttled_reqs[1])) {
         return true;
     }
+    if (bdrv_cor_prefetch_pending(bs)) {
+        return true;
+    }
 
     QLIST_FOREACH(child, &bs->children, next) {
         if (bdrv_requests_pending(child->bs)) {
@@ -252,6 +255,8 @@ static void bdrv_drain_recurse(BlockDriverState *bs)
     if (bs->drv && bs->drv->bdrv_drain) {
         bs->drv->bdrv_drain(bs);
     }
+    /* Prefetching restarts with the next guest read */
+    bdrv_cor_prefetch_cancel(bs);
     QLIST_FOREACH(child, &bs->children, next) {
         bdrv_drain_recurse(child->bs);
     }
@@ -885,6 +890,11 @@ static int coroutine_fn bdrv_aligned_preadv(BlockDriverState *bs,
             goto out;
         }
 
+        if (!(flags & BDRV_REQ_PREFETCH)) {
+            bdrv_cor_prefetch_notify_read(bs, offset, bytes,
+                                          ret && pnum == nb_sectors);
+        }
+
         if (!ret || pnum != nb_sectors) {
             ret = bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors, qiov);
             goto out;
@@ -969,7 +979,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
     }
 
     /* throttling disk I/O */
-    if (bs->io_limits_enabled) {
+    if (bs->io_limits_enabled && !(flags & BDRV_REQ_PREFETCH)) {
         throttle_group_co_io_limits_intercept(bs, bytes, false);
     }
 
@@ -1051,6 +1061,15 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
                             BDRV_REQ_COPY_ON_READ);
 }
 
+int coroutine_fn bdrv_co_prefetch_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_prefetch_readv(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov,
+                            BDRV_REQ_COPY_ON_READ | BDRV_REQ_PREFETCH);
+}
+
 #define MAX_WRITE_ZEROES_BOUNCE_BUFFER 32768
 
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
@@ -0,0 +1,453 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+#include <liburing.h>
+#include <linux/falloc.h>
+
+/*
+ * Ring size (per AioContext).  Requests beyond this are queued until
+ * completions make room, so that the completion queue (twice as large) can
+ * never overflow.
+ */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    LuringState *s;
+    struct io_uring_sqe sqeq;
+    /* Slot in the ring while the kernel has not taken the request yet */
+    struct io_uring_sqe *sqe;
+    int type;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+
+    /* Short reads are resubmitted for the rest of the request */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    /* Requests that the kernel has not accepted yet */
+    unsigned int in_queue;
+    /* SQEs that the kernel accepted and has not completed yet */
+    unsigned int in_flight;
+    /* SQEs in the ring that the kernel has not accepted yet */
+    unsigned int in_ring;
+    /* Leading in_ring SQEs whose requests were failed, now no-ops */
+    unsigned int in_ring_cancelled;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+    /* Requests with an SQE in the ring, in submission order */
+    QSIMPLEQ_HEAD(, LuringAIOCB) ring_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+    struct io_uring ring;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing for nested event loops */
+    QEMUBH *completion_bh;
+
+    bool has_fallocate;
+};
+
+static void ioq_submit(LuringState *s);
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+/*
+ * Queues the rest of a request that the kernel completed only partially.
+ * Buffered reads may be short without having reached the end of the file.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    struct io_uring_sqe *sqe = &luringcb->sqeq;
+    size_t remaining;
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_reset(&luringcb->resubmit_qiov);
+    } else {
+        qemu_iovec_init(&luringcb->resubmit_qiov, luringcb->qiov->niov);
+    }
+    qemu_iovec_concat(&luringcb->resubmit_qiov, luringcb->qiov,
+                      luringcb->total_read, remaining);
+
+    sqe->addr = (uintptr_t)luringcb->resubmit_qiov.iov;
+    sqe->len = luringcb->resubmit_qiov.niov;
+    sqe->off += nread;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Completes a request (calls the callback and frees the ACB), unless it was
+ * a short read that needs to be resubmitted.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb)
+{
+    int ret = luringcb->ret;
+
+    trace_luring_process_completion(s, luringcb, ret);
+
+    if (luringcb->type == QEMU_AIO_READ ||
+        luringcb->type == QEMU_AIO_WRITE) {
+        if (ret >= 0 && luringcb->total_read + ret == luringcb->nbytes) {
+            ret = 0;
+        } else if (ret > 0 && luringcb->type == QEMU_AIO_READ) {
+            luring_resubmit_short_read(s, luringcb, ret);
+            return;
+        } else if (ret == 0 && luringcb->type == QEMU_AIO_READ) {
+            /* Reading beyond the end of the file, pad with zeros */
+            qemu_iovec_memset(luringcb->qiov, luringcb->total_read, 0,
+                              luringcb->qiov->size - luringcb->total_read);
+        } else if (ret >= 0) {
+            ret = -EINVAL;
+        }
+    } else if (ret > 0) {
+        ret = 0;
+    }
+
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+
+    luringcb->common.cb(luringcb->common.opaque, ret);
+    qemu_aio_unref(luringcb);
+}
+
+/*
+ * Fetches completed requests from the completion queue and invokes their
+ * callbacks.
+ *
+ * Callbacks may run a nested event loop (aio_poll()), so each completion is
+ * consumed before its callback is called and the BH is scheduled while we
+ * are processing, so that a nested event loop sees the remaining
+ * completions too.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+
+        /* No-ops left behind by ioq_cancel_ring() have no request */
+        if (!luringcb) {
+            continue;
+        }
+
+        luringcb->ret = cqe->res;
+        luring_process_completion(s, luringcb);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+
+    /* Completions made room for queued requests */
+    if (s->io_q.in_queue > 0 && (s->io_q.blocked || !s->io_q.plugged)) {
+        ioq_submit(s);
+    }
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions(s);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    QSIMPLEQ_INIT(&io_q->ring_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->in_ring = 0;
+    io_q->in_ring_cancelled = 0;
+    io_q->blocked = false;
+}
+
+/* Accounts for @n SQEs from the head of the ring that the kernel accepted */
+static void ioq_accept(LuringState *s, unsigned int n)
+{
+    unsigned int cancelled = MIN(n, s->io_q.in_ring_cancelled);
+
+    s->io_q.in_flight += n;
+    s->io_q.in_ring -= n;
+    s->io_q.in_ring_cancelled -= cancelled;
+    n -= cancelled;
+
+    s->io_q.in_queue -= n;
+    while (n--) {
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.ring_queue, next);
+    }
+}
+
+/*
+ * Fails the requests whose SQEs the kernel did not accept with @ret.  SQEs
+ * cannot be taken back from the ring, so they are turned into no-ops without
+ * a request.  The requests stay in ring_queue for the caller to complete.
+ */
+static void ioq_cancel_ring(LuringState *s, int ret)
+{
+    LuringAIOCB *luringcb;
+
+    QSIMPLEQ_FOREACH(luringcb, &s->io_q.ring_queue, next) {
+        io_uring_prep_nop(luringcb->sqe);
+        io_uring_sqe_set_data(luringcb->sqe, NULL);
+        s->io_q.in_ring_cancelled++;
+        s->io_q.in_queue--;
+        luringcb->ret = ret;
+    }
+}
+
+/*
+ * Moves as many queued requests as the ring has room for into the
+ * submission queue and submits them with a single system call.
+ *
+ * SQEs that the kernel does not accept stay in the ring and go with the next
+ * submission, which is retried when completions make room.  If submission
+ * fails for another reason, the requests in the ring fail with that error.
+ */
+static void ioq_submit(LuringState *s)
+{
+    QSIMPLEQ_HEAD(, LuringAIOCB) failed = QSIMPLEQ_HEAD_INITIALIZER(failed);
+    LuringAIOCB *luringcb;
+    int ret;
+
+    do {
+        while (s->io_q.in_flight + s->io_q.in_ring < MAX_ENTRIES &&
+               (luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue))) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+            *sqe = luringcb->sqeq;
+            io_uring_sqe_set_data(sqe, luringcb);
+            luringcb->sqe = sqe;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+            QSIMPLEQ_INSERT_TAIL(&s->io_q.ring_queue, luringcb, next);
+            s->io_q.in_ring++;
+        }
+        if (s->io_q.in_ring == 0) {
+            break;
+        }
+
+        do {
+            ret = io_uring_submit(&s->ring);
+        } while (ret == -EINTR);
+        trace_luring_io_uring_submit(s, s->io_q.in_ring, ret);
+
+        if (ret == -EAGAIN || ret == -EBUSY) {
+            break;
+        } else if (ret < 0) {
+            ioq_cancel_ring(s, ret);
+            QSIMPLEQ_CONCAT(&failed, &s->io_q.ring_queue);
+            break;
+        }
+        ioq_accept(s, ret);
+    } while (s->io_q.in_ring == 0 && !QSIMPLEQ_EMPTY(&s->io_q.submit_queue));
+
+    s->io_q.blocked = s->io_q.in_queue > 0;
+    if (s->io_q.blocked && s->io_q.in_flight == 0) {
+        /* No completion is going to retry, so do it from a BH */
+        qemu_bh_schedule(s->completion_bh);
+    }
+
+    /* Callbacks may submit new requests, so only call them at the end */
+    while ((luringcb = QSIMPLEQ_FIRST(&failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&failed, next);
+        luring_process_completion(s, luringcb);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s, bool unplug)
+{
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+/*
+ * Submits a request of the given QEMU_AIO_* type.  Write zeroes requests are
+ * implemented with fallocate(FALLOC_FL_ZERO_RANGE) and only supported for
+ * regular files.
+ *
+ * Returns NULL if the request type is not supported by the kernel, in which
+ * case the caller should use the thread pool instead.
+ */
+BlockAIOCB *luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringAIOCB *luringcb;
+    struct io_uring_sqe *sqe;
+    off_t offset = sector_num * BDRV_SECTOR_SIZE;
+    off_t len = (off_t)nb_sectors * BDRV_SECTOR_SIZE;
+
+    if (type == QEMU_AIO_WRITE_ZEROES && !s->has_fallocate) {
+        return NULL;
+    }
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->s = s;
+    luringcb->type = type;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->nbytes = len;
+    luringcb->qiov = qiov;
+    luringcb->total_read = 0;
+    memset(&luringcb->resubmit_qiov, 0, sizeof(luringcb->resubmit_qiov));
+
+    sqe = &luringcb->sqeq;
+    memset(sqe, 0, sizeof(*sqe));
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        break;
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    case QEMU_AIO_WRITE_ZEROES:
+        io_uring_prep_fallocate(sqe, fd, FALLOC_FL_ZERO_RANGE, offset, len);
+        break;
+#endif
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        qemu_aio_unref(luringcb);
+        return NULL;
+    }
+
+    trace_luring_submit(s, luringcb, fd, offset, len, type);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false,
+                       NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler_poll(s->aio_context, s->ring.ring_fd, false,
+                            qemu_luring_completion_cb, NULL,
+                            qemu_luring_poll_cb, s);
+}
+
+LuringState *luring_init(Error **errp)
+{
+    LuringState *s = g_new0(LuringState, 1);
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    struct io_uring_probe *probe;
+#endif
+    int rc;
+
+    rc = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    /* fallocate() needs Linux 5.6, everything else is older */
+    probe = io_uring_get_probe_ring(&s->ring);
+    if (probe) {
+        s->has_fallocate = io_uring_opcode_supported(probe,
+                                                     IORING_OP_FALLOCATE);
+        free(probe);
+    }
+#endif
+
+    ioq_init(&s->io_q);
+    trace_luring_init_state(s, MAX_ENTRIES);
+
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    trace_luring_cleanup_state(s);
+    g_free(s);
+}
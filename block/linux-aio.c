@@ -153,6 +153,40 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/*
+ * The io_context_t returned by io_setup() points to the completion ring,
+ * which the kernel maps into our address space.  This is its header; the
+ * ring can only be read directly if the magic number matches.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+/* Checks the completion ring without a system call while aio_poll() polls */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (ring->magic != AIO_RING_MAGIC ||
+        atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+        return false;
+    }
+
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -297,8 +331,9 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
     struct qemu_laio_state *s = s_;
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
-    aio_set_event_notifier(new_context, &s->e, false,
-                           qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, false,
+                                qemu_laio_completion_cb,
+                                qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
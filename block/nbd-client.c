@@ -32,7 +32,7 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+static void nbd_recv_coroutines_enter_all(NbdConnection *s)
 {
     int i;
 
@@ -43,31 +43,29 @@ static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NbdConnection *s)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
-
-    if (!client->ioc) { /* Already closed */
+    if (!s->ioc) { /* Already closed */
         return;
     }
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(client->ioc,
+    qio_channel_shutdown(s->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    nbd_recv_coroutines_enter_all(client);
-
-    nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(client->sioc));
-    client->sioc = NULL;
-    object_unref(OBJECT(client->ioc));
-    client->ioc = NULL;
+    nbd_recv_coroutines_enter_all(s);
+
+    aio_set_fd_handler(bdrv_get_aio_context(s->session->bs),
+                       s->sioc->fd, false, NULL, NULL, NULL);
+    object_unref(OBJECT(s->sioc));
+    s->sioc = NULL;
+    object_unref(OBJECT(s->ioc));
+    s->ioc = NULL;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdConnection *s = opaque;
     uint64_t i;
     int ret;
 
@@ -104,21 +102,20 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(s->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdConnection *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
@@ -141,10 +138,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
     }
 
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->session->bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -160,13 +157,130 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static int nbd_co_read_payload(NbdConnection *s, void *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    if (nbd_wr_syncv(s->ioc, &iov, 1, 0, len, true) != len) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Consume the payload of the structured reply chunk whose header is in
+ * s->reply.  Data and holes land in @qiov, an error chunk sets
+ * reply->error.  Returns -EIO if the chunk is malformed or the read fails;
+ * the stream cannot be trusted after that.
+ */
+static int nbd_co_receive_chunk(NbdConnection *s,
+    struct nbd_request *request, struct nbd_reply *reply,
+    QEMUIOVector *qiov, int offset)
+{
+    struct nbd_reply *chunk = &s->reply;
+    uint8_t buf[64];
+    uint64_t from;
+    uint32_t len, error;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (chunk->length || !(chunk->flags & NBD_REPLY_FLAG_DONE)) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || chunk->length < 8 ||
+            nbd_co_read_payload(s, buf, 8) < 0) {
+            return -EIO;
+        }
+        from = ldq_be_p(buf);
+        len = chunk->length - 8;
+        if (from < request->from ||
+            from + len > request->from + request->len) {
+            return -EIO;
+        }
+        if (nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                         offset + from - request->from, len, true) != len) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length != 12 ||
+            nbd_co_read_payload(s, buf, 12) < 0) {
+            return -EIO;
+        }
+        from = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (from < request->from ||
+            from + len > request->from + request->len) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset + from - request->from, 0, len);
+        return 0;
+
+    default:
+        if (!(chunk->type & NBD_REPLY_ERR(0)) || chunk->length < 6 ||
+            nbd_co_read_payload(s, buf, 6) < 0) {
+            return -EIO;
+        }
+        error = nbd_errno_to_system_errno(ldl_be_p(buf));
+        if (!reply->error) {
+            reply->error = error ? error : EIO;
+        }
+        /* Skip the message and, for ERROR_OFFSET, the offset */
+        len = chunk->length - 6;
+        while (len) {
+            uint32_t n = MIN(len, sizeof(buf));
+            if (nbd_co_read_payload(s, buf, n) < 0) {
+                return -EIO;
+            }
+            len -= n;
+        }
+        return 0;
+    }
+}
+
+static void nbd_co_receive_chunks(NbdConnection *s,
+    struct nbd_request *request, struct nbd_reply *reply,
+    QEMUIOVector *qiov, int offset)
+{
+    bool done;
+
+    reply->error = 0;
+    for (;;) {
+        if (s->reply.magic != NBD_STRUCTURED_REPLY_MAGIC ||
+            nbd_co_receive_chunk(s, request, reply, qiov, offset) < 0) {
+            /* We lost track of the stream, drop the connection */
+            reply->error = EIO;
+            qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            s->reply.handle = 0;
+            return;
+        }
+        done = s->reply.flags & NBD_REPLY_FLAG_DONE;
+
+        /* Tell the read handler to read another header.  Chunks of
+         * other requests may come before our next one.  */
+        s->reply.handle = 0;
+        if (done) {
+            return;
+        }
+
+        qemu_coroutine_yield();
+        if (s->reply.handle != request->handle || !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
+    }
+}
+
+static void nbd_co_receive_reply(NbdConnection *s,
     struct nbd_request *request, struct nbd_reply *reply,
     QEMUIOVector *qiov, int offset)
 {
@@ -179,6 +293,8 @@ static void nbd_co_receive_reply(NbdClientSession *s,
     if (reply->handle != request->handle ||
         !s->ioc) {
         reply->error = EIO;
+    } else if (reply->magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        nbd_co_receive_chunks(s, request, reply, qiov, offset);
     } else {
         if (qiov && reply->error == 0) {
             ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
@@ -193,7 +309,7 @@ static void nbd_co_receive_reply(NbdClientSession *s,
     }
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+static void nbd_coroutine_start(NbdConnection *s,
    struct nbd_request *request)
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
@@ -207,7 +323,7 @@ static void nbd_coroutine_start(NbdClientSession *s,
     /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdConnection *s,
     struct nbd_request *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
@@ -217,11 +333,32 @@ static void nbd_coroutine_end(NbdClientSession *s,
     }
 }
 
+/* Pick the connection with the fewest requests in flight.  The scan starts
+ * at a rotating position so that idle connections are used in turn.
+ */
+static NbdConnection *nbd_pick_connection(NbdClientSession *client)
+{
+    NbdConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < client->num_conn; i++) {
+        NbdConnection *s = &client->conn[(client->next_conn + i) %
+                                         client->num_conn];
+        if (s->ioc && (!best || s->in_flight < best->in_flight)) {
+            best = s;
+        }
+    }
+    client->next_conn++;
+
+    /* If everything is closed, let the send path report the error */
+    return best ? best : &client->conn[0];
+}
+
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors, QEMUIOVector *qiov,
                           int offset)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *s = nbd_pick_connection(nbd_get_client_session(bs));
     struct nbd_request request = { .type = NBD_CMD_READ };
     struct nbd_reply reply;
     ssize_t ret;
@@ -229,14 +366,14 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(s, &request);
     return -reply.error;
 
 }
@@ -246,6 +383,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *s = nbd_pick_connection(client);
     struct nbd_request request = { .type = NBD_CMD_WRITE };
     struct nbd_reply reply;
     ssize_t ret;
@@ -258,14 +396,14 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(s, &request);
     return -reply.error;
 }
 
@@ -273,43 +411,158 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
  * remain aligned to 4K. */
 #define NBD_MAX_SECTORS 2040
 
-int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
-                        int nb_sectors, QEMUIOVector *qiov)
+/* With several connections, a large request is cut into NBD_MAX_SECTORS
+ * stripes that are sent in parallel, one coroutine each.  The request
+ * completes when its last stripe has.
+ */
+typedef struct NbdStripedRequest {
+    BlockDriverState *bs;
+    Coroutine *co;
+    QEMUIOVector *qiov;
+    bool is_write;
+    int pending;
+    int ret;
+} NbdStripedRequest;
+
+typedef struct NbdStripe {
+    NbdStripedRequest *req;
+    int64_t sector_num;
+    int nb_sectors;
+    int offset;
+} NbdStripe;
+
+static void coroutine_fn nbd_co_stripe_entry(void *opaque)
+{
+    NbdStripe *stripe = opaque;
+    NbdStripedRequest *req = stripe->req;
+    int ret;
+
+    if (req->is_write) {
+        ret = nbd_co_writev_1(req->bs, stripe->sector_num, stripe->nb_sectors,
+                              req->qiov, stripe->offset);
+    } else {
+        ret = nbd_co_readv_1(req->bs, stripe->sector_num, stripe->nb_sectors,
+                             req->qiov, stripe->offset);
+    }
+    if (ret < 0 && req->ret == 0) {
+        req->ret = ret;
+    }
+    g_free(stripe);
+
+    if (--req->pending == 0) {
+        qemu_coroutine_enter(req->co, NULL);
+    }
+}
+
+static int nbd_co_rw(BlockDriverState *bs, int64_t sector_num,
+                     int nb_sectors, QEMUIOVector *qiov, bool is_write)
 {
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdStripedRequest req = {
+        .bs = bs,
+        .co = qemu_coroutine_self(),
+        .qiov = qiov,
+        .is_write = is_write,
+        .pending = 1,
+    };
     int offset = 0;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
+
+    if (client->num_conn == 1) {
+        while (nb_sectors > NBD_MAX_SECTORS) {
+            ret = is_write ?
+                  nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS,
+                                  qiov, offset) :
+                  nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS,
+                                 qiov, offset);
+            if (ret < 0) {
+                return ret;
+            }
+            offset += NBD_MAX_SECTORS * 512;
+            sector_num += NBD_MAX_SECTORS;
+            nb_sectors -= NBD_MAX_SECTORS;
         }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+        return is_write ?
+               nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset) :
+               nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    while (nb_sectors > 0) {
+        NbdStripe *stripe = g_new(NbdStripe, 1);
+        int n = MIN(nb_sectors, NBD_MAX_SECTORS);
+
+        stripe->req = &req;
+        stripe->sector_num = sector_num;
+        stripe->nb_sectors = n;
+        stripe->offset = offset;
+        req.pending++;
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_co_stripe_entry),
+                             stripe);
+
+        offset += n * 512;
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    /* Drop our own reference; the last stripe to finish wakes us up */
+    if (--req.pending > 0) {
+        qemu_coroutine_yield();
+    }
+    return req.ret;
+}
+
+int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, false);
 }
 
 int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, true);
+}
+
+int nbd_client_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors, BdrvRequestFlags flags)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *s = nbd_pick_connection(client);
+    struct nbd_request request = { .type = NBD_CMD_WRITE_ZEROES };
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    if (!(client->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES)) {
+        return -ENOTSUP;
     }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    if (!bdrv_enable_write_cache(bs) &&
+        (client->nbdflags & NBD_FLAG_SEND_FUA)) {
+        request.type |= NBD_CMD_FLAG_FUA;
+    }
+    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+        request.type |= NBD_CMD_FLAG_NO_HOLE;
+    }
+
+    /* max_write_zeroes allows requests of up to 4 GB, past INT_MAX */
+    request.from = sector_num * 512;
+    request.len = (uint32_t)nb_sectors << BDRV_SECTOR_BITS;
+
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+    }
+    nbd_coroutine_end(s, &request);
+    return -reply.error;
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *s;
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
     ssize_t ret;
@@ -325,14 +578,18 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    /* Extra connections are only opened against servers that advertise
+     * NBD_FLAG_CAN_MULTI_CONN, where a flush on any connection covers the
+     * writes completed on all of them.  */
+    s = nbd_pick_connection(client);
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(s, &request);
     return -reply.error;
 }
 
@@ -340,6 +597,7 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *s;
     struct nbd_request request = { .type = NBD_CMD_TRIM };
     struct nbd_reply reply;
     ssize_t ret;
@@ -350,30 +608,46 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    s = nbd_pick_connection(client);
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(s, &request);
     return -reply.error;
 
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conn; i++) {
+        if (client->conn[i].sioc) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs),
+                               client->conn[i].sioc->fd,
+                               false, NULL, NULL, NULL);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conn; i++) {
+        if (client->conn[i].sioc) {
+            aio_set_fd_handler(new_context, client->conn[i].sioc->fd,
+                               false, nbd_reply_ready, NULL,
+                               &client->conn[i]);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -384,14 +658,45 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
+    for (i = 0; i < client->num_conn; i++) {
+        NbdConnection *s = &client->conn[i];
+
+        if (s->ioc == NULL) {
+            continue;
+        }
+
+        nbd_send_request(s->ioc, &request);
+
+        nbd_teardown_connection(s);
+    }
+}
+
+/* Take over a negotiated socket as connection @s and start reading
+ * replies from it.  @ioc is the TLS channel on top of @sioc, if any.
+ */
+static void nbd_connection_start(NbdClientSession *client, NbdConnection *s,
+                                 QIOChannelSocket *sioc, QIOChannel *ioc)
+{
+    s->session = client;
+    qemu_co_mutex_init(&s->send_mutex);
+    qemu_co_mutex_init(&s->free_sema);
+    s->sioc = sioc;
+    object_ref(OBJECT(s->sioc));
+
+    s->ioc = ioc;
+    if (!s->ioc) {
+        s->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(s->ioc));
     }
 
-    nbd_send_request(client->ioc, &request);
+    /* Now that we're connected, set the socket to be non-blocking and
+     * kick the reply mechanism.  */
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
 
-    nbd_teardown_connection(bs);
+    aio_set_fd_handler(bdrv_get_aio_context(client->bs), sioc->fd,
+                       false, nbd_reply_ready, NULL, s);
 }
 
 int nbd_client_init(BlockDriverState *bs,
@@ -402,6 +707,7 @@ int nbd_client_init(BlockDriverState *bs,
                     Error **errp)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    QIOChannel *ioc;
     int ret;
 
     /* NBD handshake */
@@ -410,30 +716,71 @@ int nbd_client_init(BlockDriverState *bs,
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
                                 &client->nbdflags,
+                                &client->structured_reply,
                                 tlscreds, hostname,
-                                &client->ioc,
+                                &ioc,
                                 &client->size, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
+    client->bs = bs;
+    client->num_conn = 1;
+    nbd_connection_start(client, &client->conn[0], sioc, ioc);
 
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
+    logout("Established connection with NBD server%s\n",
+           client->structured_reply ? " (structured replies)" : "");
+    return 0;
+}
+
+/* Open one more connection to the export set up by nbd_client_init.
+ * Only valid if the server advertised NBD_FLAG_CAN_MULTI_CONN.
+ */
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    QIOChannel *ioc;
+    uint32_t nbdflags;
+    bool structured_reply;
+    off_t size;
+    int ret;
+
+    if (!(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        error_setg(errp, "NBD server does not allow multiple connections");
+        return -ENOTSUP;
+    }
+    if (client->num_conn == MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "Too many connections to the NBD server");
+        return -EINVAL;
     }
 
-    /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
-    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
+    logout("adding connection %d\n", client->num_conn);
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
+
+    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export, &nbdflags,
+                                &structured_reply, tlscreds, hostname,
+                                &ioc, &size, errp);
+    if (ret < 0) {
+        logout("Failed to negotiate with the NBD server\n");
+        return ret;
+    }
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    if (nbdflags != client->nbdflags || size != client->size ||
+        structured_reply != client->structured_reply) {
+        error_setg(errp, "NBD export changed between connections");
+        if (ioc) {
+            object_unref(OBJECT(ioc));
+        }
+        return -EINVAL;
+    }
 
-    logout("Established connection with NBD server\n");
+    nbd_connection_start(client, &client->conn[client->num_conn++],
+                         sioc, ioc);
     return 0;
 }
@@ -16,12 +16,15 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
-typedef struct NbdClientSession {
+typedef struct NbdClientSession NbdClientSession;
+
+/* One socket to the server, carrying up to MAX_NBD_REQUESTS requests */
+typedef struct NbdConnection {
+    NbdClientSession *session;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    uint32_t nbdflags;
-    off_t size;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -30,9 +33,21 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NbdConnection;
+
+struct NbdClientSession {
+    BlockDriverState *bs;
+    uint32_t nbdflags;
+    bool structured_reply;
+    off_t size;
+
+    /* Requests are spread over all connections when the server allows it */
+    NbdConnection conn[MAX_NBD_CONNECTIONS];
+    int num_conn;
+    unsigned int next_conn;
 
     bool is_unix;
-} NbdClientSession;
+};
 
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
 
@@ -42,6 +57,12 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sock,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -49,6 +70,8 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
 int nbd_client_co_flush(BlockDriverState *bs);
 int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov);
+int nbd_client_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors, BdrvRequestFlags flags);
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov);
 
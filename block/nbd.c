@@ -39,6 +39,20 @@
 
 #define EN_OPTSTR ":exportname="
 
+static QemuOptsList nbd_runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(nbd_runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server (if it allows "
+                    "more than one)",
+        },
+        { /* end of list */ }
+    },
+};
+
 typedef struct BDRVNBDState {
     NbdClientSession client;
 } BDRVNBDState;
@@ -301,7 +315,26 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     const char *tlscredsid;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int64_t connections;
     int ret = -EINVAL;
+    int i;
+
+    opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    qemu_opts_del(opts);
+    if (connections < 1 || connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        return -EINVAL;
+    }
 
     /* Pop the config into our state object. Exit if invalid. */
     saddr = nbd_config(s, options, &export, errp);
@@ -336,6 +369,23 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, export,
                           tlscreds, hostname, errp);
+
+    /* Servers that don't allow several connections get just the one */
+    for (i = 1; ret == 0 && i < connections &&
+         (s->client.nbdflags & NBD_FLAG_CAN_MULTI_CONN); i++) {
+        QIOChannelSocket *extra = nbd_establish_connection(saddr, errp);
+
+        if (!extra) {
+            ret = -ECONNREFUSED;
+        } else {
+            ret = nbd_client_add_connection(bs, extra, export,
+                                            tlscreds, hostname, errp);
+            object_unref(OBJECT(extra));
+        }
+        if (ret < 0) {
+            nbd_client_close(bs);
+        }
+    }
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -360,6 +410,12 @@ static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
     return nbd_client_co_writev(bs, sector_num, nb_sectors, qiov);
 }
 
+static int nbd_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors, BdrvRequestFlags flags)
+{
+    return nbd_client_co_write_zeroes(bs, sector_num, nb_sectors, flags);
+}
+
 static int nbd_co_flush(BlockDriverState *bs)
 {
     return nbd_client_co_flush(bs);
@@ -369,6 +425,7 @@ static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     bs->bl.max_discard = UINT32_MAX >> BDRV_SECTOR_BITS;
     bs->bl.max_transfer_length = UINT32_MAX >> BDRV_SECTOR_BITS;
+    bs->bl.max_write_zeroes = UINT32_MAX >> BDRV_SECTOR_BITS;
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -408,6 +465,7 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     const char *port   = qdict_get_try_str(options, "port");
     const char *export = qdict_get_try_str(options, "export");
     const char *tlscreds = qdict_get_try_str(options, "tls-creds");
+    QObject *connections = qdict_get(options, "connections");
 
     qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("nbd")));
 
@@ -445,6 +503,10 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (tlscreds) {
         qdict_put_obj(opts, "tls-creds", QOBJECT(qstring_from_str(tlscreds)));
     }
+    if (connections) {
+        qobject_incref(connections);
+        qdict_put_obj(opts, "connections", connections);
+    }
 
     bs->full_open_options = opts;
 }
@@ -457,6 +519,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_file_open             = nbd_open,
     .bdrv_co_readv              = nbd_co_readv,
     .bdrv_co_writev             = nbd_co_writev,
+    .bdrv_co_write_zeroes       = nbd_co_write_zeroes,
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
@@ -475,6 +538,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_file_open             = nbd_open,
     .bdrv_co_readv              = nbd_co_readv,
     .bdrv_co_writev             = nbd_co_writev,
+    .bdrv_co_write_zeroes       = nbd_co_write_zeroes,
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
@@ -493,6 +557,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_file_open             = nbd_open,
     .bdrv_co_readv              = nbd_co_readv,
     .bdrv_co_writev             = nbd_co_writev,
+    .bdrv_co_write_zeroes       = nbd_co_write_zeroes,
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
@@ -355,8 +355,31 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
+static BlockLatencyHistogramInfo *
+bdrv_query_latency_histogram(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    BlockLatencyHistogramInfo *info = g_new0(BlockLatencyHistogramInfo, 1);
+    intList **p_boundary = &info->boundaries;
+    intList **p_bin = &info->bins;
+    unsigned i;
+
+    for (i = 0; i < stats->histogram_nb_buckets; i++) {
+        if (i > 0) {
+            *p_boundary = g_new0(intList, 1);
+            (*p_boundary)->value = block_acct_histogram_boundary(stats, i);
+            p_boundary = &(*p_boundary)->next;
+        }
+
+        *p_bin = g_new0(intList, 1);
+        (*p_bin)->value = stats->histogram[type][i];
+        p_bin = &(*p_bin)->next;
+    }
+
+    return info;
+}
+
 static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
-                                    bool query_backing)
+                                    bool query_backing, bool reset_histograms)
 {
     BlockStats *s;
 
@@ -437,18 +460,46 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
             dev_stats->avg_wr_queue_depth =
                 block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
         }
+
+        if (stats->histogram_nb_buckets) {
+            s->stats->has_rd_latency_histogram = true;
+            s->stats->rd_latency_histogram =
+                bdrv_query_latency_histogram(stats, BLOCK_ACCT_READ);
+            s->stats->has_wr_latency_histogram = true;
+            s->stats->wr_latency_histogram =
+                bdrv_query_latency_histogram(stats, BLOCK_ACCT_WRITE);
+            s->stats->has_flush_latency_histogram = true;
+            s->stats->flush_latency_histogram =
+                bdrv_query_latency_histogram(stats, BLOCK_ACCT_FLUSH);
+
+            if (reset_histograms) {
+                block_acct_reset_histograms(stats);
+            }
+        }
     }
 
     s->stats->wr_highest_offset = bs->wr_highest_offset;
 
     if (bs->file) {
         s->has_parent = true;
-        s->parent = bdrv_query_stats(bs->file->bs, query_backing);
+        s->parent = bdrv_query_stats(bs->file->bs, query_backing,
+                                     reset_histograms);
+    }
+
+    if (bs->cor_prefetch) {
+        s->stats->has_cor_prefetch = true;
+        s->stats->cor_prefetch = bdrv_cor_prefetch_query_stats(bs);
+    }
+
+    if (bs->drv && bs->drv->bdrv_get_shared_cache_stats) {
+        s->stats->has_shared_cache = true;
+        s->stats->shared_cache = bs->drv->bdrv_get_shared_cache_stats(bs);
     }
 
     if (query_backing && bs->backing) {
         s->has_backing = true;
-        s->backing = bdrv_query_stats(bs->backing->bs, query_backing);
+        s->backing = bdrv_query_stats(bs->backing->bs, query_backing,
+                                      reset_histograms);
     }
 
     return s;
@@ -479,6 +530,8 @@ BlockInfoList *qmp_query_block(Error **errp)
 
 BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
                                      bool query_nodes,
+                                     bool has_reset_histograms,
+                                     bool reset_histograms,
                                      Error **errp)
 {
     BlockStatsList *head = NULL, **p_next = &head;
@@ -486,13 +539,14 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
 
     /* Just to be safe if query_nodes is not always initialized */
     query_nodes = has_query_nodes && query_nodes;
+    reset_histograms = has_reset_histograms && reset_histograms;
 
     while ((bs = query_nodes ? bdrv_next_node(bs) : bdrv_next(bs))) {
         BlockStatsList *info = g_malloc0(sizeof(*info));
         AioContext *ctx = bdrv_get_aio_context(bs);
 
         aio_context_acquire(ctx);
-        info->value = bdrv_query_stats(bs, !query_nodes);
+        info->value = bdrv_query_stats(bs, !query_nodes, reset_histograms);
         aio_context_release(ctx);
 
         *p_next = info;
@@ -0,0 +1,1148 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/hbitmap.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+/*
+ * The on-disk format is described in docs/specs/qcow2.txt.
+ *
+ * Bitmaps are kept in memory while the image is open and only written back
+ * when it is closed (or inactivated for migration). While they are loaded,
+ * their directory entries carry the in_use flag, so that after a crash they
+ * are recognised as inconsistent and dropped.
+ */
+
+/* Bitmap directory entry flags */
+#define BME_FLAG_IN_USE                 (1U << 0)
+#define BME_FLAG_AUTO                   (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPATIBLE  (1U << 2)
+#define BME_RESERVED_FLAGS              0xfffffff8U
+
+/* Limits of what QEMU supports, the format allows more */
+#define BME_MAX_NAME_SIZE           1023
+#define BME_MIN_GRANULARITY_BITS    9
+#define BME_MAX_GRANULARITY_BITS    31
+#define BME_MAX_TABLE_SIZE          0x8000000
+
+/* Bitmap types */
+#define BME_TYPE_DIRTY_TRACKING     1
+
+/* Bitmap table entries */
+#define BME_TABLE_ENTRY_RESERVED_MASK   0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK     0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES   (1ULL << 0)
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows */
+    /* name follows */
+} Qcow2BitmapDirEntry;
+
+typedef struct Qcow2BitmapTable {
+    uint64_t offset;
+    uint32_t size;  /* number of 64 bit entries */
+} Qcow2BitmapTable;
+
+typedef struct Qcow2Bitmap {
+    Qcow2BitmapTable table;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    char *name;
+
+    /* Unknown to QEMU, but kept when the directory is rewritten */
+    uint32_t extra_data_size;
+    uint8_t *extra_data;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static inline uint32_t calc_dir_entry_size(size_t name_size,
+                                           size_t extra_data_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) + name_size +
+                        extra_data_size, 8);
+}
+
+/* Number of sectors covered by one bit of the bitmap */
+static inline uint64_t sectors_per_bit(uint8_t granularity_bits)
+{
+    return 1ULL << (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+/* Number of bitmap table entries needed for a bitmap of @bs */
+static uint64_t bitmap_table_size(BlockDriverState *bs,
+                                  uint8_t granularity_bits)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_bits = DIV_ROUND_UP(bs->total_sectors,
+                                    sectors_per_bit(granularity_bits));
+
+    return DIV_ROUND_UP(DIV_ROUND_UP(nb_bits, 8), s->cluster_size);
+}
+
+static void bitmap_free(Qcow2Bitmap *bm)
+{
+    g_free(bm->name);
+    g_free(bm->extra_data);
+    g_free(bm);
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (bm_list == NULL) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        bitmap_free(bm);
+    }
+
+    g_free(bm_list);
+}
+
+static Qcow2BitmapList *bitmap_list_new(void)
+{
+    Qcow2BitmapList *bm_list = g_new(Qcow2BitmapList, 1);
+
+    QSIMPLEQ_INIT(bm_list);
+    return bm_list;
+}
+
+static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
+                                        const char *name)
+{
+    Qcow2Bitmap *bm;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (!strcmp(bm->name, name)) {
+            return bm;
+        }
+    }
+
+    return NULL;
+}
+
+/* Whether QEMU can use the bitmap, rather than just keep it in the image */
+static bool bitmap_is_usable(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    if (bm->type != BME_TYPE_DIRTY_TRACKING ||
+        bm->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        bm->granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        return false;
+    }
+
+    if (bm->extra_data_size && !(bm->flags & BME_FLAG_EXTRA_DATA_COMPATIBLE)) {
+        return false;
+    }
+
+    /* The image may have been resized by a program that does not know about
+     * bitmaps */
+    return bm->table.size == bitmap_table_size(bs, bm->granularity_bits);
+}
+
+static int check_table_entry(BDRVQcow2State *s, uint64_t entry)
+{
+    uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+    if (entry & BME_TABLE_ENTRY_RESERVED_MASK) {
+        return -EINVAL;
+    }
+
+    if (offset != 0) {
+        if ((entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) ||
+            offset_into_cluster(s, offset))
+        {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the bitmap table described by @tb into a newly allocated array of
+ * host endian entries.
+ */
+static int bitmap_table_load(BlockDriverState *bs, Qcow2BitmapTable *tb,
+                             uint64_t **table)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *t;
+    uint32_t i;
+    int ret;
+
+    assert(tb->size != 0);
+    t = g_try_new(uint64_t, tb->size);
+    if (t == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, tb->offset, t, tb->size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < tb->size; i++) {
+        be64_to_cpus(&t[i]);
+        ret = check_table_entry(s, t[i]);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    *table = t;
+    return 0;
+
+fail:
+    g_free(t);
+    return ret;
+}
+
+/* Frees the data clusters referenced by @table */
+static void clear_bitmap_table(BlockDriverState *bs, uint64_t *table,
+                               uint32_t size, enum qcow2_discard_type type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < size; i++) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset) {
+            qcow2_free_clusters(bs, offset, s->cluster_size, type);
+        }
+        table[i] = 0;
+    }
+}
+
+/* Frees all clusters of a stored bitmap: its data and its table */
+static void free_bitmap_clusters(BlockDriverState *bs, Qcow2BitmapTable *tb)
+{
+    uint64_t *table;
+    int ret;
+
+    if (tb->offset == 0) {
+        return;
+    }
+
+    ret = bitmap_table_load(bs, tb, &table);
+    if (ret < 0) {
+        /* Leaks the data clusters, qemu-img check can reclaim them */
+        error_report("Could not read bitmap table: %s", strerror(-ret));
+    } else {
+        clear_bitmap_table(bs, table, tb->size, QCOW2_DISCARD_OTHER);
+        g_free(table);
+    }
+
+    qcow2_free_clusters(bs, tb->offset, tb->size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+    tb->offset = 0;
+    tb->size = 0;
+}
+
+/* Sets @nb_bits bits of @bitmap starting at @bit */
+static void set_dirty_bits(BdrvDirtyBitmap *bitmap, uint64_t spb,
+                           int64_t total_sectors, uint64_t bit,
+                           uint64_t nb_bits)
+{
+    int64_t sector = bit * spb;
+    int64_t end = MIN((bit + nb_bits) * spb, total_sectors);
+
+    while (sector < end) {
+        int n = MIN(end - sector, BDRV_REQUEST_MAX_SECTORS);
+
+        bdrv_set_dirty_bitmap(bitmap, sector, n);
+        sector += n;
+    }
+}
+
+/*
+ * Reads the bitmap data into @bitmap. Bits are counted from the least
+ * significant bit of each byte. Runs of set bits are passed to the
+ * HBitmap as a whole, and zero bytes are skipped without looking at
+ * single bits.
+ */
+static int load_bitmap_data(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t spb = sectors_per_bit(bm->granularity_bits);
+    uint64_t nb_bits = DIV_ROUND_UP(bs->total_sectors, spb);
+    uint64_t bits_per_cluster = (uint64_t)s->cluster_size * 8;
+    uint64_t *table;
+    uint8_t *buf = NULL;
+    uint32_t i;
+    int ret;
+
+    ret = bitmap_table_load(bs, &bm->table, &table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0; i < bm->table.size; i++) {
+        uint64_t first_bit = i * bits_per_cluster;
+        uint64_t count = MIN(bits_per_cluster, nb_bits - first_bit);
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        uint64_t j, start;
+
+        if (offset == 0) {
+            if (table[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+                set_dirty_bits(bitmap, spb, bs->total_sectors,
+                               first_bit, count);
+            }
+            continue;
+        }
+
+        ret = bdrv_pread(bs->file->bs, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        j = 0;
+        while (j < count) {
+            if (!(j & 7) && buf[j >> 3] == 0) {
+                j += 8;
+                continue;
+            }
+            if (!(buf[j >> 3] & (1 << (j & 7)))) {
+                j++;
+                continue;
+            }
+
+            start = j;
+            while (j < count && (buf[j >> 3] & (1 << (j & 7)))) {
+                j++;
+            }
+            set_dirty_bits(bitmap, spb, bs->total_sectors,
+                           first_bit + start, j - start);
+        }
+    }
+    ret = 0;
+
+fail:
+    g_free(buf);
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Writes the data of @bitmap into newly allocated clusters and returns the
+ * bitmap table (in host endianness) through @table. Clusters without any set
+ * bit are not allocated.
+ */
+static int store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             uint8_t granularity_bits, uint64_t **table,
+                             uint32_t *table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t spb = sectors_per_bit(granularity_bits);
+    uint64_t bits_per_cluster = (uint64_t)s->cluster_size * 8;
+    uint64_t tb_size = bitmap_table_size(bs, granularity_bits);
+    struct HBitmapIter hbi;
+    int64_t sector;
+    uint64_t *tb;
+    uint8_t *buf;
+    uint64_t i;
+    int ret;
+
+    if (tb_size > BME_MAX_TABLE_SIZE) {
+        return -EFBIG;
+    }
+
+    tb = g_try_new0(uint64_t, tb_size);
+    if (tb == NULL) {
+        return -ENOMEM;
+    }
+    buf = g_malloc(s->cluster_size);
+
+    bdrv_dirty_iter_init(bitmap, &hbi);
+    sector = hbitmap_iter_next(&hbi);
+
+    for (i = 0; i < tb_size; i++) {
+        uint64_t first_bit = i * bits_per_cluster;
+        uint64_t end_bit = first_bit + bits_per_cluster;
+        int64_t offset;
+
+        if (sector < 0 || sector / spb >= end_bit) {
+            /* Nothing set in this cluster, leave it unallocated */
+            continue;
+        }
+
+        memset(buf, 0, s->cluster_size);
+        while (sector >= 0 && sector / spb < end_bit) {
+            uint64_t bit = sector / spb - first_bit;
+
+            buf[bit >> 3] |= 1 << (bit & 7);
+            sector = hbitmap_iter_next(&hbi);
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        tb[i] = offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file->bs, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    g_free(buf);
+    *table = tb;
+    *table_size = tb_size;
+    return 0;
+
+fail:
+    clear_bitmap_table(bs, tb, tb_size, QCOW2_DISCARD_ALWAYS);
+    g_free(buf);
+    g_free(tb);
+    return ret;
+}
+
+/* Writes @table into newly allocated clusters and records them in @tb */
+static int store_bitmap_table(BlockDriverState *bs, uint64_t *table,
+                              uint32_t size, Qcow2BitmapTable *tb)
+{
+    size_t tb_bytes = size * sizeof(uint64_t);
+    uint64_t *be_table;
+    int64_t offset;
+    uint32_t i;
+    int ret;
+
+    offset = qcow2_alloc_clusters(bs, tb_bytes);
+    if (offset < 0) {
+        return offset;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, tb_bytes);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    be_table = g_new(uint64_t, size);
+    for (i = 0; i < size; i++) {
+        be_table[i] = cpu_to_be64(table[i]);
+    }
+    ret = bdrv_pwrite(bs->file->bs, offset, be_table, tb_bytes);
+    g_free(be_table);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    tb->offset = offset;
+    tb->size = size;
+    return 0;
+
+fail:
+    qcow2_free_clusters(bs, offset, tb_bytes, QCOW2_DISCARD_ALWAYS);
+    return ret;
+}
+
+/* Stores @bitmap into the image and returns its new directory entry */
+static Qcow2Bitmap *store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                                 Error **errp)
+{
+    const char *name = bdrv_dirty_bitmap_name(bitmap);
+    uint8_t granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    Qcow2Bitmap *bm;
+    uint64_t *table;
+    uint32_t table_size;
+    int ret;
+
+    ret = store_bitmap_data(bs, bitmap, granularity_bits, &table, &table_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write data of bitmap '%s'",
+                         name);
+        return NULL;
+    }
+
+    bm = g_new0(Qcow2Bitmap, 1);
+    if (table_size > 0) {
+        ret = store_bitmap_table(bs, table, table_size, &bm->table);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write table of bitmap "
+                             "'%s'", name);
+            clear_bitmap_table(bs, table, table_size, QCOW2_DISCARD_ALWAYS);
+            g_free(table);
+            g_free(bm);
+            return NULL;
+        }
+    }
+    g_free(table);
+
+    bm->name = g_strdup(name);
+    bm->type = BME_TYPE_DIRTY_TRACKING;
+    bm->granularity_bits = granularity_bits;
+    bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+
+    return bm;
+}
+
+/*
+ * Reads and checks the bitmap directory. Entries QEMU cannot use are kept in
+ * the list, so that they survive when the directory is rewritten.
+ */
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs, uint64_t offset,
+                                         uint64_t size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    uint8_t *dir, *dir_end, *p;
+    uint32_t nb_dir_entries = 0;
+    int ret;
+
+    if (size == 0) {
+        error_setg(errp, "Bitmap directory is empty");
+        return NULL;
+    }
+
+    dir = g_try_malloc(size);
+    if (dir == NULL) {
+        error_setg(errp, "Could not allocate buffer for bitmap directory");
+        return NULL;
+    }
+    dir_end = dir + size;
+
+    ret = bdrv_pread(bs->file->bs, offset, dir, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap directory");
+        goto fail;
+    }
+
+    bm_list = bitmap_list_new();
+    for (p = dir; p < dir_end; ) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)p;
+        Qcow2Bitmap *bm;
+        uint32_t entry_size;
+
+        if (dir_end - p < sizeof(*e)) {
+            goto broken_dir;
+        }
+
+        be64_to_cpus(&e->bitmap_table_offset);
+        be32_to_cpus(&e->bitmap_table_size);
+        be32_to_cpus(&e->flags);
+        be16_to_cpus(&e->name_size);
+        be32_to_cpus(&e->extra_data_size);
+
+        entry_size = calc_dir_entry_size(e->name_size, e->extra_data_size);
+        if (++nb_dir_entries > s->nb_bitmaps ||
+            entry_size > dir_end - p ||
+            e->name_size == 0 || e->name_size > BME_MAX_NAME_SIZE ||
+            (e->flags & BME_RESERVED_FLAGS) ||
+            e->bitmap_table_size > BME_MAX_TABLE_SIZE ||
+            offset_into_cluster(s, e->bitmap_table_offset) ||
+            (e->bitmap_table_offset == 0) != (e->bitmap_table_size == 0))
+        {
+            goto broken_dir;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->table.offset = e->bitmap_table_offset;
+        bm->table.size = e->bitmap_table_size;
+        bm->flags = e->flags;
+        bm->type = e->type;
+        bm->granularity_bits = e->granularity_bits;
+        bm->extra_data_size = e->extra_data_size;
+        if (e->extra_data_size) {
+            bm->extra_data = g_memdup(e + 1, e->extra_data_size);
+        }
+        bm->name = g_strndup((char *)(e + 1) + e->extra_data_size,
+                             e->name_size);
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+
+        p += entry_size;
+    }
+
+    if (nb_dir_entries != s->nb_bitmaps) {
+        error_setg(errp, "Fewer bitmaps than specified in the bitmaps "
+                   "extension");
+        goto fail_list;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+broken_dir:
+    error_setg(errp, "Broken bitmap directory");
+fail_list:
+    bitmap_list_free(bm_list);
+fail:
+    g_free(dir);
+    return NULL;
+}
+
+/* Writes @bm_list into newly allocated clusters */
+static int bitmap_list_store(BlockDriverState *bs, Qcow2BitmapList *bm_list,
+                             uint64_t *offset, uint64_t *size)
+{
+    Qcow2Bitmap *bm;
+    uint8_t *dir;
+    uint64_t dir_size = 0;
+    int64_t dir_offset;
+    uint8_t *p;
+    int ret;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        dir_size += calc_dir_entry_size(strlen(bm->name), bm->extra_data_size);
+    }
+
+    if (dir_size == 0 || dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        return -EINVAL;
+    }
+
+    dir = g_try_malloc0(dir_size);
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+
+    p = dir;
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)p;
+        size_t name_size = strlen(bm->name);
+
+        e->bitmap_table_offset = cpu_to_be64(bm->table.offset);
+        e->bitmap_table_size = cpu_to_be32(bm->table.size);
+        e->flags = cpu_to_be32(bm->flags);
+        e->type = bm->type;
+        e->granularity_bits = bm->granularity_bits;
+        e->name_size = cpu_to_be16(name_size);
+        e->extra_data_size = cpu_to_be32(bm->extra_data_size);
+        if (bm->extra_data_size) {
+            memcpy(e + 1, bm->extra_data, bm->extra_data_size);
+        }
+        memcpy((uint8_t *)(e + 1) + bm->extra_data_size, bm->name, name_size);
+
+        p += calc_dir_entry_size(name_size, bm->extra_data_size);
+    }
+
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        ret = dir_offset;
+        goto fail;
+    }
+
+    /* The directory is not referenced by the header yet, so these clusters
+     * must indeed be completely free */
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file->bs, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    g_free(dir);
+    *offset = dir_offset;
+    *size = dir_size;
+    return 0;
+
+fail:
+    g_free(dir);
+    if (dir_offset > 0) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_ALWAYS);
+    }
+    return ret;
+}
+
+/*
+ * Writes a new bitmap directory from @bm_list and points the header to it.
+ * The old directory is freed once the header has been updated.
+ */
+static int update_ext_header_and_dir(BlockDriverState *bs,
+                                     Qcow2BitmapList *bm_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_offset = s->bitmap_directory_offset;
+    uint64_t old_size = s->bitmap_directory_size;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_autoclear = s->autoclear_features;
+    uint64_t new_offset = 0, new_size = 0;
+    uint32_t new_nb_bitmaps = 0;
+    Qcow2Bitmap *bm;
+    int ret;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        new_nb_bitmaps++;
+    }
+
+    if (new_nb_bitmaps > QCOW2_MAX_BITMAPS) {
+        return -EINVAL;
+    }
+
+    if (new_nb_bitmaps > 0) {
+        ret = bitmap_list_store(bs, bm_list, &new_offset, &new_size);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* The header must only point to data whose refcounts are stable on
+         * disk */
+        ret = bdrv_flush(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    s->nb_bitmaps = new_nb_bitmaps;
+    s->bitmap_directory_offset = new_offset;
+    s->bitmap_directory_size = new_size;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (old_size > 0) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+    return 0;
+
+fail:
+    if (new_size > 0) {
+        qcow2_free_clusters(bs, new_offset, new_size, QCOW2_DISCARD_ALWAYS);
+    }
+
+    s->nb_bitmaps = old_nb_bitmaps;
+    s->bitmap_directory_offset = old_offset;
+    s->bitmap_directory_size = old_size;
+    s->autoclear_features = old_autoclear;
+
+    return ret;
+}
+
+/*
+ * Loads all usable bitmaps of the image as persistent dirty bitmaps of @bs
+ * and marks them as in use in the image. Bitmaps that are already in use,
+ * i.e. were not stored properly after they were last loaded, are
+ * inconsistent and are dropped.
+ */
+int qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list, *drop_list;
+    Qcow2Bitmap *bm, *next_bm;
+    GSList *created = NULL, *l;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, errp);
+    if (bm_list == NULL) {
+        return -EINVAL;
+    }
+
+    drop_list = bitmap_list_new();
+    QSIMPLEQ_FOREACH_SAFE(bm, bm_list, entry, next_bm) {
+        BdrvDirtyBitmap *bitmap;
+
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            /* The image is reopened after an aborted migration and the
+             * bitmap is still in memory; it will be stored again on close */
+            bm->flags |= BME_FLAG_IN_USE;
+            continue;
+        }
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("warning: dirty bitmap '%s' of '%s' was not saved "
+                         "correctly and is dropped", bm->name,
+                         bdrv_get_device_or_node_name(bs));
+            QSIMPLEQ_REMOVE(bm_list, bm, Qcow2Bitmap, entry);
+            QSIMPLEQ_INSERT_TAIL(drop_list, bm, entry);
+            continue;
+        }
+
+        if (!bitmap_is_usable(bs, bm)) {
+            continue;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                          bm->name, errp);
+        if (bitmap == NULL) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        created = g_slist_prepend(created, bitmap);
+
+        ret = load_bitmap_data(bs, bm, bitmap);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_persistence(bitmap, true);
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+        bm->flags |= BME_FLAG_IN_USE;
+    }
+
+    /* Mark the loaded bitmaps as in use before anything is written */
+    ret = update_ext_header_and_dir(bs, bm_list);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update bitmap directory");
+        goto fail;
+    }
+
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush bitmap directory");
+        goto fail;
+    }
+
+    QSIMPLEQ_FOREACH(bm, drop_list, entry) {
+        free_bitmap_clusters(bs, &bm->table);
+    }
+
+    g_slist_free(created);
+    bitmap_list_free(drop_list);
+    bitmap_list_free(bm_list);
+    return 0;
+
+fail:
+    for (l = created; l != NULL; l = l->next) {
+        bdrv_release_dirty_bitmap(bs, l->data);
+    }
+    g_slist_free(created);
+    bitmap_list_free(drop_list);
+    bitmap_list_free(bm_list);
+    return ret;
+}
+
+/*
+ * Writes all persistent dirty bitmaps of @bs into the image, replacing the
+ * stored versions. Stored bitmaps that QEMU does not use are kept as they
+ * are.
+ */
+void qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapList *bm_list, *drop_list, *new_list;
+    Qcow2Bitmap *bm, *next_bm, *first_new;
+    bool have_persistent = false;
+    int ret;
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            have_persistent = true;
+            break;
+        }
+    }
+
+    if (s->nb_bitmaps == 0 && !have_persistent) {
+        return;
+    }
+
+    if (s->nb_bitmaps == 0) {
+        bm_list = bitmap_list_new();
+    } else {
+        bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                                   s->bitmap_directory_size, errp);
+        if (bm_list == NULL) {
+            return;
+        }
+    }
+
+    /* Entries that are replaced by the in-memory state, or that are stale */
+    drop_list = bitmap_list_new();
+    QSIMPLEQ_FOREACH_SAFE(bm, bm_list, entry, next_bm) {
+        bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+        if ((bitmap && bdrv_dirty_bitmap_get_persistence(bitmap)) ||
+            (bm->flags & BME_FLAG_IN_USE))
+        {
+            QSIMPLEQ_REMOVE(bm_list, bm, Qcow2Bitmap, entry);
+            QSIMPLEQ_INSERT_TAIL(drop_list, bm, entry);
+        }
+    }
+
+    new_list = bitmap_list_new();
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (!bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            continue;
+        }
+
+        bm = store_bitmap(bs, bitmap, errp);
+        if (bm == NULL) {
+            goto fail;
+        }
+        QSIMPLEQ_INSERT_TAIL(new_list, bm, entry);
+    }
+
+    first_new = QSIMPLEQ_FIRST(new_list);
+    QSIMPLEQ_CONCAT(bm_list, new_list);
+
+    ret = update_ext_header_and_dir(bs, bm_list);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update bitmap directory");
+        for (bm = first_new; bm != NULL; bm = QSIMPLEQ_NEXT(bm, entry)) {
+            free_bitmap_clusters(bs, &bm->table);
+        }
+        goto out;
+    }
+
+    /* The new directory is on disk, the replaced data can go */
+    QSIMPLEQ_FOREACH(bm, drop_list, entry) {
+        free_bitmap_clusters(bs, &bm->table);
+    }
+    goto out;
+
+fail:
+    QSIMPLEQ_FOREACH(bm, new_list, entry) {
+        free_bitmap_clusters(bs, &bm->table);
+    }
+out:
+    bitmap_list_free(new_list);
+    bitmap_list_free(drop_list);
+    bitmap_list_free(bm_list);
+}
+
+/*
+ * Checks whether a new persistent bitmap could be stored in the image when it
+ * is closed.
+ */
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapList *bm_list = NULL;
+    Qcow2Bitmap *bm;
+    uint64_t nb_bitmaps = 1;
+    uint64_t dir_size;
+    int granularity_bits = ctz32(granularity);
+
+    /* Bitmaps are only stored on close of writable images */
+    if (bdrv_is_read_only(bs)) {
+        error_setg(errp, "Cannot store dirty bitmaps in read-only image '%s'",
+                   bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Cannot store dirty bitmaps in qcow2 v2 files");
+        return false;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is too long, the maximum is %d bytes",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+
+    if (granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        granularity_bits > BME_MAX_GRANULARITY_BITS)
+    {
+        error_setg(errp, "Granularity must be between %llu and %llu bytes",
+                   1ULL << BME_MIN_GRANULARITY_BITS,
+                   1ULL << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+
+    if (bitmap_table_size(bs, granularity_bits) > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Granularity is too small for an image of this "
+                   "size");
+        return false;
+    }
+
+    dir_size = calc_dir_entry_size(strlen(name), 0);
+
+    if (s->nb_bitmaps > 0) {
+        bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                                   s->bitmap_directory_size, errp);
+        if (bm_list == NULL) {
+            return false;
+        }
+
+        if (find_bitmap_by_name(bm_list, name)) {
+            error_setg(errp, "Bitmap with the same name is already stored");
+            goto fail;
+        }
+
+        QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+            nb_bitmaps++;
+            dir_size += calc_dir_entry_size(strlen(bm->name),
+                                            bm->extra_data_size);
+        }
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (bdrv_dirty_bitmap_get_persistence(bitmap) &&
+            !(bm_list && find_bitmap_by_name(bm_list, bm_name)))
+        {
+            nb_bitmaps++;
+            dir_size += calc_dir_entry_size(strlen(bm_name), 0);
+        }
+    }
+
+    if (nb_bitmaps > QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "The image can't contain more than %d bitmaps",
+                   QCOW2_MAX_BITMAPS);
+        goto fail;
+    }
+
+    if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "The bitmap directory would be too large");
+        goto fail;
+    }
+
+    bitmap_list_free(bm_list);
+    return true;
+
+fail:
+    bitmap_list_free(bm_list);
+    return false;
+}
+
+/*
+ * Increases the refcounts of all clusters used by stored bitmaps in the
+ * in-memory refcount table built by qcow2_check_refcounts().
+ */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    Error *local_err = NULL;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, &local_err);
+    if (bm_list == NULL) {
+        fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *table;
+        uint32_t i;
+
+        if (bm->table.size == 0) {
+            continue;
+        }
+
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, bm->table.offset,
+                                       bm->table.size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, &bm->table, &table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR bitmap table of '%s' is corrupt: %s\n",
+                    bm->name, strerror(-ret));
+            res->corruptions++;
+            continue;
+        }
+
+        for (i = 0; i < bm->table.size; i++) {
+            uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset == 0) {
+                continue;
+            }
+
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           s->cluster_size);
+            if (ret < 0) {
+                g_free(table);
+                goto out;
+            }
+        }
+
+        g_free(table);
+    }
+    ret = 0;
+
+out:
+    bitmap_list_free(bm_list);
+    return ret;
+}
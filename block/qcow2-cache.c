@@ -39,46 +39,111 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    int      hash_next;     /* next entry in the same bucket, or -1 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Maps table offsets to entry indices; chained through hash_next */
+    int                    *buckets;
+    unsigned int            hash_mask;
+
+    /* Unreferenced entries, unused ones first, then least recently used */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
-    BDRVQcow2State *s = bs->opaque;
-    return (uint8_t *) c->table_array + (size_t) table * s->cluster_size;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
 }
 
 static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
                   Qcow2Cache *c, void *table)
 {
-    BDRVQcow2State *s = bs->opaque;
     ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
-    int idx = table_offset / s->cluster_size;
-    assert(idx >= 0 && idx < c->size && table_offset % s->cluster_size == 0);
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
     return idx;
 }
 
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t n = offset / c->table_size;
+    return (n * 0x9e3779b97f4a7c15ULL >> 32) & c->hash_mask;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next)
+    {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned int h = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+/* Drops the table held by an entry; unreferenced entries become the next
+ * candidates for replacement */
+static void qcow2_cache_entry_reset(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    t->offset = 0;
+    t->lru_counter = 0;
+
+    if (t->ref == 0) {
+        QTAILQ_REMOVE(&c->lru, t, lru_next);
+        QTAILQ_INSERT_HEAD(&c->lru, t, lru_next);
+    }
+}
+
 static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
 #if QEMU_MADV_DONTNEED != QEMU_MADV_INVALID
-    BDRVQcow2State *s = bs->opaque;
     void *t = qcow2_cache_get_table_addr(bs, c, i);
     int align = getpagesize();
-    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t mem_size = (size_t) c->table_size * num_tables;
     size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
     size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
-    if (length > 0) {
+    if (mem_size > offset && length > 0) {
         qemu_madvise((uint8_t *) t + offset, length, QEMU_MADV_DONTNEED);
     }
 #endif
@@ -104,8 +169,7 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_reset(c, i);
             i++;
             to_clean++;
         }
@@ -118,22 +182,42 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    size_t num_buckets;
+    int i;
+
+    assert(num_tables > 0 && table_size >= 512 && is_power_of_2(table_size));
+
+    num_buckets = pow2ceil(num_tables);
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
+    c->hash_mask = num_buckets - 1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, num_buckets);
     c->table_array = qemu_try_blockalign(bs->file->bs,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) num_tables * table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < num_buckets; i++) {
+        c->buckets[i] = -1;
+    }
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     return c;
@@ -148,6 +232,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -196,13 +281,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -216,7 +301,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     ret = bdrv_pwrite(bs->file->bs, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -291,8 +376,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_reset(c, i);
     }
 
     qcow2_cache_table_release(bs, c, 0, c->size);
@@ -306,39 +390,30 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *victim;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    assert(offset != 0 && offset % c->table_size == 0);
+
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    victim = QTAILQ_FIRST(&c->lru);
+    if (victim == NULL) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = victim - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -349,7 +424,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_entry_reset(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -357,17 +432,20 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
         ret = bdrv_pread(bs->file->bs, offset,
                          qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru_next);
+    }
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -397,11 +475,30 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     assert(c->entries[i].ref >= 0);
 }
 
+/* Drops all unreferenced tables in [offset, offset + length) without writing
+ * them back, e.g. because the clusters they live in have been freed */
+void qcow2_cache_discard(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                         uint64_t length)
+{
+    uint64_t end = offset + length;
+    int i;
+
+    for (; offset < end; offset += c->table_size) {
+        i = qcow2_cache_lookup(c, offset);
+        if (i >= 0) {
+            assert(c->entries[i].ref == 0);
+            c->entries[i].dirty = false;
+            qcow2_cache_entry_reset(c, i);
+        }
+    }
+}
+
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
      void *table)
 {
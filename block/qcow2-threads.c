@@ -0,0 +1,272 @@
+/*
+ * Threaded compression and decompression for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qcow2.h"
+
+/*
+ * Codecs
+ *
+ * All of them run in a thread pool worker and must not touch any block
+ * layer state. Compression returns the compressed size, or -ENOSPC if the
+ * result does not fit into dest. Decompression must fill dest completely.
+ * The compressed data may be followed by padding up to a sector boundary.
+ */
+
+typedef ssize_t Qcow2CodecFunc(void *dest, size_t dest_size,
+                               const void *src, size_t src_size);
+
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -ENOSPC : -EIO);
+    }
+
+    deflateEnd(&strm);
+
+    return ret;
+}
+
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        /* We approve Z_BUF_ERROR because we need @dest buffer to be filled,
+         * but @src buffer may be processed partly (because in qcow2 we know
+         * size of compressed data with precision of one sector) */
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+
+    return ret;
+}
+
+#ifdef CONFIG_LZ4
+/*
+ * LZ4 needs the exact size of its input, which the L2 entry only records in
+ * sectors, so the compressed block is prefixed with its length (big endian).
+ */
+
+static ssize_t qcow2_lz4_compress(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size)
+{
+    int ret;
+
+    if (dest_size <= sizeof(uint32_t)) {
+        return -ENOSPC;
+    }
+
+    ret = LZ4_compress_default(src, (char *)dest + sizeof(uint32_t),
+                               src_size, dest_size - sizeof(uint32_t));
+    if (ret <= 0) {
+        return -ENOSPC;
+    }
+
+    stl_be_p(dest, ret);
+    return ret + sizeof(uint32_t);
+}
+
+static ssize_t qcow2_lz4_decompress(void *dest, size_t dest_size,
+                                    const void *src, size_t src_size)
+{
+    uint32_t len;
+    int ret;
+
+    if (src_size < sizeof(uint32_t)) {
+        return -EIO;
+    }
+
+    len = ldl_be_p(src);
+    if (len > src_size - sizeof(uint32_t)) {
+        return -EIO;
+    }
+
+    ret = LZ4_decompress_safe((const char *)src + sizeof(uint32_t), dest,
+                              len, dest_size);
+    if (ret < 0 || ret != dest_size) {
+        return -EIO;
+    }
+
+    return 0;
+}
+#endif
+
+typedef struct Qcow2CodecData {
+    Qcow2CodecFunc *func;
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CodecData;
+
+static int qcow2_codec_pool_func(void *opaque)
+{
+    Qcow2CodecData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+
+    return 0;
+}
+
+/*
+ * Runs a codec in the thread pool of the image's AioContext. The caller may
+ * hold s->lock, but usually should not, so that other requests can proceed
+ * while the worker is busy.
+ */
+static ssize_t coroutine_fn qcow2_co_process(BlockDriverState *bs,
+                                             Qcow2CodecFunc *func,
+                                             void *dest, size_t dest_size,
+                                             const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CodecData data = {
+        .func       = func,
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+    };
+
+    /* Leave some of the shared pool to other users */
+    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+        qemu_co_queue_wait(&s->thread_task_queue);
+    }
+
+    s->nb_threads++;
+    thread_pool_submit_co(pool, qcow2_codec_pool_func, &data);
+    s->nb_threads--;
+
+    qemu_co_queue_next(&s->thread_task_queue);
+
+    return data.ret;
+}
+
+/*
+ * qcow2_co_compress
+ *
+ * Compresses src (one cluster) into dest with the image's codec.
+ *
+ * Returns the compressed size on success, -ENOSPC if the data does not
+ * compress into dest_size bytes and -errno on other errors.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CodecFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        func = qcow2_lz4_compress;
+        break;
+#endif
+    default:
+        return -ENOTSUP;
+    }
+
+    return qcow2_co_process(bs, func, dest, dest_size, src, src_size);
+}
+
+/*
+ * qcow2_co_decompress
+ *
+ * Decompresses src into dest, which receives exactly dest_size bytes.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+ssize_t coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                         void *dest, size_t dest_size,
+                                         const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CodecFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        func = qcow2_lz4_decompress;
+        break;
+#endif
+    default:
+        return -ENOTSUP;
+    }
+
+    return qcow2_co_process(bs, func, dest, dest_size, src, src_size);
+}
@@ -25,7 +25,6 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -61,6 +60,27 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_COMPRESSION_TYPE 0x636f6d70
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
+
+typedef struct {
+    uint8_t compression_type;
+    uint8_t reserved[7];
+} QEMU_PACKED Qcow2CompressionTypeExt;
+
+static bool qcow2_compression_type_supported(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return true;
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -146,6 +166,113 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 #endif
             break;
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_TYPE:
+            {
+                Qcow2CompressionTypeExt ct;
+
+                if (ext.len < sizeof(ct.compression_type)) {
+                    error_setg(errp, "ERROR: ext_compression_type: "
+                               "len=%" PRIu32 " too small", ext.len);
+                    return -EINVAL;
+                }
+                ret = bdrv_pread(bs->file->bs, offset, &ct.compression_type,
+                                 sizeof(ct.compression_type));
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "ERROR: "
+                                     "ext_compression_type: Could not read "
+                                     "compression type");
+                    return ret;
+                }
+                if (!qcow2_compression_type_supported(ct.compression_type)) {
+                    error_setg(errp, "Unsupported compression type %u",
+                               ct.compression_type);
+                    return -ENOTSUP;
+                }
+                s->compression_type = ct.compression_type;
+            }
+            break;
+
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            {
+                Qcow2BitmapHeaderExt bitmaps_ext;
+
+                if (ext.len != sizeof(bitmaps_ext)) {
+                    error_setg(errp, "ERROR: ext_bitmaps: Invalid extension "
+                               "length");
+                    return -EINVAL;
+                }
+
+                if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                    /* The image was modified by a program that does not know
+                     * about bitmaps, so they are stale and will be dropped
+                     * with the extension when the header is rewritten */
+                    if (s->qcow_version >= 3) {
+                        error_report("warning: dirty bitmaps of '%s' are "
+                                     "inconsistent and are ignored",
+                                     bdrv_get_device_or_node_name(bs));
+                    }
+                    break;
+                }
+
+                ret = bdrv_pread(bs->file->bs, offset, &bitmaps_ext,
+                                 ext.len);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "ERROR: ext_bitmaps: "
+                                     "Could not read ext_bitmaps");
+                    return ret;
+                }
+
+                be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+                be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+                be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+                if (bitmaps_ext.reserved32 != 0) {
+                    error_setg(errp, "ERROR: ext_bitmaps: Reserved field is "
+                               "not zero");
+                    return -EINVAL;
+                }
+
+                if (bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                    error_setg(errp, "ERROR: ext_bitmaps: Image has %" PRIu32
+                               " bitmaps, exceeding the QEMU supported "
+                               "maximum of %d", bitmaps_ext.nb_bitmaps,
+                               QCOW2_MAX_BITMAPS);
+                    return -EINVAL;
+                }
+
+                if (bitmaps_ext.nb_bitmaps == 0) {
+                    error_setg(errp, "ERROR: ext_bitmaps: Found bitmaps "
+                               "extension with zero bitmaps");
+                    return -EINVAL;
+                }
+
+                if (bitmaps_ext.bitmap_directory_offset &
+                    (s->cluster_size - 1))
+                {
+                    error_setg(errp, "ERROR: ext_bitmaps: Invalid bitmap "
+                               "directory offset");
+                    return -EINVAL;
+                }
+
+                if (bitmaps_ext.bitmap_directory_size >
+                    QCOW2_MAX_BITMAP_DIRECTORY_SIZE)
+                {
+                    error_setg(errp, "ERROR: ext_bitmaps: Bitmap directory "
+                               "size (%" PRIu64 ") exceeds the maximum "
+                               "supported size (%d)",
+                               bitmaps_ext.bitmap_directory_size,
+                               QCOW2_MAX_BITMAP_DIRECTORY_SIZE);
+                    return -EINVAL;
+                }
+
+                s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+                s->bitmap_directory_offset =
+                        bitmaps_ext.bitmap_directory_offset;
+                s->bitmap_directory_size =
+                        bitmaps_ext.bitmap_directory_size;
+            }
+            break;
+
         case QCOW2_EXT_MAGIC_FEATURE_TABLE:
             if (p_feature_table != NULL) {
                 void* feature_table = g_malloc0(ext.len + 2 * sizeof(Qcow2Feature));
@@ -452,6 +579,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into an inactive L2 table",
         },
+        {
+            .name = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into the bitmap directory",
+        },
         {
             .name = QCOW2_OPT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -463,6 +595,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -486,6 +623,7 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_SNAPSHOT_TABLE_BITNR] = QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE,
     [QCOW2_OL_INACTIVE_L1_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L1,
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
+    [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
 };
 
 static void cache_clean_timer_cb(void *opaque)
@@ -593,10 +731,12 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size;
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    bool bitmaps_stored;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -608,7 +748,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -630,7 +770,24 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    /* L2 tables are cached in slices, so that a given amount of memory can
+     * cover more of the guest disk when accesses are scattered */
+    l2_cache_entry_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                          MIN(s->cluster_size, DEFAULT_L2_CACHE_ENTRY_SIZE));
+    if (l2_cache_entry_size < MIN_L2_CACHE_ENTRY_SIZE ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size))
+    {
+        error_setg(errp, "L2 cache entry size must be a power of two between "
+                   "%d and the cluster size (%d)", MIN_L2_CACHE_ENTRY_SIZE,
+                   s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -668,8 +825,10 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -776,6 +935,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -1081,17 +1241,12 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file->bs, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
+    for (i = 0; i < QCOW2_COMPRESSED_CACHE_SIZE; i++) {
+        s->compressed_cache[i].offset = -1;
     }
-
-    s->cluster_cache_offset = -1;
+    s->compressed_cache_size = MAX(1, MIN(QCOW2_COMPRESSED_CACHE_SIZE,
+                                          QCOW2_COMPRESSED_CACHE_BYTES /
+                                          s->cluster_size));
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -1111,6 +1266,17 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Readers that don't know the extension must not misinterpret the
+     * compressed clusters, so the extension comes with a feature bit */
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB))
+    {
+        error_setg(errp, "Compression type header extension and incompatible "
+                   "feature bit do not match");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -1141,8 +1307,10 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK))
+    {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1152,6 +1320,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->thread_task_queue);
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
@@ -1165,6 +1334,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* Load persistent dirty bitmaps; they are marked as in use in the image
+     * until they are stored back on close */
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE)) {
+        ret = qcow2_load_persistent_dirty_bitmaps(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1188,8 +1366,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_free(bs);
     return ret;
 }
 
@@ -1235,6 +1412,22 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     return 0;
 }
 
+/* The image stays writable, so mark the bitmaps stored by
+ * qcow2_reopen_prepare() as in use again */
+static void qcow2_reopen_bitmaps_abort(BlockDriverState *bs,
+                                       Qcow2ReopenState *r)
+{
+    Error *local_err = NULL;
+
+    if (!r->bitmaps_stored) {
+        return;
+    }
+    qcow2_load_persistent_dirty_bitmaps(bs, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+}
+
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
@@ -1252,6 +1445,20 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        /* Persistent bitmaps are not stored on close of a read-only image,
+         * so store them now; otherwise they stay marked as in use */
+        if (!bdrv_is_read_only(state->bs)) {
+            Error *local_err = NULL;
+
+            qcow2_store_persistent_dirty_bitmaps(state->bs, &local_err);
+            if (local_err) {
+                error_propagate(errp, local_err);
+                ret = -EINVAL;
+                goto fail;
+            }
+            r->bitmaps_stored = true;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -1266,6 +1473,7 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 
 fail:
+    qcow2_reopen_bitmaps_abort(state->bs, r);
     qcow2_update_options_abort(state->bs, r);
     g_free(r);
     return ret;
@@ -1279,10 +1487,22 @@ static void qcow2_reopen_commit(BDRVReopenState *state)
 
 static void qcow2_reopen_abort(BDRVReopenState *state)
 {
+    qcow2_reopen_bitmaps_abort(state->bs, state->opaque);
     qcow2_update_options_abort(state->bs, state->opaque);
     g_free(state->opaque);
 }
 
+/* Writes to the image must be tracked from now on, so load the bitmaps that
+ * qcow2_open() skipped for the read-only image and mark all of them as in
+ * use */
+static int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
+{
+    if (bs->open_flags & BDRV_O_INACTIVE) {
+        return 0;
+    }
+    return qcow2_load_persistent_dirty_bitmaps(bs, errp);
+}
+
 static void qcow2_join_options(QDict *options, QDict *old_options)
 {
     bool has_new_overlap_template =
@@ -1304,6 +1524,7 @@ static void qcow2_join_options(QDict *options, QDict *old_options)
         qdict_del(old_options, QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE);
         qdict_del(old_options, QCOW2_OPT_OVERLAP_INACTIVE_L1);
         qdict_del(old_options, QCOW2_OPT_OVERLAP_INACTIVE_L2);
+        qdict_del(old_options, QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY);
     }
 
     /* New total cache size overrides all old options */
@@ -1451,15 +1672,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_read_compressed(bs, cluster_offset,
+                                           index_in_cluster * 512, &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1558,8 +1775,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -1737,8 +1952,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_free(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1909,6 +2123,43 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression type header extension */
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        Qcow2CompressionTypeExt ct = {
+            .compression_type = s->compression_type,
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_TYPE,
+                             &ct, sizeof(ct), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Bitmaps header extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                    cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                    cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     if (s->qcow_version >= 3) {
         Qcow2Feature features[] = {
@@ -1922,11 +2173,21 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -2070,6 +2331,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
+                         Qcow2CompressionType compression_type,
                          Error **errp)
 {
     int cluster_bits;
@@ -2254,6 +2516,13 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         abort();
     }
 
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        BDRVQcow2State *s = bs->opaque;
+
+        s->compression_type = compression_type;
+        s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+    }
+
     /* Create a full header (including things like feature table) */
     ret = qcow2_update_header(bs);
     if (ret < 0) {
@@ -2324,6 +2593,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    Qcow2CompressionType compression_type;
     Error *local_err = NULL;
     int ret;
 
@@ -2397,9 +2667,36 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     refcount_order = ctz32(refcount_bits);
 
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    compression_type = qapi_enum_parse(Qcow2CompressionType_lookup, buf,
+                                       QCOW2_COMPRESSION_TYPE__MAX,
+                                       QCOW2_COMPRESSION_TYPE_ZLIB,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if (!qcow2_compression_type_supported(compression_type)) {
+        error_setg(errp, "Compression type '%s' is not supported by this "
+                   "build", Qcow2CompressionType_lookup[compression_type]);
+        ret = -ENOTSUP;
+        goto finish;
+    }
+
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression types other than zlib require "
+                   "compatibility level 1.1 or above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        compression_type, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
     }
@@ -2487,12 +2784,14 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
+    int ret;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -2512,62 +2811,51 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
             uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
             memset(pad_buf, 0, s->cluster_size);
             memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
+            ret = qcow2_co_write_compressed(bs, sector_num,
+                                            pad_buf, s->cluster_sectors);
             qemu_vfree(pad_buf);
         }
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    out_buf = g_malloc(s->cluster_size);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    /* Compression runs in a worker thread and needs no metadata, so several
+     * clusters can be compressed at the same time */
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOSPC) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     } else {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
 
+        /* The space may have held another compressed cluster before */
+        qcow2_compressed_cache_invalidate(bs, cluster_offset);
+
         ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
         if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
             goto fail;
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -2579,6 +2867,52 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} Qcow2WriteCompressedCo;
+
+static void coroutine_fn qcow2_write_compressed_entry(void *opaque)
+{
+    Qcow2WriteCompressedCo *data = opaque;
+
+    data->ret = qcow2_co_write_compressed(data->bs, data->sector_num,
+                                          data->buf, data->nb_sectors);
+}
+
+/*
+ * When called from a coroutine, concurrent callers each get their cluster
+ * compressed in a separate worker thread.
+ */
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    Coroutine *co;
+    Qcow2WriteCompressedCo data = {
+        .bs         = bs,
+        .sector_num = sector_num,
+        .buf        = buf,
+        .nb_sectors = nb_sectors,
+        .ret        = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        qcow2_write_compressed_entry(&data);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        co = qemu_coroutine_create(qcow2_write_compressed_entry);
+        qemu_coroutine_enter(co, &data);
+        while (data.ret == -EINPROGRESS) {
+            aio_poll(aio_context, true);
+        }
+    }
+    return data.ret;
+}
+
 static int make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -2827,6 +3161,10 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
         };
+        if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+            spec_info->u.qcow2->has_compression_type = true;
+            spec_info->u.qcow2->compression_type = s->compression_type;
+        }
     } else {
         /* if this assertion fails, this probably means a new version was
          * added without having it covered here */
@@ -2917,6 +3255,16 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_report("compat=0.10 requires compression_type=zlib");
+        return -ENOTSUP;
+    }
+
+    if (s->nb_bitmaps > 0) {
+        error_report("compat=0.10 does not support persistent dirty bitmaps");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3099,6 +3447,14 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                              "not exceed 64 bits");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+            if (type && strcmp(type,
+                    Qcow2CompressionType_lookup[s->compression_type])) {
+                error_report("Changing the compression type is not "
+                             "supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -3310,6 +3666,12 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Codec for compressed clusters (allowed values: zlib, "
+                    "lz4)"
+        },
         { /* end of list */ }
     }
 };
@@ -3357,6 +3719,10 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
 
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
+    .bdrv_store_persistent_dirty_bitmaps = qcow2_store_persistent_dirty_bitmaps,
+    .bdrv_reopen_bitmaps_rw = qcow2_reopen_bitmaps_rw,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
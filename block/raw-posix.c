@@ -139,6 +139,9 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_linux_io_uring;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
 #endif
@@ -155,6 +158,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_linux_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -513,6 +519,26 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = !!(bdrv_flags & BDRV_O_IO_URING);
+    if (s->use_linux_io_uring &&
+        !aio_get_linux_io_uring(bdrv_get_aio_context(bs), &local_err)) {
+        error_propagate(errp, local_err);
+        error_prepend(errp, "Unable to use io_uring: ");
+        qemu_close(fd);
+        s->fd = -1;
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
@@ -618,6 +644,14 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_linux_io_uring = !!(state->flags & BDRV_O_IO_URING);
+    if (raw_s->use_linux_io_uring &&
+        !aio_get_linux_io_uring(bdrv_get_aio_context(state->bs), errp)) {
+        return -1;
+    }
+#endif
+
     if (s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
     }
@@ -703,6 +737,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = raw_s->use_linux_io_uring;
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1298,6 +1335,54 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Returns the io_uring ring to use for requests on @bs, or NULL if it is not
+ * configured for aio=io_uring.  The ring belongs to the current AioContext of
+ * @bs, so it follows the node when it is moved to another AioContext.
+ */
+static LuringState *raw_get_luring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (!s->use_linux_io_uring) {
+        return NULL;
+    }
+    return aio_get_linux_io_uring(bdrv_get_aio_context(bs), NULL);
+}
+
+typedef struct RawLuringCo {
+    Coroutine *co;
+    int ret;
+} RawLuringCo;
+
+static void raw_luring_co_cb(void *opaque, int ret)
+{
+    RawLuringCo *data = opaque;
+
+    data->ret = ret;
+    qemu_coroutine_enter(data->co, NULL);
+}
+
+/* Returns -ENOTSUP if the ring cannot handle requests of this type */
+static int coroutine_fn raw_luring_submit_co(BlockDriverState *bs,
+        LuringState *ring, int64_t sector_num, int nb_sectors, int type)
+{
+    BDRVRawState *s = bs->opaque;
+    RawLuringCo data = {
+        .co     = qemu_coroutine_self(),
+        .ret    = -EINPROGRESS,
+    };
+
+    if (!luring_submit(bs, ring, s->fd, sector_num, NULL, nb_sectors,
+                       raw_luring_co_cb, &data, type)) {
+        return -ENOTSUP;
+    }
+    qemu_coroutine_yield();
+    return data.ret;
+}
+#endif
+
 static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockCompletionFunc *cb, void *opaque, int type)
@@ -1324,38 +1409,73 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Misaligned requests need the bounce buffer of the thread pool path */
+    if (!(type & QEMU_AIO_MISALIGNED)) {
+        LuringState *ring = raw_get_luring(bs);
+        if (ring) {
+            return luring_submit(bs, ring, s->fd, sector_num, qiov,
+                                 nb_sectors, cb, opaque, type);
+        }
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *ring = raw_get_luring(bs);
+#endif
 #ifdef CONFIG_LINUX_AIO
     BDRVRawState *s = bs->opaque;
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (ring) {
+        luring_io_plug(bs, ring);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *ring = raw_get_luring(bs);
+#endif
 #ifdef CONFIG_LINUX_AIO
     BDRVRawState *s = bs->opaque;
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (ring) {
+        luring_io_unplug(bs, ring, true);
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *ring = raw_get_luring(bs);
+#endif
 #ifdef CONFIG_LINUX_AIO
     BDRVRawState *s = bs->opaque;
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (ring) {
+        luring_io_unplug(bs, ring, false);
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -1378,10 +1498,21 @@ static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockCompletionFunc *cb, void *opaque)
 {
     BDRVRawState *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *ring;
+#endif
 
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    ring = raw_get_luring(bs);
+    if (ring) {
+        return luring_submit(bs, ring, s->fd, 0, NULL, 0, cb, opaque,
+                             QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1882,6 +2013,22 @@ static int coroutine_fn raw_co_write_zeroes(
     BDRVRawState *s = bs->opaque;
 
     if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+#ifdef CONFIG_LINUX_IO_URING
+        LuringState *ring = raw_get_luring(bs);
+        bool is_xfs = false;
+#ifdef CONFIG_XFS
+        is_xfs = s->is_xfs;
+#endif
+        /* Only FALLOC_FL_ZERO_RANGE on regular files is done in the ring,
+         * everything else is left to the fallbacks in the thread pool */
+        if (ring && s->has_write_zeroes && !is_xfs) {
+            int ret = raw_luring_submit_co(bs, ring, sector_num, nb_sectors,
+                                           QEMU_AIO_WRITE_ZEROES);
+            if (ret != -ENOTSUP && ret != -EINVAL) {
+                return ret;
+            }
+        }
+#endif
         return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
                               QEMU_AIO_WRITE_ZEROES);
     } else if (s->discard_zeroes) {
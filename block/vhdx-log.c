@@ -832,22 +832,47 @@ static void vhdx_log_raw_to_le_sector(VHDXLogDescriptor *desc,
 }
 
 
+/* Returns the number of log data sectors needed for @range */
+static uint32_t vhdx_log_range_sectors(VHDXLogRange *range)
+{
+    uint32_t sector_offset = range->offset % VHDX_LOG_SECTOR_SIZE;
+    uint32_t aligned_length = range->length;
+    uint32_t leading_length;
+    uint32_t sectors = 0;
+
+    /* add in the unaligned head and tail bytes */
+    if (sector_offset) {
+        leading_length = (VHDX_LOG_SECTOR_SIZE - sector_offset);
+        leading_length = leading_length > range->length ? range->length
+                                                        : leading_length;
+        aligned_length -= leading_length;
+        sectors++;
+    }
+
+    sectors += DIV_ROUND_UP(aligned_length, VHDX_LOG_SECTOR_SIZE);
+    return sectors;
+}
+
+/*
+ * Writes a single log entry that contains all of @ranges, with one data
+ * descriptor per 4 KB sector of metadata.
+ */
 static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
-                          void *data, uint32_t length, uint64_t offset)
+                          VHDXLogRange *ranges, unsigned int count)
 {
     int ret = 0;
     void *buffer = NULL;
     void *merged_sector = NULL;
     void *data_tmp, *sector_write;
-    unsigned int i;
+    unsigned int i, r;
     int sector_offset;
-    uint32_t desc_sectors, sectors, total_length;
+    uint32_t desc_sectors, sectors, range_sectors, total_length;
     uint32_t sectors_written = 0;
     uint32_t aligned_length;
-    uint32_t leading_length = 0;
-    uint32_t trailing_length = 0;
-    uint32_t partial_sectors = 0;
+    uint32_t leading_length;
+    uint32_t trailing_length;
     uint32_t bytes_written = 0;
+    uint64_t length = 0;
     uint64_t file_offset;
     VHDXHeader *header;
     VHDXLogEntryHeader new_hdr;
@@ -859,6 +884,12 @@ static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
 
     /* need to have offset read data, and be on 4096 byte boundary */
 
+    sectors = 0;
+    for (r = 0; r < count; r++) {
+        length += ranges[r].length;
+        sectors += vhdx_log_range_sectors(&ranges[r]);
+    }
+
     if (length > header->log_length) {
         /* no log present.  we could create a log here instead of failing */
         ret = -EINVAL;
@@ -881,27 +912,6 @@ static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
         s->log.sequence = 1;
     }
 
-    sector_offset = offset % VHDX_LOG_SECTOR_SIZE;
-    file_offset = (offset / VHDX_LOG_SECTOR_SIZE) * VHDX_LOG_SECTOR_SIZE;
-
-    aligned_length = length;
-
-    /* add in the unaligned head and tail bytes */
-    if (sector_offset) {
-        leading_length = (VHDX_LOG_SECTOR_SIZE - sector_offset);
-        leading_length = leading_length > length ? length : leading_length;
-        aligned_length -= leading_length;
-        partial_sectors++;
-    }
-
-    sectors = aligned_length / VHDX_LOG_SECTOR_SIZE;
-    trailing_length = aligned_length - (sectors * VHDX_LOG_SECTOR_SIZE);
-    if (trailing_length) {
-        partial_sectors++;
-    }
-
-    sectors += partial_sectors;
-
     /* sectors is now how many sectors the data itself takes, not
      * including the header and descriptor metadata */
 
@@ -929,55 +939,73 @@ static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
 
     new_desc = buffer + sizeof(new_hdr);
     data_sector = buffer + (desc_sectors * VHDX_LOG_SECTOR_SIZE);
-    data_tmp = data;
 
     /* All log sectors are 4KB, so for any partial sectors we must
      * merge the data with preexisting data from the final file
      * destination */
     merged_sector = qemu_blockalign(bs, VHDX_LOG_SECTOR_SIZE);
 
-    for (i = 0; i < sectors; i++) {
-        new_desc->signature       = VHDX_LOG_DESC_SIGNATURE;
-        new_desc->sequence_number = s->log.sequence;
-        new_desc->file_offset     = file_offset;
-
-        if (i == 0 && leading_length) {
-            /* partial sector at the front of the buffer */
-            ret = bdrv_pread(bs->file->bs, file_offset, merged_sector,
-                             VHDX_LOG_SECTOR_SIZE);
-            if (ret < 0) {
-                goto exit;
-            }
-            memcpy(merged_sector + sector_offset, data_tmp, leading_length);
-            bytes_written = leading_length;
-            sector_write = merged_sector;
-        } else if (i == sectors - 1 && trailing_length) {
-            /* partial sector at the end of the buffer */
-            ret = bdrv_pread(bs->file->bs,
-                            file_offset,
-                            merged_sector + trailing_length,
-                            VHDX_LOG_SECTOR_SIZE - trailing_length);
-            if (ret < 0) {
-                goto exit;
-            }
-            memcpy(merged_sector, data_tmp, trailing_length);
-            bytes_written = trailing_length;
-            sector_write = merged_sector;
-        } else {
-            bytes_written = VHDX_LOG_SECTOR_SIZE;
-            sector_write = data_tmp;
+    for (r = 0; r < count; r++) {
+        sector_offset = ranges[r].offset % VHDX_LOG_SECTOR_SIZE;
+        file_offset = (ranges[r].offset / VHDX_LOG_SECTOR_SIZE) *
+                      VHDX_LOG_SECTOR_SIZE;
+        data_tmp = ranges[r].data;
+
+        aligned_length = ranges[r].length;
+        leading_length = 0;
+        if (sector_offset) {
+            leading_length = (VHDX_LOG_SECTOR_SIZE - sector_offset);
+            leading_length = leading_length > ranges[r].length ?
+                             ranges[r].length : leading_length;
+            aligned_length -= leading_length;
         }
+        trailing_length = aligned_length % VHDX_LOG_SECTOR_SIZE;
+        range_sectors = vhdx_log_range_sectors(&ranges[r]);
+
+        for (i = 0; i < range_sectors; i++) {
+            new_desc->signature       = VHDX_LOG_DESC_SIGNATURE;
+            new_desc->sequence_number = s->log.sequence;
+            new_desc->file_offset     = file_offset;
+
+            if (i == 0 && leading_length) {
+                /* partial sector at the front of the buffer */
+                ret = bdrv_pread(bs->file->bs, file_offset, merged_sector,
+                                 VHDX_LOG_SECTOR_SIZE);
+                if (ret < 0) {
+                    goto exit;
+                }
+                memcpy(merged_sector + sector_offset, data_tmp,
+                       leading_length);
+                bytes_written = leading_length;
+                sector_write = merged_sector;
+            } else if (i == range_sectors - 1 && trailing_length) {
+                /* partial sector at the end of the buffer */
+                ret = bdrv_pread(bs->file->bs,
+                                file_offset,
+                                merged_sector + trailing_length,
+                                VHDX_LOG_SECTOR_SIZE - trailing_length);
+                if (ret < 0) {
+                    goto exit;
+                }
+                memcpy(merged_sector, data_tmp, trailing_length);
+                bytes_written = trailing_length;
+                sector_write = merged_sector;
+            } else {
+                bytes_written = VHDX_LOG_SECTOR_SIZE;
+                sector_write = data_tmp;
+            }
 
-        /* populate the raw sector data into the proper structures,
-         * as well as update the descriptor, and convert to proper
-         * endianness */
-        vhdx_log_raw_to_le_sector(new_desc, data_sector, sector_write,
-                                  s->log.sequence);
+            /* populate the raw sector data into the proper structures,
+             * as well as update the descriptor, and convert to proper
+             * endianness */
+            vhdx_log_raw_to_le_sector(new_desc, data_sector, sector_write,
+                                      s->log.sequence);
 
-        data_tmp += bytes_written;
-        data_sector++;
-        new_desc++;
-        file_offset += VHDX_LOG_SECTOR_SIZE;
+            data_tmp += bytes_written;
+            data_sector++;
+            new_desc++;
+            file_offset += VHDX_LOG_SECTOR_SIZE;
+        }
     }
 
     /* checksum covers entire entry, from the log header through the
@@ -1008,9 +1036,12 @@ exit:
     return ret;
 }
 
-/* Perform a log write, and then immediately flush the entire log */
+/*
+ * Perform a log write of all @ranges as a single log entry, and then
+ * immediately flush the entire log
+ */
 int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
-                             void *data, uint32_t length, uint64_t offset)
+                             VHDXLogRange *ranges, unsigned int count)
 {
     int ret = 0;
     VHDXLogSequence logs = { .valid = true,
@@ -1021,7 +1052,7 @@ int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
     /* Make sure data written (new and/or changed blocks) is stable
      * on disk, before creating log entry */
     bdrv_flush(bs);
-    ret = vhdx_log_write(bs, s, data, length, offset);
+    ret = vhdx_log_write(bs, s, ranges, count);
     if (ret < 0) {
         goto exit;
     }
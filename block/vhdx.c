@@ -22,6 +22,7 @@
 #include "qemu/crc32c.h"
 #include "block/vhdx.h"
 #include "migration/migration.h"
+#include "qemu/bitmap.h"
 
 #include <uuid/uuid.h>
 #include <glib.h>
@@ -878,6 +879,8 @@ static void vhdx_close(BlockDriverState *bs)
     s->headers[1] = NULL;
     qemu_vfree(s->bat);
     s->bat = NULL;
+    g_free(s->bat_dirty);
+    s->bat_dirty = NULL;
     qemu_vfree(s->parent_entries);
     s->parent_entries = NULL;
     migrate_del_blocker(s->migration_blocker);
@@ -901,6 +904,8 @@ static int vhdx_open(BlockDriverState *bs, QDict *options, int flags,
 
     qemu_co_mutex_init(&s->lock);
     QLIST_INIT(&s->regions);
+    QLIST_INIT(&s->allocs_in_flight);
+    qemu_co_queue_init(&s->bat_commit_queue);
 
     /* validate the file signature */
     ret = bdrv_pread(bs->file->bs, 0, &signature, sizeof(uint64_t));
@@ -967,6 +972,9 @@ static int vhdx_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    s->bat_dirty = bitmap_new(DIV_ROUND_UP(s->bat_rt.length,
+                                           VHDX_LOG_SECTOR_SIZE));
+
     uint64_t payblocks = s->chunk_ratio;
     /* endian convert, and verify populated BAT field file offsets against
      * region table and log entries */
@@ -1077,19 +1085,48 @@ static int vhdx_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 }
 
 
+/* Returns the allocating write in flight for @bat_idx, if any */
+static VHDXAllocInFlight *vhdx_find_alloc_in_flight(BDRVVHDXState *s,
+                                                    uint32_t bat_idx)
+{
+    VHDXAllocInFlight *alloc;
+
+    QLIST_FOREACH(alloc, &s->allocs_in_flight, next) {
+        if (alloc->bat_idx == bat_idx) {
+            return alloc;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the BAT entry for @bat_idx as seen by reads: a block that is being
+ * allocated only becomes visible once its data has been written.
+ */
+static VHDXBatEntry vhdx_bat_entry_for_read(BDRVVHDXState *s, uint32_t bat_idx)
+{
+    VHDXAllocInFlight *alloc = vhdx_find_alloc_in_flight(s, bat_idx);
+
+    return alloc ? alloc->old_entry : s->bat[bat_idx];
+}
+
+/*
+ * Reads don't take s->lock: the block translation only uses the in-memory
+ * BAT and never yields, so reads of fully present blocks are issued
+ * concurrently with each other and with writes.
+ */
 static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
                                       int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVHDXState *s = bs->opaque;
     int ret = 0;
     VHDXSectorInfo sinfo;
+    VHDXBatEntry bat_entry;
     uint64_t bytes_done = 0;
     QEMUIOVector hd_qiov;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (nb_sectors > 0) {
         /* We are a differencing file, so we need to inspect the sector bitmap
          * to see if we have the data or not */
@@ -1099,12 +1136,13 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto exit;
         } else {
             vhdx_block_translate(s, sector_num, nb_sectors, &sinfo);
+            bat_entry = vhdx_bat_entry_for_read(s, sinfo.bat_idx);
 
             qemu_iovec_reset(&hd_qiov);
             qemu_iovec_concat(&hd_qiov, qiov,  bytes_done, sinfo.bytes_avail);
 
             /* check the payload block state */
-            switch (s->bat[sinfo.bat_idx] & VHDX_BAT_STATE_BIT_MASK) {
+            switch (bat_entry & VHDX_BAT_STATE_BIT_MASK) {
             case PAYLOAD_BLOCK_NOT_PRESENT: /* fall through */
             case PAYLOAD_BLOCK_UNDEFINED:
             case PAYLOAD_BLOCK_UNMAPPED:
@@ -1114,11 +1152,9 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
                 qemu_iovec_memset(&hd_qiov, 0, 0, sinfo.bytes_avail);
                 break;
             case PAYLOAD_BLOCK_FULLY_PRESENT:
-                qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_co_readv(bs->file->bs,
                                     sinfo.file_offset >> BDRV_SECTOR_BITS,
                                     sinfo.sectors_avail, &hd_qiov);
-                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     goto exit;
                 }
@@ -1138,7 +1174,6 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
     }
     ret = 0;
 exit:
-    qemu_co_mutex_unlock(&s->lock);
     qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
@@ -1203,6 +1238,125 @@ int vhdx_user_visible_write(BlockDriverState *bs, BDRVVHDXState *s)
     return ret;
 }
 
+#define VHDX_BAT_ENTRIES_PER_LOG_SECTOR \
+    (VHDX_LOG_SECTOR_SIZE / sizeof(VHDXBatEntry))
+
+/* Maximum number of BAT sectors written with a single log entry */
+#define VHDX_BAT_LOG_MAX_SECTORS 64
+
+/* Marks the BAT sector that contains @bat_idx for the next log write, and
+ * returns the generation to wait for with vhdx_co_bat_commit() */
+static uint64_t vhdx_bat_mark_dirty(BDRVVHDXState *s, uint32_t bat_idx)
+{
+    set_bit(bat_idx / VHDX_BAT_ENTRIES_PER_LOG_SECTOR, s->bat_dirty);
+    return ++s->bat_dirty_gen;
+}
+
+/*
+ * Writes all dirty BAT sectors through the log, at most
+ * VHDX_BAT_LOG_MAX_SECTORS per log entry.
+ *
+ * Called with s->lock held.  The lock is dropped for the log I/O, so the
+ * dirty sectors are copied first; entries of blocks whose data is still
+ * being written are logged with their old value.
+ */
+static int coroutine_fn vhdx_co_bat_log_dirty(BlockDriverState *bs,
+                                              BDRVVHDXState *s)
+{
+    uint64_t nb_sectors = DIV_ROUND_UP(s->bat_rt.length, VHDX_LOG_SECTOR_SIZE);
+    uint64_t sector;
+    VHDXLogRange *ranges;
+    VHDXBatEntry *buf;
+    uint32_t length;
+    unsigned int count = 0, done, n, i;
+    int ret = 0;
+
+    for (sector = find_first_bit(s->bat_dirty, nb_sectors);
+         sector < nb_sectors;
+         sector = find_next_bit(s->bat_dirty, nb_sectors, sector + 1)) {
+        count++;
+    }
+
+    ranges = g_new(VHDXLogRange, count);
+    count = 0;
+    for (sector = find_first_bit(s->bat_dirty, nb_sectors);
+         sector < nb_sectors;
+         sector = find_next_bit(s->bat_dirty, nb_sectors, sector + 1)) {
+        length = MIN(VHDX_LOG_SECTOR_SIZE,
+                     s->bat_rt.length - sector * VHDX_LOG_SECTOR_SIZE);
+        buf = qemu_blockalign(bs, length);
+        for (i = 0; i < length / sizeof(VHDXBatEntry); i++) {
+            buf[i] = cpu_to_le64(vhdx_bat_entry_for_read(s,
+                        sector * VHDX_BAT_ENTRIES_PER_LOG_SECTOR + i));
+        }
+        ranges[count++] = (VHDXLogRange) {
+            .data   = buf,
+            .length = length,
+            .offset = s->bat_offset + sector * VHDX_LOG_SECTOR_SIZE,
+        };
+        clear_bit(sector, s->bat_dirty);
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    for (done = 0; done < count; done += n) {
+        n = MIN(count - done, VHDX_BAT_LOG_MAX_SECTORS);
+        ret = vhdx_log_write_and_flush(bs, s, ranges + done, n);
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_co_mutex_lock(&s->lock);
+
+    /* try again with the next commit */
+    for (i = done; i < count; i++) {
+        set_bit((ranges[i].offset - s->bat_offset) / VHDX_LOG_SECTOR_SIZE,
+                s->bat_dirty);
+    }
+
+    for (i = 0; i < count; i++) {
+        qemu_vfree(ranges[i].data);
+    }
+    g_free(ranges);
+    return ret;
+}
+
+/*
+ * Waits until the BAT updates up to generation @gen are on disk.
+ *
+ * BAT updates are group committed: while one coroutine writes the log, the
+ * allocating writes that complete in the meantime mark their BAT sectors
+ * dirty and wait, and the first of them to wake up writes all of their
+ * updates with a single log entry.
+ *
+ * Called with s->lock held.
+ */
+static int coroutine_fn vhdx_co_bat_commit(BlockDriverState *bs,
+                                           BDRVVHDXState *s, uint64_t gen)
+{
+    uint64_t target;
+    int ret;
+
+    while (s->bat_commit_gen < gen) {
+        if (s->bat_commit_in_progress) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&s->bat_commit_queue);
+            qemu_co_mutex_lock(&s->lock);
+            continue;
+        }
+
+        s->bat_commit_in_progress = true;
+        target = s->bat_dirty_gen;
+        ret = vhdx_co_bat_log_dirty(bs, s);
+        s->bat_commit_in_progress = false;
+        qemu_co_queue_restart_all(&s->bat_commit_queue);
+        if (ret < 0) {
+            return ret;
+        }
+        s->bat_commit_gen = MAX(s->bat_commit_gen, target);
+    }
+    return 0;
+}
+
 static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                                       int nb_sectors, QEMUIOVector *qiov)
 {
@@ -1219,6 +1373,10 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     int bat_state;
     uint64_t bat_prior_offset = 0;
     bool bat_update = false;
+    VHDXAllocInFlight alloc;
+    VHDXAllocInFlight *other_alloc;
+    uint64_t commit_gen = 0;
+    int commit_ret;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
@@ -1240,6 +1398,16 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             vhdx_block_translate(s, sector_num, nb_sectors, &sinfo);
             sectors_to_write = sinfo.sectors_avail;
 
+            /* Reads don't see a block before its allocating write has
+             * written the data, so neither may a write to it complete */
+            other_alloc = vhdx_find_alloc_in_flight(s, sinfo.bat_idx);
+            if (other_alloc) {
+                qemu_co_mutex_unlock(&s->lock);
+                qemu_co_queue_wait(&other_alloc->waiters);
+                qemu_co_mutex_lock(&s->lock);
+                continue;
+            }
+
             qemu_iovec_reset(&hd_qiov);
             /* check the payload block state */
             bat_state = s->bat[sinfo.bat_idx] & VHDX_BAT_STATE_BIT_MASK;
@@ -1296,6 +1464,12 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                 if (ret < 0) {
                     goto exit;
                 }
+                /* reads keep seeing the old entry until the data is
+                 * written */
+                alloc.bat_idx = sinfo.bat_idx;
+                alloc.old_entry = s->bat[sinfo.bat_idx];
+                qemu_co_queue_init(&alloc.waiters);
+                QLIST_INSERT_HEAD(&s->allocs_in_flight, &alloc, next);
                 /* once we support differencing files, this may also be
                  * partially present */
                 /* update block state to the newly specified state */
@@ -1324,6 +1498,7 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                 }
                 /* block exists, so we can just overwrite it */
                 qemu_co_mutex_unlock(&s->lock);
+                BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
                 ret = bdrv_co_writev(bs->file->bs,
                                     sinfo.file_offset >> BDRV_SECTOR_BITS,
                                     sectors_to_write, &hd_qiov);
@@ -1342,14 +1517,12 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             }
 
             if (bat_update) {
-                /* this will update the BAT entry into the log journal, and
-                 * then flush the log journal out to disk */
-                ret =  vhdx_log_write_and_flush(bs, s, &bat_entry,
-                                                sizeof(VHDXBatEntry),
-                                                bat_entry_offset);
-                if (ret < 0) {
-                    goto exit;
-                }
+                /* the BAT entry goes into the log journal together with
+                 * the updates of other allocating writes, see
+                 * vhdx_co_bat_commit() */
+                QLIST_REMOVE(&alloc, next);
+                qemu_co_queue_restart_all(&alloc.waiters);
+                commit_gen = vhdx_bat_mark_dirty(s, sinfo.bat_idx);
             }
 
             nb_sectors -= sinfo.sectors_avail;
@@ -1365,11 +1538,20 @@ error_bat_restore:
     if (bat_update) {
         /* keep metadata in sync, and restore the bat entry state
          * if error. */
+        QLIST_REMOVE(&alloc, next);
+        qemu_co_queue_restart_all(&alloc.waiters);
         sinfo.file_offset = bat_prior_offset;
         vhdx_update_bat_table_entry(bs, s, &sinfo, &bat_entry,
                                     &bat_entry_offset, bat_state);
     }
 exit:
+    if (commit_gen) {
+        /* blocks allocated before an error still need their BAT entries */
+        commit_ret = vhdx_co_bat_commit(bs, s, commit_gen);
+        if (ret >= 0) {
+            ret = commit_ret;
+        }
+    }
     qemu_vfree(iov1.iov_base);
     qemu_vfree(iov2.iov_base);
     qemu_co_mutex_unlock(&s->lock);
@@ -1377,6 +1559,22 @@ exit:
     return ret;
 }
 
+/*
+ * Writes the BAT updates of completed allocating writes that are still
+ * waiting for a group commit, or waits for the commit that is writing them.
+ */
+static coroutine_fn int vhdx_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVVHDXState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = vhdx_co_bat_commit(bs, s, s->bat_dirty_gen);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
 
 
 /*
@@ -1961,6 +2159,7 @@ static BlockDriver bdrv_vhdx = {
     .bdrv_reopen_prepare    = vhdx_reopen_prepare,
     .bdrv_co_readv          = vhdx_co_readv,
     .bdrv_co_writev         = vhdx_co_writev,
+    .bdrv_co_flush_to_os    = vhdx_co_flush_to_os,
     .bdrv_create            = vhdx_create,
     .bdrv_get_info          = vhdx_get_info,
     .bdrv_check             = vhdx_check,
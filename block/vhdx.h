@@ -355,7 +355,23 @@ typedef struct VHDXRegionEntry {
     QLIST_ENTRY(VHDXRegionEntry) entries;
 } VHDXRegionEntry;
 
+/* A payload block whose data is being written by an allocating write */
+typedef struct VHDXAllocInFlight {
+    uint32_t bat_idx;
+    VHDXBatEntry old_entry;     /* BAT entry before the allocation */
+    CoQueue waiters;            /* other writes to the block */
+    QLIST_ENTRY(VHDXAllocInFlight) next;
+} VHDXAllocInFlight;
+
+/* A range of metadata to be written through the log */
+typedef struct VHDXLogRange {
+    void *data;
+    uint32_t length;
+    uint64_t offset;
+} VHDXLogRange;
+
 typedef struct BDRVVHDXState {
+    /* Serializes writes and metadata updates; reads don't take it */
     CoMutex lock;
 
     int curr_header;
@@ -386,6 +402,22 @@ typedef struct BDRVVHDXState {
     VHDXBatEntry *bat;
     uint64_t bat_offset;
 
+    /* Blocks allocated by writes that haven't finished writing their data.
+     * Their entries in @bat already point to the new block, but reads and
+     * the log still use the old entries, and other writes to these blocks
+     * wait until the data is written. */
+    QLIST_HEAD(, VHDXAllocInFlight) allocs_in_flight;
+
+    /* BAT updates are written through the log in batches: log sectors of the
+     * BAT (4 KB each) that need to be logged, a generation number that is
+     * incremented whenever one is marked dirty, and the generation up to
+     * which the BAT is on disk */
+    unsigned long *bat_dirty;
+    uint64_t bat_dirty_gen;
+    uint64_t bat_commit_gen;
+    bool bat_commit_in_progress;
+    CoQueue bat_commit_queue;
+
     bool first_visible_write;
     MSGUID session_guid;
 
@@ -416,7 +448,7 @@ int vhdx_parse_log(BlockDriverState *bs, BDRVVHDXState *s, bool *flushed,
                    Error **errp);
 
 int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
-                             void *data, uint32_t length, uint64_t offset);
+                             VHDXLogRange *ranges, unsigned int count);
 
 static inline void leguid_to_cpus(MSGUID *guid)
 {
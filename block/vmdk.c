@@ -55,6 +55,11 @@
 
 #define BLOCK_OPT_ZEROED_GRAIN "zeroed_grain"
 
+#define VMDK_OPT_L2_CACHE_SIZE "l2-cache-size"
+
+/* Grain table cache size in bytes, shared by all sparse extents */
+#define DEFAULT_L2_CACHE_SIZE (1 * 1024 * 1024)
+
 typedef struct {
     uint32_t version;
     uint32_t flags;
@@ -85,8 +90,6 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
-
 typedef struct VmdkExtent {
     BdrvChild *file;
     bool flat;
@@ -105,9 +108,17 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+
+    /* Grain table cache with l2_cache_tables slots of l2_size entries */
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    unsigned int l2_cache_tables;
+    /* Grain table offset (in sectors) cached in each slot, 0 if unused */
+    uint32_t *l2_cache_offsets;
+    /* Last use of each slot, for LRU eviction */
+    uint64_t *l2_cache_lru;
+    uint64_t l2_cache_lru_counter;
+    /* Maps grain table offsets to their slot index plus one */
+    GHashTable *l2_cache_index;
 
     int64_t cluster_sectors;
     int64_t next_cluster_sector;
@@ -115,6 +126,10 @@ typedef struct VmdkExtent {
 } VmdkExtent;
 
 typedef struct BDRVVmdkState {
+    /*
+     * Protects allocations and loading grain tables into the cache.  Reads
+     * whose grain table is cached don't take the lock.
+     */
     CoMutex lock;
     uint64_t desc_offset;
     bool cid_updated;
@@ -210,6 +225,91 @@ static int vmdk_probe(const uint8_t *buf, int buf_size, const char *filename)
 #define BUF_SIZE 4096
 #define HEADER_SIZE 512                 /* first sector of 512 bytes */
 
+static int vmdk_l2_cache_init(VmdkExtent *extent, uint64_t cache_size,
+                              Error **errp)
+{
+    uint64_t table_bytes = extent->l2_size * sizeof(uint32_t);
+    uint64_t tables;
+
+    /* No point in caching more grain tables than the extent has */
+    tables = MIN(cache_size / table_bytes, extent->l1_size);
+    tables = MAX(tables, 1);
+
+    extent->l2_cache = g_try_malloc(tables * table_bytes);
+    if (extent->l2_cache == NULL) {
+        error_setg(errp, "Could not allocate grain table cache for "
+                   "extent '%s'", extent->file->bs->filename);
+        return -ENOMEM;
+    }
+    extent->l2_cache_tables = tables;
+    extent->l2_cache_offsets = g_new0(uint32_t, tables);
+    extent->l2_cache_lru = g_new0(uint64_t, tables);
+    extent->l2_cache_lru_counter = 0;
+    extent->l2_cache_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    return 0;
+}
+
+static void vmdk_l2_cache_free(VmdkExtent *extent)
+{
+    g_free(extent->l2_cache);
+    g_free(extent->l2_cache_offsets);
+    g_free(extent->l2_cache_lru);
+    if (extent->l2_cache_index) {
+        g_hash_table_destroy(extent->l2_cache_index);
+    }
+}
+
+/* Returns the cache slot of the grain table at @l2_offset, or -1 */
+static int vmdk_l2_cache_find(VmdkExtent *extent, uint32_t l2_offset)
+{
+    gpointer slot;
+
+    slot = g_hash_table_lookup(extent->l2_cache_index,
+                               GUINT_TO_POINTER(l2_offset));
+    return slot ? GPOINTER_TO_UINT(slot) - 1 : -1;
+}
+
+/*
+ * Reads the grain table at @l2_offset into the least recently used slot of
+ * the cache.  Must be called with s->lock held.
+ *
+ * Returns the cached table, or NULL on I/O error.
+ */
+static uint32_t *vmdk_l2_cache_load(VmdkExtent *extent, uint32_t l2_offset)
+{
+    unsigned int i, victim = 0;
+    uint32_t *l2_table;
+    int ret;
+
+    for (i = 1; i < extent->l2_cache_tables; i++) {
+        if (extent->l2_cache_lru[i] < extent->l2_cache_lru[victim]) {
+            victim = i;
+        }
+    }
+
+    /* Unmap the slot before overwriting it, so that lookups without the
+     * lock never see a partially loaded table */
+    if (extent->l2_cache_offsets[victim]) {
+        g_hash_table_remove(extent->l2_cache_index,
+                            GUINT_TO_POINTER(extent->l2_cache_offsets[victim]));
+        extent->l2_cache_offsets[victim] = 0;
+        extent->l2_cache_lru[victim] = 0;
+    }
+
+    l2_table = extent->l2_cache + (size_t)victim * extent->l2_size;
+    ret = bdrv_pread(extent->file->bs, (int64_t)l2_offset * 512, l2_table,
+                     extent->l2_size * sizeof(uint32_t));
+    if (ret != extent->l2_size * sizeof(uint32_t)) {
+        return NULL;
+    }
+
+    extent->l2_cache_offsets[victim] = l2_offset;
+    extent->l2_cache_lru[victim] = ++extent->l2_cache_lru_counter;
+    g_hash_table_insert(extent->l2_cache_index, GUINT_TO_POINTER(l2_offset),
+                        GUINT_TO_POINTER(victim + 1));
+    return l2_table;
+}
+
 static void vmdk_free_extents(BlockDriverState *bs)
 {
     int i;
@@ -219,7 +319,7 @@ static void vmdk_free_extents(BlockDriverState *bs)
     for (i = 0; i < s->num_extents; i++) {
         e = &s->extents[i];
         g_free(e->l1_table);
-        g_free(e->l2_cache);
+        vmdk_l2_cache_free(e);
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -476,8 +576,6 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
-    extent->l2_cache =
-        g_new(uint32_t, extent->l2_size * L2_CACHE_SIZE);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -925,17 +1023,45 @@ exit:
     return ret;
 }
 
+static QemuOptsList vmdk_runtime_opts = {
+    .name = "vmdk",
+    .head = QTAILQ_HEAD_INITIALIZER(vmdk_runtime_opts.head),
+    .desc = {
+        {
+            .name = VMDK_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum grain table cache size",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
-    char *buf;
+    char *buf = NULL;
     int ret;
     BDRVVmdkState *s = bs->opaque;
     uint32_t magic;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t l2_cache_size;
+    int i, sparse_extents;
+
+    opts = qemu_opts_create(&vmdk_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+    l2_cache_size = qemu_opt_get_size(opts, VMDK_OPT_L2_CACHE_SIZE,
+                                      DEFAULT_L2_CACHE_SIZE);
 
     buf = vmdk_read_desc(bs->file->bs, 0, errp);
     if (!buf) {
-        return -EINVAL;
+        ret = -EINVAL;
+        goto fail;
     }
 
     magic = ldl_be_p(buf);
@@ -954,6 +1080,24 @@ static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* split the grain table cache evenly among the sparse extents */
+    sparse_extents = 0;
+    for (i = 0; i < s->num_extents; i++) {
+        if (!s->extents[i].flat) {
+            sparse_extents++;
+        }
+    }
+    for (i = 0; i < s->num_extents; i++) {
+        if (s->extents[i].flat) {
+            continue;
+        }
+        ret = vmdk_l2_cache_init(&s->extents[i],
+                                 l2_cache_size / sparse_extents, errp);
+        if (ret) {
+            goto fail;
+        }
+    }
+
     /* try to open parent images, if exist */
     ret = vmdk_parent_open(bs);
     if (ret) {
@@ -969,10 +1113,12 @@ static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
                bdrv_get_device_or_node_name(bs));
     migrate_add_blocker(s->migration_blocker);
     g_free(buf);
+    qemu_opts_del(opts);
     return 0;
 
 fail:
     g_free(buf);
+    qemu_opts_del(opts);
     g_free(s->create_type);
     s->create_type = NULL;
     vmdk_free_extents(bs);
@@ -1136,8 +1282,8 @@ static int get_cluster_offset(BlockDriverState *bs,
                               uint64_t skip_end_sector)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table;
+    int slot;
+    uint32_t *l2_table;
     bool zeroed = false;
     int64_t ret;
     int64_t cluster_sector;
@@ -1159,40 +1305,18 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
-        }
-    }
-    /* not found: load a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
-            min_index = i;
+    slot = vmdk_l2_cache_find(extent, l2_offset);
+    if (slot >= 0) {
+        extent->l2_cache_lru[slot] = ++extent->l2_cache_lru_counter;
+        l2_table = extent->l2_cache + (size_t)slot * extent->l2_size;
+    } else {
+        /* not found: load it in the least recently used slot */
+        l2_table = vmdk_l2_cache_load(extent, l2_offset);
+        if (!l2_table) {
+            return VMDK_ERROR;
         }
     }
-    l2_table = extent->l2_cache + (min_index * extent->l2_size);
-    if (bdrv_pread(
-                extent->file->bs,
-                (int64_t)l2_offset * 512,
-                l2_table,
-                extent->l2_size * sizeof(uint32_t)
-            ) != extent->l2_size * sizeof(uint32_t)) {
-        return VMDK_ERROR;
-    }
 
-    extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
- found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     cluster_sector = le32_to_cpu(l2_table[l2_index]);
 
@@ -1260,6 +1384,54 @@ static inline uint64_t vmdk_find_index_in_cluster(VmdkExtent *extent,
     return index_in_cluster;
 }
 
+/*
+ * Returns true if get_cluster_offset() can look up @offset without loading a
+ * grain table, i.e. without yielding, as long as @allocate is false.
+ */
+static bool vmdk_lookup_is_cached(VmdkExtent *extent, uint64_t offset)
+{
+    unsigned int l1_index;
+    uint32_t l2_offset;
+
+    if (extent->flat) {
+        return true;
+    }
+
+    offset -= (extent->end_sector - extent->sectors) * SECTOR_SIZE;
+    l1_index = (offset >> 9) / extent->l1_entry_sectors;
+    if (l1_index >= extent->l1_size) {
+        return true;
+    }
+    l2_offset = extent->l1_table[l1_index];
+    return !l2_offset || vmdk_l2_cache_find(extent, l2_offset) >= 0;
+}
+
+/*
+ * Looks up the cluster offset for reading.  Lookups that hit the grain table
+ * cache complete without yielding, so they don't need s->lock and can proceed
+ * while a write is in flight; an allocating write only updates the cached
+ * table after the new cluster has been written.
+ */
+static int coroutine_fn vmdk_co_lookup_cluster(BlockDriverState *bs,
+                                               VmdkExtent *extent,
+                                               uint64_t offset,
+                                               uint64_t *cluster_offset)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int ret;
+
+    if (vmdk_lookup_is_cached(extent, offset)) {
+        return get_cluster_offset(bs, extent, NULL, offset, false,
+                                  cluster_offset, 0, 0);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = get_cluster_offset(bs, extent, NULL, offset, false,
+                             cluster_offset, 0, 0);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
 static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum, BlockDriverState **file)
 {
@@ -1272,11 +1444,7 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
     if (!extent) {
         return 0;
     }
-    qemu_co_mutex_lock(&s->lock);
-    ret = get_cluster_offset(bs, extent, NULL,
-                             sector_num * 512, false, &offset,
-                             0, 0);
-    qemu_co_mutex_unlock(&s->lock);
+    ret = vmdk_co_lookup_cluster(bs, extent, sector_num * 512, &offset);
 
     index_in_cluster = vmdk_find_index_in_cluster(extent, sector_num);
     switch (ret) {
@@ -1309,36 +1477,39 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
 }
 
 static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, const uint8_t *buf,
-                            int nb_sectors, int64_t sector_num)
+                            int64_t offset_in_cluster, QEMUIOVector *qiov,
+                            int64_t sector_num)
 {
     int ret;
     VmdkGrainMarker *data = NULL;
     uLongf buf_len;
-    const uint8_t *write_buf = buf;
-    int write_len = nb_sectors * 512;
+    uint8_t *buf = NULL;
+    int write_len = qiov->size;
     int64_t write_offset;
     int64_t write_end_sector;
 
+    write_offset = cluster_offset + offset_in_cluster;
     if (extent->compressed) {
         if (!extent->has_marker) {
             ret = -EINVAL;
             goto out;
         }
+        buf = g_malloc(qiov->size);
+        qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
         buf_len = (extent->cluster_sectors << 9) * 2;
         data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
-        if (compress(data->data, &buf_len, buf, nb_sectors << 9) != Z_OK ||
+        if (compress(data->data, &buf_len, buf, qiov->size) != Z_OK ||
                 buf_len == 0) {
             ret = -EINVAL;
             goto out;
         }
         data->lba = sector_num;
         data->size = buf_len;
-        write_buf = (uint8_t *)data;
         write_len = buf_len + sizeof(VmdkGrainMarker);
+        ret = bdrv_pwrite(extent->file->bs, write_offset, data, write_len);
+    } else {
+        ret = bdrv_pwritev(extent->file->bs, write_offset, qiov);
     }
-    write_offset = cluster_offset + offset_in_cluster,
-    ret = bdrv_pwrite(extent->file->bs, write_offset, write_buf, write_len);
 
     write_end_sector = DIV_ROUND_UP(write_offset + write_len, BDRV_SECTOR_SIZE);
 
@@ -1356,12 +1527,14 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     ret = 0;
  out:
     g_free(data);
+    g_free(buf);
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+static int coroutine_fn vmdk_read_extent(VmdkExtent *extent,
+                                         int64_t cluster_offset,
+                                         int64_t offset_in_cluster,
+                                         QEMUIOVector *qiov, int nb_sectors)
 {
     int ret;
     int cluster_bytes, buf_bytes;
@@ -1373,14 +1546,11 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
 
 
     if (!extent->compressed) {
-        ret = bdrv_pread(extent->file->bs,
-                          cluster_offset + offset_in_cluster,
-                          buf, nb_sectors * 512);
-        if (ret == nb_sectors * 512) {
-            return 0;
-        } else {
-            return -EIO;
-        }
+        ret = bdrv_co_readv(extent->file->bs,
+                            (cluster_offset + offset_in_cluster)
+                                >> BDRV_SECTOR_BITS,
+                            nb_sectors, qiov);
+        return ret < 0 ? ret : 0;
     }
     cluster_bytes = extent->cluster_sectors * 512;
     /* Read two clusters in case GrainMarker + compressed data > one cluster */
@@ -1416,7 +1586,8 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
+    qemu_iovec_from_buf(qiov, 0, uncomp_buf + offset_in_cluster,
+                        nb_sectors * 512);
     ret = 0;
 
  out:
@@ -1425,70 +1596,78 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Reads run without s->lock except for grain table cache misses, so any
+ * number of them can be in flight at the same time, also concurrently with
+ * a write.
+ */
+static coroutine_fn int vmdk_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
     uint64_t n, index_in_cluster;
+    uint64_t bytes_done = 0;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    QEMUIOVector local_qiov;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto fail;
         }
-        ret = get_cluster_offset(bs, extent, NULL,
-                                 sector_num << 9, false, &cluster_offset,
-                                 0, 0);
+        ret = vmdk_co_lookup_cluster(bs, extent, sector_num << 9,
+                                     &cluster_offset);
         index_in_cluster = vmdk_find_index_in_cluster(extent, sector_num);
         n = extent->cluster_sectors - index_in_cluster;
         if (n > nb_sectors) {
             n = nb_sectors;
         }
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done, n * 512);
+
         if (ret != VMDK_OK) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing && ret != VMDK_ZEROED) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    goto fail;
                 }
-                ret = bdrv_read(bs->backing->bs, sector_num, buf, n);
+                ret = bdrv_co_readv(bs->backing->bs, sector_num, n,
+                                    &local_qiov);
                 if (ret < 0) {
-                    return ret;
+                    goto fail;
                 }
             } else {
-                memset(buf, 0, 512 * n);
+                qemu_iovec_memset(&local_qiov, 0, 0, n * 512);
             }
         } else {
             ret = vmdk_read_extent(extent,
                             cluster_offset, index_in_cluster * 512,
-                            buf, n);
+                            &local_qiov, n);
             if (ret) {
-                return ret;
+                goto fail;
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+fail:
+    qemu_iovec_destroy(&local_qiov);
     return ret;
 }
 
 /**
  * vmdk_write:
- * @zeroed:       buf is ignored (data is zero), use zeroed_grain GTE feature
+ * @zeroed:       qiov is ignored (data is zero), use zeroed_grain GTE feature
  *                if possible, otherwise return -ENOTSUP.
  * @zero_dry_run: used for zeroed == true only, don't update L2 table, just try
  *                with each cluster. By dry run we can find if the zero write
@@ -1497,15 +1676,17 @@ static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
  * Returns: error code with 0 for success.
  */
 static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                      const uint8_t *buf, int nb_sectors,
+                      QEMUIOVector *qiov, int nb_sectors,
                       bool zeroed, bool zero_dry_run)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
     int ret;
     int64_t index_in_cluster, n;
+    uint64_t bytes_done = 0;
     uint64_t cluster_offset;
     VmdkMetaData m_data;
+    QEMUIOVector local_qiov;
 
     if (sector_num > bs->total_sectors) {
         error_report("Wrong offset: sector_num=0x%" PRIx64
@@ -1514,10 +1695,13 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     }
 
+    qemu_iovec_init(&local_qiov, zeroed ? 0 : qiov->niov);
+
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto fail;
         }
         index_in_cluster = vmdk_find_index_in_cluster(extent, sector_num);
         n = extent->cluster_sectors - index_in_cluster;
@@ -1533,7 +1717,8 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                 /* Refuse write to allocated cluster for streamOptimized */
                 error_report("Could not write to allocated cluster"
                               " for streamOptimized");
-                return -EIO;
+                ret = -EIO;
+                goto fail;
             } else {
                 /* allocate */
                 ret = get_cluster_offset(bs, extent, &m_data, sector_num << 9,
@@ -1541,10 +1726,11 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
             }
         }
         if (ret == VMDK_ERROR) {
-            return -EINVAL;
+            ret = -EINVAL;
+            goto fail;
         }
         if (zeroed) {
-            /* Do zeroed write, buf is ignored */
+            /* Do zeroed write, qiov is ignored */
             if (extent->has_zero_grain &&
                     index_in_cluster == 0 &&
                     n >= extent->cluster_sectors) {
@@ -1553,52 +1739,62 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                     /* update L2 tables */
                     if (vmdk_L2update(extent, &m_data, VMDK_GTE_ZEROED)
                             != VMDK_OK) {
-                        return -EIO;
+                        ret = -EIO;
+                        goto fail;
                     }
                 }
             } else {
-                return -ENOTSUP;
+                ret = -ENOTSUP;
+                goto fail;
             }
         } else {
+            qemu_iovec_reset(&local_qiov);
+            qemu_iovec_concat(&local_qiov, qiov, bytes_done, n * 512);
+
             ret = vmdk_write_extent(extent,
                             cluster_offset, index_in_cluster * 512,
-                            buf, n, sector_num);
+                            &local_qiov, sector_num);
             if (ret) {
-                return ret;
+                goto fail;
             }
             if (m_data.valid) {
                 /* update L2 tables */
                 if (vmdk_L2update(extent, &m_data,
                                   cluster_offset >> BDRV_SECTOR_BITS)
                         != VMDK_OK) {
-                    return -EIO;
+                    ret = -EIO;
+                    goto fail;
                 }
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
 
         /* update CID on the first write every time the virtual disk is
          * opened */
         if (!s->cid_updated) {
             ret = vmdk_write_cid(bs, g_random_int());
             if (ret < 0) {
-                return ret;
+                goto fail;
             }
             s->cid_updated = true;
         }
     }
-    return 0;
+    ret = 0;
+
+fail:
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
 }
 
-static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
-                                      const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vmdk_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                       int nb_sectors, QEMUIOVector *qiov)
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
     qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+    ret = vmdk_write(bs, sector_num, qiov, nb_sectors, false, false);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -1609,8 +1805,15 @@ static int vmdk_write_compressed(BlockDriverState *bs,
                                  int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = (uint8_t *)buf,
+        .iov_len    = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+
     if (s->num_extents == 1 && s->extents[0].compressed) {
-        return vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        return vmdk_write(bs, sector_num, &qiov, nb_sectors, false, false);
     } else {
         return -ENOTSUP;
     }
@@ -2302,8 +2505,8 @@ static BlockDriver bdrv_vmdk = {
     .bdrv_open                    = vmdk_open,
     .bdrv_check                   = vmdk_check,
     .bdrv_reopen_prepare          = vmdk_reopen_prepare,
-    .bdrv_read                    = vmdk_co_read,
-    .bdrv_write                   = vmdk_co_write,
+    .bdrv_co_readv                = vmdk_co_readv,
+    .bdrv_co_writev               = vmdk_co_writev,
     .bdrv_write_compressed        = vmdk_write_compressed,
     .bdrv_co_write_zeroes         = vmdk_co_write_zeroes,
     .bdrv_close                   = vmdk_close,
@@ -27,6 +27,7 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "migration/migration.h"
+#include "qemu/bitmap.h"
 #if defined(CONFIG_UUID)
 #include <uuid/uuid.h>
 #endif
@@ -118,13 +119,15 @@ typedef struct vhd_dyndisk_header {
 } QEMU_PACKED VHDDynDiskHeader;
 
 typedef struct BDRVVPCState {
+    /* Serializes writes; reads run concurrently without taking it */
     CoMutex lock;
     uint8_t footer_buf[HEADER_SIZE];
     uint64_t free_data_block_offset;
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
+    /* Blocks whose sector bitmap is known to have all bits set */
+    unsigned long *bitmap_full;
 
     uint32_t block_size;
     uint32_t bitmap_size;
@@ -317,7 +320,7 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags,
             goto fail;
         }
 
-        s->last_bitmap_offset = (int64_t) -1;
+        s->bitmap_full = bitmap_new(s->max_table_entries);
 
 #ifdef CACHE
         s->pageentry_u8 = g_malloc(512);
@@ -339,6 +342,7 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags,
 
 fail:
     qemu_vfree(s->pagetable);
+    g_free(s->bitmap_full);
 #ifdef CACHE
     g_free(s->pageentry_u8);
 #endif
@@ -355,11 +359,10 @@ static int vpc_reopen_prepare(BDRVReopenState *state,
  * Returns the absolute byte offset of the given sector in the image file.
  * If the sector is not allocated, -1 is returned instead.
  *
- * The parameter write must be 1 if the offset will be used for a write
- * operation (the block bitmaps is updated then), 0 otherwise.
+ * This only looks at the in-memory BAT, so it never yields.
  */
 static inline int64_t get_sector_offset(BlockDriverState *bs,
-    int64_t sector_num, int write)
+    int64_t sector_num)
 {
     BDRVVPCState *s = bs->opaque;
     uint64_t offset = sector_num * 512;
@@ -375,20 +378,63 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     bitmap_offset = 512 * (uint64_t) s->pagetable[pagetable_index];
     block_offset = bitmap_offset + s->bitmap_size + (512 * pageentry_index);
 
-    // We must ensure that we don't write to any sectors which are marked as
-    // unused in the bitmap. We get away with setting all bits in the block
-    // bitmap each time we write to a new block. This might cause Virtual PC to
-    // miss sparse read optimization, but it's not a problem in terms of
-    // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
-        uint8_t bitmap[s->bitmap_size];
+    return block_offset;
+}
+
+/*
+ * Makes sure that all bits in the bitmap of an allocated block are set
+ * before writing to it.
+ *
+ * We must ensure that we don't write to any sectors which are marked as
+ * unused in the bitmap. We get away with setting all bits in the block
+ * bitmap each time we write to a new block. This might cause Virtual PC to
+ * miss sparse read optimization, but it's not a problem in terms of
+ * correctness.
+ *
+ * Blocks whose bitmap is known to be full are remembered in s->bitmap_full,
+ * so only the first write to a block after opening the image looks at the
+ * bitmap on disk, and it is only rewritten if some bit is actually clear.
+ *
+ * Returns 0 on success and < 0 on error
+ */
+static int vpc_fill_bitmap(BlockDriverState *bs, uint32_t index)
+{
+    BDRVVPCState *s = bs->opaque;
+    uint64_t bitmap_offset = 512 * (uint64_t) s->pagetable[index];
+    uint32_t used_bytes = DIV_ROUND_UP(s->block_size / 512, 8);
+    uint8_t *bitmap;
+    uint32_t i;
+    int ret;
+
+    if (test_bit(index, s->bitmap_full)) {
+        return 0;
+    }
+
+    bitmap = qemu_blockalign(bs->file->bs, s->bitmap_size);
+    ret = bdrv_pread(bs->file->bs, bitmap_offset, bitmap, s->bitmap_size);
+    if (ret < 0) {
+        goto out;
+    }
 
-        s->last_bitmap_offset = bitmap_offset;
+    for (i = 0; i < used_bytes; i++) {
+        if (bitmap[i] != 0xff) {
+            break;
+        }
+    }
+    if (i < used_bytes) {
         memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite_sync(bs->file->bs, bitmap_offset, bitmap, s->bitmap_size);
+        ret = bdrv_pwrite_sync(bs->file->bs, bitmap_offset, bitmap,
+                               s->bitmap_size);
+        if (ret < 0) {
+            goto out;
+        }
     }
 
-    return block_offset;
+    set_bit(index, s->bitmap_full);
+    ret = 0;
+out:
+    qemu_vfree(bitmap);
+    return ret;
 }
 
 /*
@@ -411,57 +457,87 @@ static int rewrite_footer(BlockDriverState* bs)
 }
 
 /*
- * Allocates a new block. This involves writing a new footer and updating
- * the Block Allocation Table to use the space at the old end of the image
- * file (overwriting the old footer)
+ * Allocates a new block at the old end of the image file (overwriting the
+ * old footer) and initializes its bitmap.
+ *
+ * Neither the footer nor the Block Allocation Table are updated here. The
+ * caller writes the footer once after writing the data of all blocks that
+ * a request allocates, and then updates the BAT with vpc_update_bat().
  *
- * Returns the sectors' offset in the image file on success and < 0 on error
+ * Returns the new BAT entry (the offset of the block's bitmap in sectors)
+ * on success and < 0 on error
  */
-static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
+static int64_t alloc_block(BlockDriverState* bs, uint32_t index)
 {
     BDRVVPCState *s = bs->opaque;
-    int64_t bat_offset;
-    uint32_t index, bat_value;
+    int64_t bitmap_offset;
     int ret;
     uint8_t bitmap[s->bitmap_size];
 
-    // Check if sector_num is valid
-    if ((sector_num < 0) || (sector_num > bs->total_sectors))
-        return -1;
-
-    // Write entry into in-memory BAT
-    index = (sector_num * 512) / s->block_size;
+    // Check if index is valid
+    if (index >= s->max_table_entries)
+        return -EINVAL;
     if (s->pagetable[index] != 0xFFFFFFFF)
-        return -1;
+        return -EINVAL;
 
-    s->pagetable[index] = s->free_data_block_offset / 512;
+    bitmap_offset = s->free_data_block_offset;
 
     // Initialize the block's bitmap
     memset(bitmap, 0xff, s->bitmap_size);
-    ret = bdrv_pwrite_sync(bs->file->bs, s->free_data_block_offset, bitmap,
-        s->bitmap_size);
+    ret = bdrv_pwrite(bs->file->bs, bitmap_offset, bitmap, s->bitmap_size);
     if (ret < 0) {
         return ret;
     }
 
-    // Write new footer (the old one will be overwritten)
     s->free_data_block_offset += s->block_size + s->bitmap_size;
-    ret = rewrite_footer(bs);
-    if (ret < 0)
-        goto fail;
 
-    // Write BAT entry to disk
-    bat_offset = s->bat_offset + (4 * index);
-    bat_value = cpu_to_be32(s->pagetable[index]);
-    ret = bdrv_pwrite_sync(bs->file->bs, bat_offset, &bat_value, 4);
-    if (ret < 0)
-        goto fail;
+    return bitmap_offset / 512;
+}
+
+/*
+ * Writes the BAT entries for blocks @first to @last with a single request.
+ * @entries holds the new entries of the blocks that were allocated, and
+ * 0xFFFFFFFF for blocks whose entry doesn't change.
+ *
+ * The in-memory BAT is only updated once the new entries are on disk, so
+ * that concurrent reads don't see a block before its data has been written.
+ *
+ * Returns 0 on success and < 0 on error
+ */
+static int vpc_update_bat(BlockDriverState *bs, uint32_t first, uint32_t last,
+                          const uint32_t *entries)
+{
+    BDRVVPCState *s = bs->opaque;
+    uint32_t i, n = last - first + 1;
+    uint32_t *buf;
+    int ret;
 
-    return get_sector_offset(bs, sector_num, 0);
+    buf = g_new(uint32_t, n);
+    for (i = 0; i < n; i++) {
+        uint32_t entry = entries[i];
 
-fail:
-    s->free_data_block_offset -= (s->block_size + s->bitmap_size);
-    return -1;
+        if (entry == 0xFFFFFFFF) {
+            entry = s->pagetable[first + i];
+        }
+        buf[i] = cpu_to_be32(entry);
+    }
+
+    ret = bdrv_pwrite_sync(bs->file->bs, s->bat_offset + 4 * (int64_t) first,
+                           buf, n * 4);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (entries[i] != 0xFFFFFFFF) {
+            s->pagetable[first + i] = entries[i];
+            set_bit(first + i, s->bitmap_full);
+        }
+    }
+    ret = 0;
+out:
+    g_free(buf);
+    return ret;
 }
 
 static int vpc_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -477,20 +553,101 @@ static int vpc_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int vpc_cmp_offset(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int vpc_check(BlockDriverState *bs, BdrvCheckResult *res,
+                     BdrvCheckMode fix)
+{
+    BDRVVPCState *s = bs->opaque;
+    VHDFooter *footer = (VHDFooter *) s->footer_buf;
+    uint64_t bat_end, block_len;
+    uint32_t *offsets;
+    int64_t size;
+    int i, n;
+
+    if (be32_to_cpu(footer->type) == VHD_FIXED) {
+        return 0;
+    }
+
+    size = bdrv_getlength(bs->file->bs);
+    if (size < 0) {
+        res->check_errors++;
+        return size;
+    }
+
+    bat_end = s->bat_offset + (uint64_t) s->max_table_entries * 4;
+    block_len = s->bitmap_size + s->block_size;
+
+    res->bfi.total_clusters = s->max_table_entries;
+    res->bfi.compressed_clusters = 0; /* compression is not supported */
+
+    offsets = g_new(uint32_t, s->max_table_entries);
+    n = 0;
+    for (i = 0; i < s->max_table_entries; i++) {
+        uint64_t off;
+
+        if (s->pagetable[i] == 0xFFFFFFFF) {
+            continue;
+        }
+
+        off = 512 * (uint64_t) s->pagetable[i];
+        if (off < bat_end || off + block_len > size) {
+            fprintf(stderr, "ERROR block %d is outside the data area\n", i);
+            res->corruptions++;
+            continue;
+        }
+
+        res->bfi.allocated_clusters++;
+        if (n > 0 && offsets[n - 1] + block_len / 512 != s->pagetable[i]) {
+            res->bfi.fragmented_clusters++;
+        }
+        offsets[n++] = s->pagetable[i];
+    }
+
+    /* Blocks must not share any space with each other */
+    qsort(offsets, n, sizeof(offsets[0]), vpc_cmp_offset);
+    for (i = 1; i < n; i++) {
+        if (offsets[i - 1] + block_len / 512 > offsets[i]) {
+            fprintf(stderr, "ERROR blocks at offset 0x%" PRIx64 " and 0x%"
+                    PRIx64 " overlap\n", 512 * (uint64_t) offsets[i - 1],
+                    512 * (uint64_t) offsets[i]);
+            res->corruptions++;
+        }
+    }
+    g_free(offsets);
+
+    res->image_end_offset = s->free_data_block_offset + HEADER_SIZE;
+    return 0;
+}
+
+/*
+ * Reads don't take s->lock: looking up a block never yields, and allocating
+ * writes only make a block visible in the BAT after its data is on disk.
+ */
+static coroutine_fn int vpc_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int ret;
     int64_t offset;
     int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
     VHDFooter *footer = (VHDFooter *) s->footer_buf;
+    QEMUIOVector local_qiov;
 
     if (be32_to_cpu(footer->type) == VHD_FIXED) {
-        return bdrv_read(bs->file->bs, sector_num, buf, nb_sectors);
+        return bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
     }
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 0);
+        offset = get_sector_offset(bs, sector_num);
 
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
@@ -498,83 +655,128 @@ static int vpc_read(BlockDriverState *bs, int64_t sector_num,
             sectors = nb_sectors;
         }
 
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done,
+                          sectors * BDRV_SECTOR_SIZE);
+
         if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
+            qemu_iovec_memset(&local_qiov, 0, 0, sectors * BDRV_SECTOR_SIZE);
         } else {
-            ret = bdrv_pread(bs->file->bs, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
+            ret = bdrv_co_readv(bs->file->bs, offset >> BDRV_SECTOR_BITS,
+                                sectors, &local_qiov);
+            if (ret < 0) {
+                goto fail;
             }
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+fail:
+    qemu_iovec_destroy(&local_qiov);
     return ret;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
-    int64_t offset;
+    int64_t offset, entry;
     int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
+    uint64_t old_free_data_block_offset;
+    uint32_t index, last_index, alloc_first = 0, alloc_last = 0;
+    uint32_t *new_entries = NULL;
     int ret;
     VHDFooter *footer =  (VHDFooter *) s->footer_buf;
+    QEMUIOVector local_qiov;
 
     if (be32_to_cpu(footer->type) == VHD_FIXED) {
-        return bdrv_write(bs->file->bs, sector_num, buf, nb_sectors);
+        return bdrv_co_writev(bs->file->bs, sector_num, nb_sectors, qiov);
     }
-    while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 1);
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    last_index = (sector_num + nb_sectors - 1) / sectors_per_block;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_co_mutex_lock(&s->lock);
+    old_free_data_block_offset = s->free_data_block_offset;
+
+    while (nb_sectors > 0) {
+        index = sector_num / sectors_per_block;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
         if (sectors > nb_sectors) {
             sectors = nb_sectors;
         }
 
+        offset = get_sector_offset(bs, sector_num);
         if (offset == -1) {
-            offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
+            entry = alloc_block(bs, index);
+            if (entry < 0) {
+                ret = entry;
+                goto fail;
+            }
+            if (!new_entries) {
+                alloc_first = index;
+                new_entries = g_new(uint32_t, last_index - index + 1);
+                memset(new_entries, 0xff,
+                       (last_index - index + 1) * sizeof(uint32_t));
+            }
+            new_entries[index - alloc_first] = entry;
+            alloc_last = index;
+            offset = 512 * entry + s->bitmap_size
+                     + 512 * (sector_num % sectors_per_block);
+        } else {
+            ret = vpc_fill_bitmap(bs, index);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
-        ret = bdrv_pwrite(bs->file->bs, offset, buf,
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done,
                           sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+
+        ret = bdrv_co_writev(bs->file->bs, offset >> BDRV_SECTOR_BITS,
+                             sectors, &local_qiov);
+        if (ret < 0) {
+            goto fail;
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
 
-    return 0;
-}
+    /* Make the new blocks reachable only once their bitmap and data (which
+     * the footer write flushes) are on disk, updating the BAT entries of the
+     * whole request at once */
+    if (new_entries) {
+        ret = rewrite_footer(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = vpc_update_bat(bs, alloc_first, alloc_last, new_entries);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    ret = 0;
+    goto out;
 
-static coroutine_fn int vpc_co_write(BlockDriverState *bs, int64_t sector_num,
-                                     const uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_write(bs, sector_num, buf, nb_sectors);
+fail:
+    if (new_entries) {
+        /* Give up the new blocks and restore the overwritten footer */
+        s->free_data_block_offset = old_free_data_block_offset;
+        rewrite_footer(bs);
+    }
+out:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&local_qiov);
+    g_free(new_entries);
     return ret;
 }
 
@@ -594,7 +796,7 @@ static int64_t coroutine_fn vpc_co_get_block_status(BlockDriverState *bs,
                (sector_num << BDRV_SECTOR_BITS);
     }
 
-    offset = get_sector_offset(bs, sector_num, 0);
+    offset = get_sector_offset(bs, sector_num);
     start = offset;
     allocated = (offset != -1);
     *pnum = 0;
@@ -617,7 +819,7 @@ static int64_t coroutine_fn vpc_co_get_block_status(BlockDriverState *bs,
         if (nb_sectors == 0) {
             break;
         }
-        offset = get_sector_offset(bs, sector_num, 0);
+        offset = get_sector_offset(bs, sector_num);
     } while (offset == -1);
 
     return 0;
@@ -893,6 +1095,7 @@ static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
     qemu_vfree(s->pagetable);
+    g_free(s->bitmap_full);
 #ifdef CACHE
     g_free(s->pageentry_u8);
 #endif
@@ -931,11 +1134,12 @@ static BlockDriver bdrv_vpc = {
     .bdrv_reopen_prepare    = vpc_reopen_prepare,
     .bdrv_create            = vpc_create,
 
-    .bdrv_read                  = vpc_co_read,
-    .bdrv_write                 = vpc_co_write,
+    .bdrv_co_readv              = vpc_co_readv,
+    .bdrv_co_writev             = vpc_co_writev,
     .bdrv_co_get_block_status   = vpc_co_get_block_status,
 
     .bdrv_get_info          = vpc_get_info,
+    .bdrv_check             = vpc_check,
 
     .create_opts            = &vpc_create_opts,
     .bdrv_has_zero_init     = vpc_has_zero_init,
@@ -176,8 +176,13 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(blk, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY, NULL,
-                         errp);
+    /* All clients of an export share its BlockBackend, so a flush on one
+     * connection covers writes completed on any other: clients may open
+     * several connections to the same export.
+     */
+    exp = nbd_export_new(blk, 0, -1,
+                         NBD_FLAG_CAN_MULTI_CONN |
+                         (writable ? 0 : NBD_FLAG_READ_ONLY), NULL, errp);
     if (!exp) {
         return;
     }
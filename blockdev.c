@@ -372,6 +372,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
             if (!strcmp(aio, "native")) {
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(aio, "io_uring")) {
+                *bdrv_flags |= BDRV_O_IO_URING;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
             } else {
@@ -1833,6 +1835,7 @@ static void do_drive_backup(const char *device, const char *target,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_in_flight, int64_t max_in_flight,
                             BlockJobTxn *txn, Error **errp);
 
 static void drive_backup_prepare(BlkActionState *common, Error **errp)
@@ -1871,6 +1874,7 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
                     backup->has_bitmap, backup->bitmap,
                     backup->has_on_source_error, backup->on_source_error,
                     backup->has_on_target_error, backup->on_target_error,
+                    backup->has_max_in_flight, backup->max_in_flight,
                     common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -1915,6 +1919,7 @@ static void do_blockdev_backup(const char *device, const char *target,
                                BlockdevOnError on_source_error,
                                bool has_on_target_error,
                                BlockdevOnError on_target_error,
+                               bool has_max_in_flight, int64_t max_in_flight,
                                BlockJobTxn *txn, Error **errp);
 
 static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
@@ -1960,6 +1965,7 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
                        backup->has_speed, backup->speed,
                        backup->has_on_source_error, backup->on_source_error,
                        backup->has_on_target_error, backup->on_target_error,
+                       backup->has_max_in_flight, backup->max_in_flight,
                        common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2015,6 +2021,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2715,12 +2722,50 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_min_order, int64_t min_order,
+                                     bool has_max_order, int64_t max_order,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    AioContext *aio_context;
+
+    if (!has_min_order) {
+        min_order = BLOCK_ACCT_HISTOGRAM_MIN_ORDER_DEFAULT;
+    }
+    if (!has_max_order) {
+        max_order = BLOCK_ACCT_HISTOGRAM_MAX_ORDER_DEFAULT;
+    }
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    if (min_order < 0 || min_order > max_order ||
+        max_order > BLOCK_ACCT_HISTOGRAM_MAX_ORDER) {
+        error_setg(errp, "Histogram orders must satisfy "
+                   "0 <= min-order <= max-order <= %d",
+                   BLOCK_ACCT_HISTOGRAM_MAX_ORDER);
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+    block_acct_set_histogram(blk_get_stats(blk), min_order, max_order);
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2746,7 +2791,20 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp))
+    {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap != NULL) {
+        bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -3138,6 +3196,7 @@ static void do_drive_backup(const char *device, const char *target,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_in_flight, int64_t max_in_flight,
                             BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3161,6 +3220,9 @@ static void do_drive_backup(const char *device, const char *target,
     if (!has_on_target_error) {
         on_target_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = BACKUP_MAX_IN_FLIGHT_DEFAULT;
+    }
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
@@ -3252,7 +3314,7 @@ static void do_drive_backup(const char *device, const char *target,
         }
     }
 
-    backup_start(bs, target_bs, speed, sync, bmap,
+    backup_start(bs, target_bs, speed, max_in_flight, sync, bmap,
                  on_source_error, on_target_error,
                  block_job_cb, bs, txn, &local_err);
     if (local_err != NULL) {
@@ -3273,6 +3335,7 @@ void qmp_drive_backup(const char *device, const char *target,
                       bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       Error **errp)
 {
     return do_drive_backup(device, target, has_format, format, sync,
@@ -3280,6 +3343,7 @@ void qmp_drive_backup(const char *device, const char *target,
                            has_bitmap, bitmap,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
+                           has_max_in_flight, max_in_flight,
                            NULL, errp);
 }
 
@@ -3295,6 +3359,7 @@ void do_blockdev_backup(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_in_flight, int64_t max_in_flight,
                          BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk, *target_blk;
@@ -3312,6 +3377,9 @@ void do_blockdev_backup(const char *device, const char *target,
     if (!has_on_target_error) {
         on_target_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = BACKUP_MAX_IN_FLIGHT_DEFAULT;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3342,8 +3410,9 @@ void do_blockdev_backup(const char *device, const char *target,
 
     bdrv_ref(target_bs);
     bdrv_set_aio_context(target_bs, aio_context);
-    backup_start(bs, target_bs, speed, sync, NULL, on_source_error,
-                 on_target_error, block_job_cb, bs, txn, &local_err);
+    backup_start(bs, target_bs, speed, max_in_flight, sync, NULL,
+                 on_source_error, on_target_error, block_job_cb, bs, txn,
+                 &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
@@ -3359,11 +3428,13 @@ void qmp_blockdev_backup(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_in_flight, int64_t max_in_flight,
                          Error **errp)
 {
     do_blockdev_backup(device, target, sync, has_speed, speed,
                        has_on_source_error, on_source_error,
                        has_on_target_error, on_target_error,
+                       has_max_in_flight, max_in_flight,
                        NULL, errp);
 }
 
@@ -4055,7 +4126,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -4186,7 +4257,7 @@ static QemuOptsList qemu_root_bds_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "read-only",
             .type = QEMU_OPT_BOOL,
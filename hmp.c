@@ -515,7 +515,7 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
 {
     BlockStatsList *stats_list, *stats;
 
-    stats_list = qmp_query_blockstats(false, false, NULL);
+    stats_list = qmp_query_blockstats(false, false, false, false, NULL);
 
     for (stats = stats_list; stats; stats = stats->next) {
         if (!stats->value->has_device) {
@@ -1111,7 +1111,7 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, NULL,
-                     false, 0, false, 0, &err);
+                     false, 0, false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -2007,8 +2007,11 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        monitor_printf(mon, "%s: thread_id=%" PRId64 " poll-max-ns=%" PRId64
+                       " poll-grow=%" PRId64 " poll-shrink=%" PRId64 "\n",
+                       info->value->id, info->value->thread_id,
+                       info->value->poll_max_ns, info->value->poll_grow,
+                       info->value->poll_shrink);
     }
 
     qapi_free_IOThreadInfoList(info_list);
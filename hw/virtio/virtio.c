@@ -1786,12 +1786,27 @@ static void virtio_queue_host_notifier_read(EventNotifier *n)
     }
 }
 
+/* Processes new requests without waiting for the guest's notification */
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_vq(vq);
+    return true;
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 bool assign, bool set_handler)
 {
     if (assign && set_handler) {
-        aio_set_event_notifier(ctx, &vq->host_notifier, true,
-                               virtio_queue_host_notifier_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier, true,
+                                    virtio_queue_host_notifier_read,
+                                    virtio_queue_host_notifier_aio_poll);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
     }
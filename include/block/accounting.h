@@ -31,6 +31,16 @@
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
+/*
+ * Latency histograms have buckets with power-of-two boundaries between
+ * 2^min_order and 2^max_order nanoseconds, plus one bucket for everything
+ * below and one for everything above.
+ */
+#define BLOCK_ACCT_HISTOGRAM_MAX_ORDER      62
+#define BLOCK_ACCT_HISTOGRAM_MAX_BUCKETS    (BLOCK_ACCT_HISTOGRAM_MAX_ORDER + 2)
+#define BLOCK_ACCT_HISTOGRAM_MIN_ORDER_DEFAULT  10  /* 1 us */
+#define BLOCK_ACCT_HISTOGRAM_MAX_ORDER_DEFAULT  34  /* 17 s */
+
 enum BlockAcctType {
     BLOCK_ACCT_READ,
     BLOCK_ACCT_WRITE,
@@ -55,6 +65,9 @@ typedef struct BlockAcctStats {
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
     bool account_invalid;
     bool account_failed;
+    unsigned histogram_min_order;
+    unsigned histogram_nb_buckets;
+    uint64_t histogram[BLOCK_MAX_IOTYPE][BLOCK_ACCT_HISTOGRAM_MAX_BUCKETS];
 } BlockAcctStats;
 
 typedef struct BlockAcctCookie {
@@ -77,6 +90,10 @@ void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
+int block_acct_set_histogram(BlockAcctStats *stats, unsigned min_order,
+                             unsigned max_order);
+void block_acct_reset_histograms(BlockAcctStats *stats);
+int64_t block_acct_histogram_boundary(BlockAcctStats *stats, unsigned i);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
 
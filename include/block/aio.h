@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -120,6 +121,12 @@ struct AioContext {
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring ring shared by all aio=io_uring images in this AioContext,
+     * created on first use */
+    struct LuringState *linux_io_uring;
+#endif
+
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
 
@@ -129,6 +136,22 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Number of AioHandlers without .io_poll(); polling is only possible
+     * while this is zero, because their events would be delayed otherwise.
+     */
+    int poll_disable_cnt;
+
+    /* Adaptive polling: aio_poll() busy waits for up to poll_ns nanoseconds
+     * before blocking.  poll_ns grows by poll_grow and shrinks by
+     * poll_shrink, between 0 and poll_max_ns, depending on whether the
+     * events came in while polling or only later.  poll_max_ns == 0
+     * disables polling.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
 };
 
 /**
@@ -316,6 +339,22 @@ void aio_set_fd_handler(AioContext *ctx,
                         IOHandler *io_write,
                         void *opaque);
 
+/* Like aio_set_fd_handler(), but also registers @io_poll.
+ *
+ * @io_poll is called repeatedly while aio_poll() busy waits before blocking.
+ * It checks, without a system call, whether the event that would make @fd
+ * readable has happened (e.g. new requests in a ring shared with the guest or
+ * the kernel), handles it and returns true, or returns false if there is
+ * nothing to do.  A readable @fd still invokes @io_read as usual.
+ */
+void aio_set_fd_handler_poll(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             AioPollFn *io_poll,
+                             void *opaque);
+
 /* Register an event notifier and associated callbacks.  Behaves very similarly
  * to event_notifier_set_handler.  Unlike event_notifier_set_handler, these callbacks
  * will be invoked when using aio_poll().
@@ -328,6 +367,15 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Like aio_set_event_notifier(), but also registers @io_poll, see
+ * aio_set_fd_handler_poll().  @io_poll is passed @notifier.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 bool is_external,
+                                 EventNotifierHandler *io_read,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -336,6 +384,12 @@ GSource *aio_get_g_source(AioContext *ctx);
 /* Return the ThreadPool bound to this AioContext */
 struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Return the io_uring ring bound to this AioContext, or NULL with @errp set
+ * if the kernel does not support io_uring */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx, Error **errp);
+#endif
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -442,4 +496,17 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx, Error **errp);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds (0 disables polling)
+ * @grow: polling time growth factor (0 selects the default)
+ * @shrink: polling time shrink factor (0 resets the time to 0)
+ *
+ * Configure adaptive polling for @ctx.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
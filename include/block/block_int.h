@@ -27,6 +27,7 @@
 #include "block/accounting.h"
 #include "block/block.h"
 #include "block/throttle-groups.h"
+#include "block/cor-prefetch.h"
 #include "qemu/option.h"
 #include "qemu/queue.h"
 #include "qemu/coroutine.h"
@@ -57,6 +58,7 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -175,6 +177,17 @@ struct BlockDriver {
     void (*bdrv_invalidate_cache)(BlockDriverState *bs, Error **errp);
     int (*bdrv_inactivate)(BlockDriverState *bs);
 
+    /* Persistent dirty bitmaps */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+    void (*bdrv_store_persistent_dirty_bitmaps)(BlockDriverState *bs,
+                                                Error **errp);
+    /* Called when a read-only image was reopened read-write, after the
+     * whole reopen queue has been committed */
+    int (*bdrv_reopen_bitmaps_rw)(BlockDriverState *bs, Error **errp);
+
     /*
      * Flushes all data that was already written to the OS all the way down to
      * the disk (for example raw-posix calls fsync()).
@@ -214,6 +227,8 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockSharedCacheStats *(*bdrv_get_shared_cache_stats)(
+        const BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -380,6 +395,7 @@ struct BlockDriverState {
     int sg;        /* if true, the device is a /dev/sg* */
     int copy_on_read; /* if true, copy read backing sectors into image
                          note this is a reference count */
+    BdrvCorPrefetch *cor_prefetch; /* copy-on-read prefetch, may be NULL */
     bool probed;
 
     BlockDriver *drv; /* NULL means no media */
@@ -670,11 +686,17 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/* Background copy requests of a backup job in flight at a time */
+#define BACKUP_MAX_IN_FLIGHT_DEFAULT 16
+#define BACKUP_MAX_IN_FLIGHT 256
+
 /*
  * backup_start:
  * @bs: Block device to operate on.
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_in_flight: The maximum number of concurrent copy requests, between 1
+ *                 and BACKUP_MAX_IN_FLIGHT.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
  * @on_source_error: The action to take upon error reading from the source.
@@ -687,7 +709,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * until the job is cancelled or manually completed.
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
-                  int64_t speed, MirrorSyncMode sync_mode,
+                  int64_t speed, int64_t max_in_flight,
+                  MirrorSyncMode sync_mode,
                   BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
@@ -70,6 +70,12 @@ typedef struct BlockJobDriver {
      * never both.
      */
     void (*abort)(BlockJob *job);
+
+    /**
+     * Optional callback for job types that report additional information in
+     * query-block-jobs.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
 } BlockJobDriver;
 
 /**
@@ -0,0 +1,62 @@
+/*
+ * QEMU block layer copy-on-read prefetch
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef BLOCK_COR_PREFETCH_H
+#define BLOCK_COR_PREFETCH_H
+
+#include "qemu/typedefs.h"
+#include "qemu-common.h"
+#include "qemu/coroutine.h"
+#include "qapi-types.h"
+
+typedef struct BdrvCorPrefetch BdrvCorPrefetch;
+
+/*
+ * bdrv_cor_prefetch_enable:
+ *
+ * Start prefetching backing file data into @bs around copy-on-read requests,
+ * following @policy.  At most @max_window bytes are prefetched ahead of a
+ * request (0 selects the default), at a rate of at most @speed bytes per
+ * second (0 means unlimited).
+ */
+void bdrv_cor_prefetch_enable(BlockDriverState *bs,
+                              BlockdevCorPrefetchPolicy policy,
+                              uint64_t max_window, uint64_t speed);
+
+/*
+ * bdrv_cor_prefetch_disable:
+ *
+ * Stop prefetching for @bs.  The caller must have drained @bs.
+ */
+void bdrv_cor_prefetch_disable(BlockDriverState *bs);
+
+/*
+ * bdrv_cor_prefetch_notify_read:
+ *
+ * Called for each guest copy-on-read request before it is served.
+ * @allocated tells whether the request was entirely allocated in @bs, i.e.
+ * whether it can be served without reading the backing file.
+ */
+void coroutine_fn bdrv_cor_prefetch_notify_read(BlockDriverState *bs,
+                                                int64_t offset,
+                                                unsigned int bytes,
+                                                bool allocated);
+
+/*
+ * bdrv_cor_prefetch_cancel:
+ *
+ * Drop the prefetch work that has not been started yet.  Requests that are
+ * in flight still complete; bdrv_cor_prefetch_pending() tells whether there
+ * are any.
+ */
+void bdrv_cor_prefetch_cancel(BlockDriverState *bs);
+
+bool bdrv_cor_prefetch_pending(BlockDriverState *bs);
+
+BlockCorPrefetchStats *
+bdrv_cor_prefetch_query_stats(const BlockDriverState *bs);
+
+#endif
@@ -37,6 +37,10 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+    /* Only valid for structured reply chunks */
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
@@ -45,6 +49,8 @@ struct nbd_reply {
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)     /* Send WRITE_ZEROES */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multiple connections OK */
 
 /* New-style global flags. */
 #define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* Fixed newstyle protocol. */
@@ -55,23 +61,51 @@ struct nbd_reply {
 /* Reply types. */
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Metadata context. */
 #define NBD_REP_ERR_UNSUP       ((UINT32_C(1) << 31) | 1) /* Unknown option. */
 #define NBD_REP_ERR_POLICY      ((UINT32_C(1) << 31) | 2) /* Server denied */
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
 #define NBD_REP_ERR_TLS_REQD    ((UINT32_C(1) << 31) | 5) /* TLS required */
+#define NBD_REP_ERR_UNKNOWN     ((UINT32_C(1) << 31) | 6) /* No such export */
 
+/* Structured reply chunks. */
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+#define NBD_REPLY_FLAG_DONE         (1 << 0)    /* Last chunk of the reply */
+
+#define NBD_REPLY_ERR(value)        ((1 << 15) | (value))
+#define NBD_REPLY_TYPE_NONE         (0)
+#define NBD_REPLY_TYPE_OFFSET_DATA  (1)
+#define NBD_REPLY_TYPE_OFFSET_HOLE  (2)
+#define NBD_REPLY_TYPE_BLOCK_STATUS (5)
+#define NBD_REPLY_TYPE_ERROR        NBD_REPLY_ERR(1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET NBD_REPLY_ERR(2)
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_NO_HOLE	(1 << 17)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_WRITE_ZEROES = 6,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
+/* Metadata contexts for NBD_CMD_BLOCK_STATUS. */
+#define NBD_META_BASE_ALLOCATION    "base:allocation"
+#define NBD_META_DIRTY_BITMAP       "qemu:dirty-bitmap:"
+
+/* Extent flags for base:allocation */
+#define NBD_STATE_HOLE          (1 << 0)
+#define NBD_STATE_ZERO          (1 << 1)
+
+/* Extent flags for qemu:dirty-bitmap:<name> */
+#define NBD_STATE_DIRTY         (1 << 0)
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
@@ -84,12 +118,14 @@ ssize_t nbd_wr_syncv(QIOChannel *ioc,
                      size_t length,
                      bool do_read);
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
+                          bool *structured_reply,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
                           off_t *size, Error **errp);
 int nbd_init(int fd, QIOChannelSocket *sioc, uint32_t flags, off_t size);
 ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request);
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply);
+int nbd_errno_to_system_errno(int err);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
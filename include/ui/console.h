@@ -120,6 +120,7 @@ struct QemuConsoleClass {
 };
 
 #define QEMU_ALLOCATED_FLAG     0x01
+#define QEMU_MEMFD_FLAG         0x02
 
 struct PixelFormat {
     uint8_t bits_per_pixel;
@@ -135,6 +136,7 @@ struct DisplaySurface {
     pixman_format_code_t format;
     pixman_image_t *image;
     uint8_t flags;
+    int memfd;              /* backing memfd, valid with QEMU_MEMFD_FLAG */
 #ifdef CONFIG_OPENGL
     GLenum glformat;
     GLenum gltype;
@@ -243,6 +245,7 @@ PixelFormat qemu_default_pixelformat(int bpp);
 
 DisplaySurface *qemu_create_displaysurface(int width, int height);
 void qemu_free_displaysurface(DisplaySurface *surface);
+void qemu_displaysurface_use_memfd(bool enable);
 
 static inline int is_surface_bgr(DisplaySurface *surface)
 {
@@ -19,7 +19,7 @@
 #include "qemu/osdep.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -348,8 +348,88 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
     return QIO_CHANNEL(tioc);
 }
 
+/* Ask the server to answer with structured reply chunks.  Returns 1 if the
+ * server agreed, 0 if it declined and -1 on error.
+ */
+static int nbd_receive_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t opt = cpu_to_be32(NBD_OPT_STRUCTURED_REPLY);
+    uint32_t length = 0;
+    uint32_t type;
+    char buf[64];
+
+    TRACE("Requesting structured replies");
+    if (write_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -1;
+    }
+
+    if (write_sync(ioc, &opt, sizeof(opt)) != sizeof(opt)) {
+        error_setg(errp, "Failed to send option number");
+        return -1;
+    }
+
+    if (write_sync(ioc, &length, sizeof(length)) != sizeof(length)) {
+        error_setg(errp, "Failed to send option length");
+        return -1;
+    }
+
+    if (read_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "failed to read option magic");
+        return -1;
+    }
+    magic = be64_to_cpu(magic);
+    if (magic != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected option magic");
+        return -1;
+    }
+    if (read_sync(ioc, &opt, sizeof(opt)) != sizeof(opt)) {
+        error_setg(errp, "failed to read option");
+        return -1;
+    }
+    opt = be32_to_cpu(opt);
+    if (opt != NBD_OPT_STRUCTURED_REPLY) {
+        error_setg(errp, "Unexpected option type %x expected %x",
+                   opt, NBD_OPT_STRUCTURED_REPLY);
+        return -1;
+    }
+
+    if (read_sync(ioc, &type, sizeof(type)) != sizeof(type)) {
+        error_setg(errp, "failed to read option type");
+        return -1;
+    }
+    type = be32_to_cpu(type);
+
+    if (read_sync(ioc, &length, sizeof(length)) != sizeof(length)) {
+        error_setg(errp, "failed to read option length");
+        return -1;
+    }
+    length = be32_to_cpu(length);
+
+    if (type & (1 << 31)) {
+        /* Older servers reject the option; skip any error message */
+        TRACE("Server declined structured replies (%x)", type);
+        while (length) {
+            size_t n = MIN(length, sizeof(buf));
+            if (read_sync(ioc, buf, n) != n) {
+                error_setg(errp, "failed to read option error message");
+                return -1;
+            }
+            length -= n;
+        }
+        return 0;
+    }
+    if (type != NBD_REP_ACK || length != 0) {
+        error_setg(errp, "Unexpected reply type %x expected %x",
+                   type, NBD_REP_ACK);
+        return -1;
+    }
+    return 1;
+}
 
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
+                          bool *structured_reply,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
                           off_t *size, Error **errp)
@@ -366,6 +446,9 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
     if (outioc) {
         *outioc = NULL;
     }
+    if (structured_reply) {
+        *structured_reply = false;
+    }
     if (tlscreds && !outioc) {
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
@@ -458,6 +541,13 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+            if (structured_reply) {
+                int ret = nbd_receive_structured_reply(ioc, errp);
+                if (ret < 0) {
+                    goto fail;
+                }
+                *structured_reply = ret > 0;
+            }
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -651,16 +741,15 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    uint32_t magic;
+    uint8_t buf[NBD_CHUNK_HEADER_SIZE];
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
@@ -669,22 +758,49 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
      */
 
-    magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->magic = be32_to_cpup((uint32_t*)buf);
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (reply->magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                        NBD_CHUNK_HEADER_SIZE - NBD_REPLY_SIZE);
+        if (ret != NBD_CHUNK_HEADER_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        reply->error = 0;
+        reply->flags = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->length = be32_to_cpup((uint32_t*)(buf + 16));
+
+        TRACE("Got chunk: "
+              "{ .flags = %x, .type = %x, handle = %" PRIu64", .length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->error = be32_to_cpup((uint32_t*)(buf + 4));
     reply->error = nbd_errno_to_system_errno(reply->error);
+    reply->flags = 0;
+    reply->type = 0;
+    reply->length = 0;
 
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
-          magic, reply->error, reply->handle);
+          reply->magic, reply->error, reply->handle);
 
-    if (magic != NBD_REPLY_MAGIC) {
-        LOG("invalid magic (got 0x%x)", magic);
+    if (reply->magic != NBD_REPLY_MAGIC) {
+        LOG("invalid magic (got 0x%x)", reply->magic);
         return -EINVAL;
     }
     return 0;
 }
-
@@ -87,12 +87,24 @@ struct NBDClient {
     Coroutine *send_coroutine;
 
     bool can_read;
+    bool structured_reply;
+
+    /* Metadata contexts chosen with NBD_OPT_SET_META_CONTEXT */
+    bool meta_base_allocation;
+    char *meta_dirty_bitmap;
 
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
 };
 
+/* Context ids handed out by NBD_OPT_SET_META_CONTEXT */
+#define NBD_META_ID_BASE_ALLOCATION 1
+#define NBD_META_ID_DIRTY_BITMAP    2
+
+#define NBD_MAX_META_OPTION_SIZE    4096
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 1024
+
 /* That's all folks */
 
 static void nbd_set_handlers(NBDClient *client);
@@ -189,12 +201,12 @@ static ssize_t nbd_negotiate_drop_sync(QIOChannel *ioc, size_t size)
 
 */
 
-static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+static int nbd_negotiate_send_rep_len(QIOChannel *ioc, uint32_t type,
+                                      uint32_t opt, uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
-    TRACE("Reply opt=%x type=%x", type, opt);
+    TRACE("Reply opt=%x type=%x len=%u", type, opt, len);
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (nbd_negotiate_write(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -211,7 +223,7 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (nbd_negotiate_write(ioc, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -219,6 +231,11 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+{
+    return nbd_negotiate_send_rep_len(ioc, type, opt, 0);
+}
+
 static int nbd_negotiate_send_rep_list(QIOChannel *ioc, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -280,6 +297,236 @@ static int nbd_negotiate_handle_list(NBDClient *client, uint32_t length)
     return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, NBD_OPT_LIST);
 }
 
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    TRACE("Client requested structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_negotiate_send_meta_context(QIOChannel *ioc, uint32_t opt,
+                                           uint32_t id, const char *name)
+{
+    size_t len = strlen(name);
+
+    TRACE("Advertizing metadata context '%s'", name);
+    if (nbd_negotiate_send_rep_len(ioc, NBD_REP_META_CONTEXT, opt,
+                                   sizeof(id) + len) < 0) {
+        return -EINVAL;
+    }
+    id = cpu_to_be32(id);
+    if (nbd_negotiate_write(ioc, &id, sizeof(id)) != sizeof(id)) {
+        LOG("write failed (context id)");
+        return -EINVAL;
+    }
+    if (nbd_negotiate_write(ioc, (char *)name, len) != len) {
+        LOG("write failed (context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Send a context for every named dirty bitmap of @bs */
+static int nbd_negotiate_list_dirty_bitmaps(QIOChannel *ioc, uint32_t opt,
+                                            BlockDriverState *bs)
+{
+    BlockDirtyInfoList *list, *info;
+    int ret = 0;
+
+    if (!bs) {
+        return 0;
+    }
+
+    list = bdrv_query_dirty_bitmaps(bs);
+    for (info = list; info && ret == 0; info = info->next) {
+        char *name;
+
+        if (!info->value->has_name) {
+            continue;
+        }
+        name = g_strconcat(NBD_META_DIRTY_BITMAP, info->value->name, NULL);
+        ret = nbd_negotiate_send_meta_context(ioc, opt, 0, name);
+        g_free(name);
+    }
+    qapi_free_BlockDirtyInfoList(list);
+    return ret;
+}
+
+/* Match one query against the contexts of @bs and reply with every hit.
+ * For NBD_OPT_SET_META_CONTEXT the hits are also recorded in @base and
+ * @bitmap; only one dirty bitmap can be selected at a time.
+ */
+static int nbd_negotiate_meta_query(QIOChannel *ioc, uint32_t opt,
+                                    BlockDriverState *bs, const char *query,
+                                    bool *base, char **bitmap)
+{
+    bool list = opt == NBD_OPT_LIST_META_CONTEXT;
+    const char *name;
+
+    if (!strcmp(query, NBD_META_BASE_ALLOCATION) ||
+        (list && !strcmp(query, "base:"))) {
+        if (*base) {
+            return 0;
+        }
+        *base = true;
+        return nbd_negotiate_send_meta_context(ioc, opt,
+                                               list ? 0 :
+                                               NBD_META_ID_BASE_ALLOCATION,
+                                               NBD_META_BASE_ALLOCATION);
+    }
+
+    if (!strstart(query, NBD_META_DIRTY_BITMAP, &name)) {
+        TRACE("Ignoring unknown metadata context '%s'", query);
+        return 0;
+    }
+    if (list && !*name) {
+        return nbd_negotiate_list_dirty_bitmaps(ioc, opt, bs);
+    }
+    if (!*name || !bs || !bdrv_find_dirty_bitmap(bs, name) ||
+        (!list && *bitmap)) {
+        return 0;
+    }
+    if (!list) {
+        *bitmap = g_strdup(name);
+    }
+    return nbd_negotiate_send_meta_context(ioc, opt,
+                                           list ? 0 : NBD_META_ID_DIRTY_BITMAP,
+                                           query);
+}
+
+/* Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.
+ *
+ * Client sends:
+    [ 0 ..   3]   export name length
+    [ 4 ..   n]   export name
+    [ n .. n+3]   number of queries
+    ...           for each query: length, query string
+ */
+static int nbd_negotiate_handle_meta_context(NBDClient *client, uint32_t opt,
+                                             uint32_t length)
+{
+    GPtrArray *queries = NULL;
+    uint8_t *buf, *p, *end;
+    uint32_t namelen, nqueries, qlen, i;
+    char *name = NULL;
+    char *bitmap = NULL;
+    bool base = false;
+    NBDExport *exp;
+    BlockDriverState *bs;
+    AioContext *ctx;
+    uint32_t err = NBD_REP_ERR_INVALID;
+    int ret = 0;
+
+    if (length > NBD_MAX_META_OPTION_SIZE) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+    }
+
+    buf = g_malloc(length);
+    if (nbd_negotiate_read(client->ioc, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+    p = buf;
+    end = buf + length;
+
+    if (opt == NBD_OPT_SET_META_CONTEXT && !client->structured_reply) {
+        TRACE("Metadata contexts need structured replies");
+        goto out;
+    }
+
+    if (end - p < 4) {
+        goto out;
+    }
+    namelen = ldl_be_p(p);
+    p += 4;
+    if (namelen > end - p || end - p - namelen < 4) {
+        goto out;
+    }
+    name = g_strndup((char *)p, namelen);
+    p += namelen;
+    nqueries = ldl_be_p(p);
+    p += 4;
+
+    queries = g_ptr_array_new_with_free_func(g_free);
+    for (i = 0; i < nqueries; i++) {
+        if (end - p < 4) {
+            goto out;
+        }
+        qlen = ldl_be_p(p);
+        p += 4;
+        if (qlen > end - p) {
+            goto out;
+        }
+        g_ptr_array_add(queries, g_strndup((char *)p, qlen));
+        p += qlen;
+    }
+    if (p != end) {
+        goto out;
+    }
+
+    exp = nbd_export_find(name);
+    if (!exp) {
+        TRACE("Unknown export '%s'", name);
+        err = NBD_REP_ERR_UNKNOWN;
+        goto out;
+    }
+
+    ctx = blk_get_aio_context(exp->blk);
+    aio_context_acquire(ctx);
+    bs = blk_bs(exp->blk);
+    if (nqueries == 0 && opt == NBD_OPT_LIST_META_CONTEXT) {
+        ret = nbd_negotiate_meta_query(client->ioc, opt, bs,
+                                       NBD_META_BASE_ALLOCATION,
+                                       &base, &bitmap);
+        if (ret == 0) {
+            ret = nbd_negotiate_list_dirty_bitmaps(client->ioc, opt, bs);
+        }
+    }
+    for (i = 0; i < queries->len && ret == 0; i++) {
+        ret = nbd_negotiate_meta_query(client->ioc, opt, bs,
+                                       g_ptr_array_index(queries, i),
+                                       &base, &bitmap);
+    }
+    aio_context_release(ctx);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        client->meta_base_allocation = base;
+        g_free(client->meta_dirty_bitmap);
+        client->meta_dirty_bitmap = bitmap;
+        bitmap = NULL;
+    }
+    err = NBD_REP_ACK;
+
+out:
+    if (ret == 0) {
+        ret = nbd_negotiate_send_rep(client->ioc, err, opt);
+    }
+    if (queries) {
+        g_ptr_array_free(queries, true);
+    }
+    g_free(bitmap);
+    g_free(name);
+    g_free(buf);
+    return ret;
+}
+
 static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length)
 {
     int rc = -EINVAL;
@@ -465,6 +712,22 @@ static int nbd_negotiate_options(NBDClient *client)
             case NBD_OPT_ABORT:
                 return -EINVAL;
 
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             case NBD_OPT_EXPORT_NAME:
                 return nbd_negotiate_handle_export_name(client, length);
 
@@ -513,7 +776,8 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     char buf[8 + 8 + 8 + 128];
     int rc;
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_SEND_WRITE_ZEROES);
     bool oldStyle;
 
     /* Old style negotiation header without options
@@ -699,6 +963,7 @@ void nbd_client_put(NBDClient *client)
             object_unref(OBJECT(client->tlscreds));
         }
         g_free(client->tlsaclname);
+        g_free(client->meta_dirty_bitmap);
         if (client->exp) {
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             nbd_export_put(client->exp);
@@ -952,6 +1217,364 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+/* Send one structured reply chunk: the header, a fixed @payload and
+ * optionally @len bytes of read data from req->data + @data_offset.
+ */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, uint32_t payload_len,
+                                 uint32_t data_offset, uint32_t len)
+{
+    NBDClient *client = req->client;
+    uint8_t buf[NBD_CHUNK_HEADER_SIZE];
+    ssize_t rc, ret;
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, payload_len + len);
+
+    TRACE("Sending chunk type %x, %u byte(s)", type, payload_len + len);
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    qio_channel_set_cork(client->ioc, true);
+    rc = 0;
+    ret = write_sync(client->ioc, buf, sizeof(buf));
+    if (ret != sizeof(buf)) {
+        rc = -EIO;
+    }
+    if (rc >= 0 && payload_len) {
+        ret = write_sync(client->ioc, payload, payload_len);
+        if (ret != payload_len) {
+            rc = -EIO;
+        }
+    }
+    if (rc >= 0 && len) {
+        ret = write_sync(client->ioc, req->data + data_offset, len);
+        if (ret != len) {
+            rc = -EIO;
+        }
+    }
+    qio_channel_set_cork(client->ioc, false);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+static ssize_t nbd_co_send_chunk_error(NBDRequest *req, uint64_t handle,
+                                       int error)
+{
+    uint8_t payload[4 + 2];
+
+    /* [ 0 ..  3] error, [ 4 ..  5] message length (no message) */
+    stl_be_p(payload, system_errno_to_nbd_errno(error));
+    stw_be_p(payload + 4, 0);
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR,
+                             payload, sizeof(payload), 0, 0);
+}
+
+/* Answer a READ with structured reply chunks.  Extents that read as zeroes
+ * go out as hole chunks without payload, everything else is read into
+ * req->data and sent as data chunks.  Adjacent extents of the same kind are
+ * merged so that the client sees as few chunks as possible.
+ *
+ * Returns 0 if the reply was sent (possibly as an error chunk) and a
+ * negative errno if the connection broke.
+ */
+static int nbd_co_send_sparse_read(NBDRequest *req,
+                                   struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    int done = 0;
+    int ret;
+
+    if (request->len == 0) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, 0, 0);
+    }
+
+    /* Block status works in sectors; a request that is not sector aligned
+     * is answered with a single data chunk covering all of it.
+     */
+    if ((request->from + exp->dev_offset) % BDRV_SECTOR_SIZE ||
+        request->len % BDRV_SECTOR_SIZE) {
+        uint8_t payload[8];
+
+        ret = blk_pread(exp->blk, request->from + exp->dev_offset,
+                        req->data, request->len);
+        if (ret < 0) {
+            LOG("reading from file failed");
+            return nbd_co_send_chunk_error(req, request->handle, -ret);
+        }
+        stq_be_p(payload, request->from);
+        ret = nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                NBD_REPLY_TYPE_OFFSET_DATA,
+                                payload, sizeof(payload), 0, request->len);
+        if (ret < 0) {
+            return ret;
+        }
+        TRACE("Read %u byte(s)", request->len);
+        return 0;
+    }
+
+    while (done < nb_sectors) {
+        uint8_t payload[8 + 4];
+        bool zero = false;
+        int count = 0;
+        uint16_t flags;
+
+        /* Grow the run while the block status keeps the same kind */
+        while (done + count < nb_sectors) {
+            int64_t status = 0;
+            int pnum = nb_sectors - done - count;
+            BlockDriverState *file;
+
+            if (bs) {
+                status = bdrv_get_block_status_above(bs, NULL,
+                                                     sector_num + done + count,
+                                                     pnum, &pnum, &file);
+            }
+            if (status < 0 || pnum == 0) {
+                /* Unknown status, read it as data */
+                status = 0;
+                pnum = nb_sectors - done - count;
+            }
+            if (count && zero != !!(status & BDRV_BLOCK_ZERO)) {
+                break;
+            }
+            zero = status & BDRV_BLOCK_ZERO;
+            count += pnum;
+        }
+
+        flags = done + count == nb_sectors ? NBD_REPLY_FLAG_DONE : 0;
+        stq_be_p(payload, request->from + (uint64_t)done * BDRV_SECTOR_SIZE);
+
+        if (zero) {
+            stl_be_p(payload + 8, count * BDRV_SECTOR_SIZE);
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE,
+                                    payload, sizeof(payload), 0, 0);
+        } else {
+            ret = blk_read(exp->blk, sector_num + done,
+                           req->data + done * BDRV_SECTOR_SIZE, count);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_chunk_error(req, request->handle, -ret);
+            }
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA,
+                                    payload, 8, done * BDRV_SECTOR_SIZE,
+                                    count * BDRV_SECTOR_SIZE);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        done += count;
+    }
+
+    TRACE("Read %u byte(s)", request->len);
+    return 0;
+}
+
+/* Append an extent to a block status payload, merging it into the previous
+ * descriptor when the flags match.  Returns false once @max descriptors are
+ * in use and the extent did not fit.
+ */
+static bool nbd_extent_add(uint8_t *payload, unsigned int *count,
+                           unsigned int max, uint32_t len, uint32_t flags)
+{
+    uint8_t *desc = payload + 4 + *count * 8;
+
+    if (*count && ldl_be_p(desc - 4) == flags) {
+        stl_be_p(desc - 8, ldl_be_p(desc - 8) + len);
+        return true;
+    }
+    if (*count == max) {
+        return false;
+    }
+    stl_be_p(desc, len);
+    stl_be_p(desc + 4, flags);
+    (*count)++;
+    return true;
+}
+
+static int nbd_extents_allocation(NBDExport *exp, BlockDriverState *bs,
+                                  uint64_t from, uint32_t len,
+                                  uint8_t *payload, unsigned int *count,
+                                  unsigned int max)
+{
+    uint64_t pos = from, end = from + len;
+    int64_t last = DIV_ROUND_UP(end + exp->dev_offset, BDRV_SECTOR_SIZE);
+
+    while (pos < end) {
+        int64_t sector = (pos + exp->dev_offset) / BDRV_SECTOR_SIZE;
+        int64_t ret;
+        uint64_t next;
+        uint32_t flags;
+        BlockDriverState *file;
+        int pnum;
+
+        ret = bdrv_get_block_status_above(bs, NULL, sector,
+                                          MIN(last - sector,
+                                              BDRV_REQUEST_MAX_SECTORS),
+                                          &pnum, &file);
+        if (ret < 0) {
+            return ret;
+        }
+        if (pnum == 0) {
+            return -EIO;
+        }
+
+        flags = (ret & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (ret & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        next = MIN((sector + pnum) * BDRV_SECTOR_SIZE - exp->dev_offset, end);
+        if (!nbd_extent_add(payload, count, max, next - pos, flags)) {
+            break;
+        }
+        pos = next;
+    }
+    return 0;
+}
+
+static int nbd_extents_dirty_bitmap(NBDExport *exp, BlockDriverState *bs,
+                                    BdrvDirtyBitmap *bitmap,
+                                    uint64_t from, uint32_t len,
+                                    uint8_t *payload, unsigned int *count,
+                                    unsigned int max)
+{
+    uint64_t pos = from, end = from + len;
+    int64_t gran = MAX(bdrv_dirty_bitmap_granularity(bitmap)
+                       >> BDRV_SECTOR_BITS, 1);
+
+    while (pos < end) {
+        int64_t sector = (pos + exp->dev_offset) / BDRV_SECTOR_SIZE;
+        uint64_t next;
+        uint32_t flags;
+
+        flags = bdrv_get_dirty(bs, bitmap, sector) ? NBD_STATE_DIRTY : 0;
+        next = QEMU_ALIGN_UP(sector + 1, gran) * BDRV_SECTOR_SIZE
+               - exp->dev_offset;
+        next = MIN(next, end);
+        if (!nbd_extent_add(payload, count, max, next - pos, flags)) {
+            break;
+        }
+        pos = next;
+    }
+    return 0;
+}
+
+/* Answer NBD_CMD_BLOCK_STATUS with one chunk per selected metadata
+ * context.  Returns 0 if the reply was sent (possibly as an error chunk)
+ * and a negative errno if the connection broke.
+ */
+static int nbd_co_send_block_status(NBDRequest *req,
+                                    struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    unsigned int max = request->type & NBD_CMD_FLAG_REQ_ONE ?
+                       1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    uint8_t *payload = g_malloc(4 + max * 8);
+    unsigned int count;
+    int ret = 0;
+
+    if (!bs) {
+        ret = -ENOMEDIUM;
+        goto error;
+    }
+
+    if (client->meta_base_allocation) {
+        count = 0;
+        stl_be_p(payload, NBD_META_ID_BASE_ALLOCATION);
+        ret = nbd_extents_allocation(exp, bs, request->from, request->len,
+                                     payload, &count, max);
+        if (ret < 0) {
+            goto error;
+        }
+        ret = nbd_co_send_chunk(req, request->handle,
+                                client->meta_dirty_bitmap ?
+                                0 : NBD_REPLY_FLAG_DONE,
+                                NBD_REPLY_TYPE_BLOCK_STATUS,
+                                payload, 4 + count * 8, 0, 0);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    if (client->meta_dirty_bitmap) {
+        BdrvDirtyBitmap *bitmap;
+
+        /* Look the bitmap up again, it may have been removed meanwhile */
+        bitmap = bdrv_find_dirty_bitmap(bs, client->meta_dirty_bitmap);
+        if (!bitmap) {
+            LOG("dirty bitmap '%s' is gone", client->meta_dirty_bitmap);
+            ret = -ENOENT;
+            goto error;
+        }
+        count = 0;
+        stl_be_p(payload, NBD_META_ID_DIRTY_BITMAP);
+        nbd_extents_dirty_bitmap(exp, bs, bitmap, request->from, request->len,
+                                 payload, &count, max);
+        ret = nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                NBD_REPLY_TYPE_BLOCK_STATUS,
+                                payload, 4 + count * 8, 0, 0);
+    }
+    goto out;
+
+error:
+    LOG("block status failed");
+    ret = nbd_co_send_chunk_error(req, request->handle, -ret);
+out:
+    g_free(payload);
+    return ret < 0 ? ret : 0;
+}
+
+/* Zero the requested range without transferring any data.  Unless the
+ * client asked for NBD_CMD_FLAG_NO_HOLE the block layer may punch holes.
+ */
+static int nbd_co_write_zeroes(NBDExport *exp, struct nbd_request *request)
+{
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int64_t nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    BdrvRequestFlags flags = 0;
+    int ret;
+
+    if (!(request->type & NBD_CMD_FLAG_NO_HOLE)) {
+        flags |= BDRV_REQ_MAY_UNMAP;
+    }
+
+    while (nb_sectors > 0) {
+        int n = MIN(nb_sectors, BDRV_REQUEST_MAX_SECTORS);
+
+        ret = blk_co_write_zeroes(exp->blk, sector_num, n, flags);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    return 0;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1074,6 +1697,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1149,6 +1779,58 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_WRITE_ZEROES:
+        TRACE("Request type is WRITE_ZEROES");
+
+        if (exp->nbdflags & NBD_FLAG_READ_ONLY) {
+            TRACE("Server is read-only, return error");
+            reply.error = EROFS;
+            goto error_reply;
+        }
+
+        /* Partial sectors would keep their old data */
+        if ((request.from + exp->dev_offset) % BDRV_SECTOR_SIZE ||
+            request.len % BDRV_SECTOR_SIZE) {
+            LOG("unaligned write zeroes request");
+            goto invalid_request;
+        }
+
+        ret = nbd_co_write_zeroes(exp, &request);
+        if (ret < 0) {
+            LOG("writing zeroes failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+
+        if (request.type & NBD_CMD_FLAG_FUA) {
+            ret = blk_co_flush(exp->blk);
+            if (ret < 0) {
+                LOG("flush failed");
+                reply.error = -ret;
+                goto error_reply;
+            }
+        }
+
+        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+            goto out;
+        }
+        break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->meta_base_allocation && !client->meta_dirty_bitmap) {
+            LOG("no metadata context selected");
+            goto invalid_request;
+        }
+        /* A reply needs at least one extent per context */
+        if (request.len == 0) {
+            LOG("block status request without length");
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
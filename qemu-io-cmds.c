@@ -2070,6 +2070,7 @@ static void reopen_help(void)
 " 'reopen -o lazy-refcounts=on' - activates lazy refcount writeback on a qcow2 image\n"
 "\n"
 " -r, -- Reopen the image read-only\n"
+" -w, -- Reopen the image read-write\n"
 " -c, -- Change the cache mode to the given value\n"
 " -o, -- Changes block driver options (cf. 'open' command)\n"
 "\n");
@@ -2092,7 +2093,7 @@ static const cmdinfo_t reopen_cmd = {
        .argmin         = 0,
        .argmax         = -1,
        .cfunc          = reopen_f,
-       .args           = "[-r] [-c cache] [-o options]",
+       .args           = "[-r|-w] [-c cache] [-o options]",
        .oneline        = "reopens an image with new options",
        .help           = reopen_help,
 };
@@ -2108,7 +2109,7 @@ static int reopen_f(BlockBackend *blk, int argc, char **argv)
     BlockReopenQueue *brq;
     Error *local_err = NULL;
 
-    while ((c = getopt(argc, argv, "c:o:r")) != -1) {
+    while ((c = getopt(argc, argv, "c:o:rw")) != -1) {
         switch (c) {
         case 'c':
             if (bdrv_parse_cache_flags(optarg, &flags) < 0) {
@@ -2125,6 +2126,9 @@ static int reopen_f(BlockBackend *blk, int argc, char **argv)
         case 'r':
             flags &= ~BDRV_O_RDWR;
             break;
+        case 'w':
+            flags |= BDRV_O_RDWR;
+            break;
         default:
             qemu_opts_reset(&reopen_opts);
             return qemuio_command_usage(&reopen_cmd);
@@ -101,7 +101,7 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, unmap)\n"
 "      --image-opts          treat FILE as a full set of image options\n"
@@ -252,7 +252,8 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags,
+    /* The kernel client does not understand structured replies */
+    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags, NULL,
                                 NULL, NULL, NULL,
                                 &size, &local_error);
     if (ret < 0) {
@@ -546,6 +547,8 @@ int main(int argc, char **argv)
             seen_aio = true;
             if (!strcmp(optarg, "native")) {
                 flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
             } else if (!strcmp(optarg, "threads")) {
                 /* this is the default */
             } else {
@@ -878,6 +881,13 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Extra connections of a client would count against --shared, so only
+     * let clients open several of them when more than one is accepted.
+     */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
     exp = nbd_export_new(blk, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          &local_err);
     if (!exp) {
@@ -521,8 +521,11 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,cor-prefetch=off|sequential|adjacent][,cor-prefetch-size=s]\n"
+    "       [,cor-prefetch-speed=b]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
@@ -564,7 +567,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring. Unlike "native", "io_uring" does not require @option{cache=none}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -586,6 +589,17 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item cor-prefetch=@var{cor-prefetch}
+@var{cor-prefetch} is "off", "sequential" or "adjacent" and selects which
+data is copied from the backing file in the background in addition to the
+data that is read when @option{copy-on-read} is on. "sequential" prefetches
+ahead of sequential reads, "adjacent" prefetches after every read that had to
+access the backing file. The default is "off".
+@item cor-prefetch-size=@var{cor-prefetch-size}
+Maximum amount of data that is prefetched ahead of a read, 1M by default.
+@item cor-prefetch-speed=@var{cor-prefetch-speed}
+Limits prefetching to @var{cor-prefetch-speed} bytes per second. By default
+prefetching is not limited.
 @item detect-zeroes=@var{detect-zeroes}
 @var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
 conversion of plain zero writes by the OS to driver specific optimized
@@ -2498,6 +2512,10 @@ Syntax for specifying a NBD device using TCP
 Syntax for specifying a NBD device using Unix Domain Sockets
 ``nbd:unix:<domain-socket>[:exportname=<export>]''
 
+If the server allows it, several connections can be opened to the same
+export with @option{file.connections=@var{n}} (at most 16); requests
+are then spread over all of them.
+
 
 Example for TCP
 @example
@@ -2509,6 +2527,11 @@ Example for Unix Domain Sockets
 qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket
 @end example
 
+Example for TCP with four connections
+@example
+qemu-system-i386 --drive file=nbd:192.0.2.1:30000,file.connections=4
+@end example
+
 @item SSH
 QEMU supports SSH (Secure Shell) access to remote disks.
 
@@ -3176,7 +3199,7 @@ if KVM support is enabled when compiling.
 ETEXI
 
 DEF("mux", HAS_ARG, QEMU_OPTION_mux, \
-    "-mux [dbus-object=<obj>][,dbus-path=<path>]\n"
+    "-mux [dbus-object=<obj>][,dbus-path=<path>][,shm=on|off]\n"
     "      enable RDPMux integration features\n", QEMU_ARCH_ALL)
 STEXI
 @item -mux @var{option}[,@var{option}]
@@ -3192,6 +3215,11 @@ The well-known name of the RDPMux server on the system bus.
 @item dbus-object=<obj>
 The object path to the main RDPMux dbus object.
 
+@item shm=on|off
+Share the framebuffer with the RDPMux server through shared memory instead
+of sending pixel data over the socket. Only damage rectangles are
+transferred when enabled. Defaults to on when librdpmux supports it.
+
 @end table
 ETEXI
 
@@ -1186,7 +1186,8 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?,"
+                      "max-in-flight:i?",
         .mhandler.cmd_new = qmp_marshal_drive_backup,
     },
 
@@ -1228,6 +1229,8 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-in-flight": the maximum number of concurrent copy requests, between
+                   1 and 256, default 16 (json-int, optional)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
@@ -1240,7 +1243,8 @@ EQMP
     {
         .name       = "blockdev-backup",
         .args_type  = "sync:s,device:B,target:B,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,"
+                      "max-in-flight:i?",
         .mhandler.cmd_new = qmp_marshal_blockdev_backup,
     },
 
@@ -1269,6 +1273,8 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-in-flight": the maximum number of concurrent copy requests, between
+                   1 and 256, default 16 (json-int, optional)
 
 Example:
 -> { "execute": "blockdev-backup", "arguments": { "device": "src-id",
@@ -1400,7 +1406,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1417,6 +1423,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image when it is closed; only
+                qcow2 version 3 images support this (json-bool, optional,
+                default false)
 
 Example:
 
@@ -2086,6 +2095,35 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,min-order:i?,max-order:i?",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Change the bucket boundaries of the latency histograms of a block drive and
+clear the histograms.  The boundaries are the powers of two from 2^min-order
+to 2^max-order nanoseconds.
+
+Arguments:
+
+- "device": device name (json-string)
+- "min-order": log2 of the first boundary, default 10 (json-int, optional)
+- "max-order": log2 of the last boundary, default 34, at most 62
+               (json-int, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0", "min-order": 12, "max-order": 30 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2721,6 +2759,39 @@ Each json-object contain the following:
         - "avg_wr_queue_depth": average number of pending write
                                 operations in the defined interval
                                 (json-number).
+    - "rd_latency_histogram": latency histogram of read operations,
+                              with the following members
+                              (json-object, optional):
+        - "boundaries": bucket boundaries in nanoseconds (json-array)
+        - "bins": number of operations in each bucket, one more than
+                  there are boundaries (json-array)
+    - "wr_latency_histogram": latency histogram of write operations,
+                              like "rd_latency_histogram"
+                              (json-object, optional)
+    - "flush_latency_histogram": latency histogram of flush operations,
+                                 like "rd_latency_histogram"
+                                 (json-object, optional)
+    - "cor_prefetch": copy-on-read prefetch statistics, present if
+                      prefetching is enabled, with the following members
+                      (json-object, optional):
+        - "policy": prefetch policy (json-string)
+        - "prefetched_bytes": bytes copied from the backing file by
+                              prefetching (json-int)
+        - "hits": copy-on-read requests served from prefetched data
+                  (json-int)
+        - "misses": copy-on-read requests that had to read from the
+                    backing file (json-int)
+    - "shared_cache": shared read cache statistics, present for blkcache
+                      nodes, with the following members (json-object,
+                      optional):
+        - "id": name of the shared cache (json-string)
+        - "eviction": eviction policy of the shared cache (json-string)
+        - "size": maximum size of the shared cache in bytes (json-int)
+        - "used": amount of data in the shared cache in bytes (json-int)
+        - "hits": cache blocks that this node read from the cache
+                  (json-int)
+        - "misses": cache blocks that this node read from the image
+                    (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2829,7 +2900,7 @@ EQMP
 
     {
         .name       = "query-blockstats",
-        .args_type  = "query-nodes:b?",
+        .args_type  = "query-nodes:b?,reset-histograms:b?",
         .mhandler.cmd_new = qmp_marshal_query_blockstats,
     },
 
@@ -2902,6 +2973,15 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if polling is disabled
+                 (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink factor, 0 to stop polling at once
+                 (json-int)
+
+The poll parameters can be set with the properties of the same names of the
+iothread object, e.g. -object iothread,id=iothread0,poll-max-ns=65536 or
+qom-set.
 
 Example:
 
@@ -2910,11 +2990,17 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0
          }
       ]
    }
@@ -3333,6 +3419,16 @@ The main json-object contains the following:
     "enabled": true or false
     "obj": The DBus object of the RDPMux server
     "path": The DBus path of the RDPMux server
+    "heads": number of graphic consoles shown by the RDPMux server
+    "shm": true if the framebuffers are shared through shared memory
+    "rects-received": damage rectangles reported by the display device
+    "rects-merged": damage rectangles merged into others before sending
+    "rects-dropped": damaged 64x64 tiles dropped because they did not change
+    "rects-sent": rectangles sent to the RDPMux server
+    "refresh-interval": shortest refresh interval of all heads in milliseconds
+    "frames-throttled": refreshes skipped while the RDPMux server was behind
+    "cursor-cache-hits": cursor images found in the RDPMux server's cache
+    "input-dropped": pointer motion events dropped on a full input queue
 
 Example:
 
@@ -3341,7 +3437,17 @@ Example:
       "return": {
           "enabled": true,
           "obj": "org.RDPMux.RDPMux",
-          "path": "/org/RDPMux/RDPMux"
+          "path": "/org/RDPMux/RDPMux",
+          "heads": 1,
+          "shm": true,
+          "rects-received": 1532,
+          "rects-merged": 1021,
+          "rects-dropped": 230,
+          "rects-sent": 402,
+          "refresh-interval": 30,
+          "frames-throttled": 0,
+          "cursor-cache-hits": 57,
+          "input-dropped": 0
       }
    }
 
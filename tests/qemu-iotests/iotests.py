@@ -41,6 +41,10 @@ qemu_io_args = [os.environ.get('QEMU_IO_PROG', 'qemu-io')]
 if os.environ.get('QEMU_IO_OPTIONS'):
     qemu_io_args += os.environ['QEMU_IO_OPTIONS'].strip().split(' ')
 
+qemu_nbd_args = [os.environ.get('QEMU_NBD_PROG', 'qemu-nbd')]
+if os.environ.get('QEMU_NBD_OPTIONS'):
+    qemu_nbd_args += os.environ['QEMU_NBD_OPTIONS'].strip().split(' ')
+
 qemu_args = [os.environ.get('QEMU_PROG', 'qemu')]
 if os.environ.get('QEMU_OPTIONS'):
     qemu_args += os.environ['QEMU_OPTIONS'].strip().split(' ')
@@ -86,6 +90,10 @@ def qemu_io(*args):
         sys.stderr.write('qemu-io received signal %i: %s\n' % (-exitcode, ' '.join(args)))
     return subp.communicate()[0]
 
+def qemu_nbd_popen(*args):
+    '''Start qemu-nbd in the background and return its Popen object'''
+    return subprocess.Popen(qemu_nbd_args + list(args))
+
 def compare_images(img1, img2):
     '''Return True if two image files are identical'''
     return qemu_img('compare', '-f', imgfmt,
@@ -235,6 +243,16 @@ class VM(object):
             os.remove(self._qemu_log_path)
             self._popen = None
 
+    def kill(self):
+        '''Kill the VM without shutting it down, as if it crashed'''
+        if not self._popen is None:
+            self._popen.kill()
+            self._popen.wait()
+            os.remove(self._monitor_path)
+            os.remove(self._qtest_path)
+            os.remove(self._qemu_log_path)
+            self._popen = None
+
     underscore_to_dash = string.maketrans('_', '-')
     def qmp(self, cmd, conv_keys=True, **args):
         '''Invoke a QMP command and return the result dict'''
@@ -16,6 +16,7 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 
 static AioContext *ctx;
 
@@ -504,6 +505,62 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+typedef struct {
+    EventNotifier e;
+    int n;
+    int polled;
+    bool ready;
+} PollTestData;
+
+static void poll_read_cb(EventNotifier *e)
+{
+    PollTestData *data = container_of(e, PollTestData, e);
+    g_assert(event_notifier_test_and_clear(e));
+    data->n++;
+}
+
+static bool poll_ready_cb(void *opaque)
+{
+    PollTestData *data = container_of(opaque, PollTestData, e);
+
+    if (!data->ready) {
+        return false;
+    }
+    data->ready = false;
+    data->polled++;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    PollTestData data = { .n = 0 };
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier_poll(ctx, &data.e, false, poll_read_cb,
+                                poll_ready_cb);
+    aio_context_set_poll_params(ctx, 1000000000LL, 0, 0, &error_abort);
+    while (aio_poll(ctx, false));
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* Nothing is polled yet, but a short wait starts polling */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.polled, ==, 0);
+    g_assert_cmpint(ctx->poll_ns, ==, 4000);
+
+    /* Now the event is found by the poll function, without the fd */
+    data.ready = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.polled, ==, 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -857,6 +914,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
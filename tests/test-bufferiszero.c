@@ -0,0 +1,143 @@
+/*
+ * buffer_is_zero unit tests and benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE (1024 * 1024)
+
+static char buffer[8 * 1024 + 64] __attribute__((aligned(64)));
+
+/* Checks all-zero buffers and a single set byte at every position */
+static void test_1(void)
+{
+    size_t s, a, o;
+
+    for (s = 0; s < 1500; s += (s < 300 ? 1 : 37)) {
+        for (a = 0; a < 64; a += (a < 8 ? 1 : 8)) {
+            /* Bytes around the tested area must not make a difference */
+            memset(buffer, 0xff, sizeof(buffer));
+            memset(buffer + a, 0, s);
+            g_assert(buffer_is_zero(buffer + a, s));
+
+            for (o = 0; o < s; ++o) {
+                buffer[a + o] = 1;
+                g_assert(!buffer_is_zero(buffer + a, s));
+                buffer[a + o] = 0;
+            }
+        }
+    }
+}
+
+static void test_2(void)
+{
+    do {
+        g_test_message("testing %s", test_buffer_is_zero_accel_name());
+        test_1();
+    } while (test_buffer_is_zero_next_accel());
+}
+
+static void test_run(void)
+{
+    bool is_zero;
+    size_t len;
+
+    memset(buffer, 0, sizeof(buffer));
+    len = buffer_zero_run(buffer, 4096, 512, &is_zero);
+    g_assert(is_zero);
+    g_assert_cmpint(len, ==, 4096);
+
+    /* Data in the third block ends a zero run after two blocks */
+    buffer[1500] = 1;
+    len = buffer_zero_run(buffer, 4096, 512, &is_zero);
+    g_assert(is_zero);
+    g_assert_cmpint(len, ==, 1024);
+
+    len = buffer_zero_run(buffer + 1024, 3072, 512, &is_zero);
+    g_assert(!is_zero);
+    g_assert_cmpint(len, ==, 512);
+
+    /* Neighbouring data blocks make a single run */
+    buffer[2048] = 1;
+    len = buffer_zero_run(buffer + 1024, 3072, 512, &is_zero);
+    g_assert(!is_zero);
+    g_assert_cmpint(len, ==, 1536);
+
+    /* A short last block still counts */
+    len = buffer_zero_run(buffer + 2560, 700, 512, &is_zero);
+    g_assert(is_zero);
+    g_assert_cmpint(len, ==, 700);
+
+    len = buffer_zero_run(buffer, 0, 512, &is_zero);
+    g_assert(is_zero);
+    g_assert_cmpint(len, ==, 0);
+}
+
+/* Scans a zeroed buffer with each implementation and reports throughput */
+static void perf_zero(void)
+{
+    char *buf = qemu_memalign(64, BUF_SIZE);
+    unsigned int i, max = 2000;
+    double duration;
+
+    memset(buf, 0, BUF_SIZE);
+    do {
+        g_test_timer_start();
+        for (i = 0; i < max; i++) {
+            g_assert(buffer_is_zero(buf, BUF_SIZE));
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("%-8s %u x %d KiB: %f s, %f GB/s",
+                       test_buffer_is_zero_accel_name(), max, BUF_SIZE / 1024,
+                       duration, (double)max * BUF_SIZE / duration / 1e9);
+    } while (test_buffer_is_zero_next_accel());
+
+    qemu_vfree(buf);
+}
+
+/* Walks a buffer with alternating zero and data areas run by run */
+static void perf_run(void)
+{
+    char *buf = qemu_memalign(64, BUF_SIZE);
+    unsigned int i, max = 500;
+    size_t pos, len;
+    bool is_zero;
+    double duration;
+
+    memset(buf, 0, BUF_SIZE);
+    for (pos = 0; pos < BUF_SIZE; pos += 64 * 1024) {
+        buf[pos + 512 * 17] = 1;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        for (pos = 0; pos < BUF_SIZE; pos += len) {
+            len = buffer_zero_run(buf + pos, BUF_SIZE - pos, 512, &is_zero);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("run      %u x %d KiB: %f s, %f GB/s",
+                   max, BUF_SIZE / 1024, duration,
+                   (double)max * BUF_SIZE / duration / 1e9);
+
+    qemu_vfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/bufferiszero", test_2);
+    g_test_add_func("/cutils/bufferiszero/run", test_run);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/bufferiszero/zero", perf_zero);
+        g_test_add_func("/perf/bufferiszero/run", perf_run);
+    }
+    return g_test_run();
+}
@@ -26,6 +26,7 @@
 #include "ui/console.h"
 #include "hw/qdev-core.h"
 #include "qemu/timer.h"
+#include "qemu/memfd.h"
 #include "qmp-commands.h"
 #include "sysemu/char.h"
 #include "trace.h"
@@ -1253,18 +1254,79 @@ static QemuConsole *new_console(DisplayState *ds, console_type_t console_type,
     return s;
 }
 
+static bool displaysurface_use_memfd;
+
+/*
+ * Back QEMU-allocated surfaces with a memfd so that a display listener
+ * can share the pixels with another process instead of copying them.
+ * Only affects surfaces created after the call.
+ */
+void qemu_displaysurface_use_memfd(bool enable)
+{
+    displaysurface_use_memfd = enable;
+}
+
+#ifdef CONFIG_POSIX
+static void qemu_free_displaysurface_memfd(pixman_image_t *image,
+                                           void *opaque)
+{
+    void *data = pixman_image_get_data(image);
+    size_t size = (size_t)pixman_image_get_stride(image) *
+        pixman_image_get_height(image);
+
+    qemu_memfd_free(data, size, GPOINTER_TO_INT(opaque));
+}
+
+static bool qemu_alloc_display_memfd(DisplaySurface *surface,
+                                     int width, int height)
+{
+    size_t size = (size_t)width * 4 * height;
+    void *data;
+    int fd;
+
+    if (!size) {
+        return false;
+    }
+
+    data = qemu_memfd_alloc("qemu-displaysurface", size,
+                            F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL, &fd);
+    if (!data) {
+        return false;
+    }
+
+    surface->image = pixman_image_create_bits(surface->format,
+                                              width, height,
+                                              data, width * 4);
+    assert(surface->image != NULL);
+    pixman_image_set_destroy_function(surface->image,
+                                      qemu_free_displaysurface_memfd,
+                                      GINT_TO_POINTER(fd));
+    surface->memfd = fd;
+    surface->flags |= QEMU_MEMFD_FLAG;
+    return true;
+}
+#endif
+
 static void qemu_alloc_display(DisplaySurface *surface, int width, int height)
 {
     qemu_pixman_image_unref(surface->image);
     surface->image = NULL;
 
     surface->format = PIXMAN_x8r8g8b8;
+    surface->flags = QEMU_ALLOCATED_FLAG;
+    surface->memfd = -1;
+
+#ifdef CONFIG_POSIX
+    if (displaysurface_use_memfd &&
+        qemu_alloc_display_memfd(surface, width, height)) {
+        return;
+    }
+#endif
+
     surface->image = pixman_image_create_bits(surface->format,
                                               width, height,
                                               NULL, width * 4);
     assert(surface->image != NULL);
-
-    surface->flags = QEMU_ALLOCATED_FLAG;
 }
 
 DisplaySurface *qemu_create_displaysurface(int width, int height)
@@ -1284,6 +1346,7 @@ DisplaySurface *qemu_create_displaysurface_from(int width, int height,
 
     trace_displaysurface_create_from(surface, width, height, format);
     surface->format = format;
+    surface->memfd = -1;
     surface->image = pixman_image_create_bits(surface->format,
                                               width, height,
                                               (void *)data, linesize);
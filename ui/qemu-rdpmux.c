@@ -1,11 +1,33 @@
 #include "qemu-rdpmux.h"
 #include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "qemu/memfd.h"
 #include "qmp-commands.h"
 #include "sysemu/sysemu.h"
 
 #define MUX_MIN_REFRESH 3
 #define MUX_MAX_REFRESH 60
 
+/* frame pacing, in ms */
+#define MUX_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
+#define MUX_REFRESH_INTERVAL_INC  50
+#define MUX_REFRESH_INTERVAL_MAX  GUI_REFRESH_INTERVAL_IDLE
+
+/* damage tracking */
+#define MUX_TILE_SIZE 64
+#define MUX_DAMAGE_MAX_RECTS 32
+
+/*
+ * With multi-head support in librdpmux every display call is addressed to
+ * one head; the heads are laid out left to right in the virtual desktop.
+ */
+#ifdef CONFIG_MUX_MULTIHEAD
+#define MUX_HEAD_CALL(d, fn, ...) mux_display_head_##fn((d)->head, __VA_ARGS__)
+#else
+#define MUX_HEAD_CALL(d, fn, ...) mux_display_##fn(__VA_ARGS__)
+#endif
+
 static bool mux_qemu_check_format(DisplayChangeListener *dcl, 
         pixman_format_code_t format)
 {
@@ -26,7 +48,6 @@ static const DisplayChangeListenerOps mux_display_listener_ops = {
     .dpy_gfx_switch = mux_qemu_display_switch,
     .dpy_gfx_copy = mux_qemu_display_copy,
     .dpy_gfx_check_format = mux_qemu_check_format,
-    .dpy_refresh = mux_qemu_display_refresh,
     .dpy_mouse_set = mux_qemu_mouse_set,
     .dpy_cursor_define = mux_qemu_cursor_define,
 };
@@ -48,33 +69,55 @@ static QemuOptsList qemu_mux_opts = {
             .name = "dbus-object",
             .type = QEMU_OPT_STRING,
         },
+        {
+            .name = "shm",
+            .type = QEMU_OPT_BOOL,
+        },
         { /* end of list */ }
     },
 };
 
-static QemuMuxDisplay *display;
+static QemuMux *mux;
 
 static void qemu_mux_cleanup(Notifier *n, void *opaque)
 {
     printf("QEMU: qemu_mux_cleanup\n");
-    mux_cleanup(display->s);
+    mux_cleanup(mux->s);
 }
 
 MuxInfo *qmp_query_mux(Error **errp)
 {
     QemuOpts *opts = QTAILQ_FIRST(&qemu_mux_opts.head);
     MuxInfo *info;
+    QemuMuxDisplay *d;
     const char *obj;
     const char *path;
+    int i;
 
     info = g_malloc0(sizeof(*info));
 
-    if (!display) {
+    if (!mux) {
         info->enabled = false;
         return info;
     }
 
     info->enabled = true;
+    info->heads = mux->nheads;
+    info->shm = mux->nheads > 0;
+    info->refresh_interval = MUX_REFRESH_INTERVAL_MAX;
+    for (i = 0; i < mux->nheads; i++) {
+        d = mux->heads[i];
+        info->shm &= d->shm_active;
+        info->rects_received += d->rects_received;
+        info->rects_merged += d->rects_merged;
+        info->rects_dropped += d->rects_dropped;
+        info->rects_sent += d->rects_sent;
+        info->refresh_interval = MIN(info->refresh_interval,
+                                     d->dcl.update_interval);
+        info->frames_throttled += d->frames_throttled;
+        info->cursor_cache_hits += d->cursor_cache_hits;
+    }
+    info->input_dropped = atomic_read(&mux->input_dropped);
     obj = qemu_opt_get(opts, "dbus-object");
     path = qemu_opt_get(opts, "dbus-path");
 
@@ -85,114 +128,646 @@ MuxInfo *qmp_query_mux(Error **errp)
 }
 
 
+#ifdef CONFIG_MUX_SHM
+static void mux_qemu_shm_free(pixman_image_t *image, void *opaque)
+{
+    void *data = pixman_image_get_data(image);
+    size_t size = (size_t)pixman_image_get_stride(image) *
+        pixman_image_get_height(image);
+
+    qemu_memfd_free(data, size, GPOINTER_TO_INT(opaque));
+}
+
+static void mux_qemu_shm_release(QemuMuxDisplay *d)
+{
+    if (d->shm_shadow) {
+        pixman_image_unref(d->shm_shadow);
+        d->shm_shadow = NULL;
+    }
+    d->shm_active = false;
+}
+
+/*
+ * Hand the pixels of @ds to the mux process through a memfd. Surfaces
+ * allocated by QEMU already live in one and are shared as is; surfaces
+ * owned by the device (e.g. VGA memory) are mirrored into a memfd
+ * shadow that only gets the damaged rectangles copied in.
+ */
+static bool mux_qemu_shm_switch(QemuMuxDisplay *d, DisplaySurface *ds)
+{
+    pixman_image_t *image = ds->image;
+    int width = surface_width(ds);
+    int height = surface_height(ds);
+    int stride = surface_stride(ds);
+    size_t size = (size_t)stride * height;
+    void *data;
+    int fd;
+
+    mux_qemu_shm_release(d);
+
+    if (!d->mux->shm_enabled || !size) {
+        return false;
+    }
+
+    if (ds->flags & QEMU_MEMFD_FLAG) {
+        fd = ds->memfd;
+    } else {
+        data = qemu_memfd_alloc("rdpmux-surface", size, 0, &fd);
+        if (!data) {
+            return false;
+        }
+        d->shm_shadow = pixman_image_create_bits(ds->format, width, height,
+                                                 data, stride);
+        pixman_image_set_destroy_function(d->shm_shadow, mux_qemu_shm_free,
+                                          GINT_TO_POINTER(fd));
+        pixman_image_composite(PIXMAN_OP_SRC, ds->image, NULL, d->shm_shadow,
+                               0, 0, 0, 0, 0, 0, width, height);
+        image = d->shm_shadow;
+    }
+
+    if (!MUX_HEAD_CALL(d, switch_shm, image, fd, size)) {
+        mux_qemu_shm_release(d);
+        return false;
+    }
+
+    d->shm_active = true;
+    return true;
+}
+
+static void mux_qemu_shm_copy(QemuMuxDisplay *d, int x, int y, int w, int h)
+{
+    if (d->shm_shadow) {
+        pixman_image_composite(PIXMAN_OP_SRC, d->ds->image, NULL,
+                               d->shm_shadow, x, y, 0, 0, x, y, w, h);
+    }
+}
+#else
+static bool mux_qemu_shm_switch(QemuMuxDisplay *d, DisplaySurface *ds)
+{
+    return false;
+}
+
+static void mux_qemu_shm_copy(QemuMuxDisplay *d, int x, int y, int w, int h)
+{
+}
+#endif
+
+#define MUX_HASH_SEED  0xcbf29ce484222325ULL
+#define MUX_HASH_PRIME 0x100000001b3ULL
+
+static uint64_t mux_qemu_hash_buf(const uint8_t *buf, size_t len,
+                                  uint64_t hash)
+{
+    size_t i;
+
+    for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        hash = (hash ^ ldq_he_p(buf + i)) * MUX_HASH_PRIME;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ buf[i]) * MUX_HASH_PRIME;
+    }
+    return hash ^ (hash >> 29);
+}
+
+/*
+ * Hash of one tile of the surface, used to tell whether damaged content
+ * actually changed since it was last sent. Never returns 0, which marks
+ * a tile whose content the mux has not seen yet.
+ */
+static uint64_t mux_qemu_tile_hash(DisplaySurface *ds, int x, int y,
+                                   int w, int h)
+{
+    uint8_t *row = (uint8_t *)surface_data(ds) + y * surface_stride(ds) +
+        x * surface_bytes_per_pixel(ds);
+    size_t len = w * surface_bytes_per_pixel(ds);
+    uint64_t hash = MUX_HASH_SEED;
+
+    for (; h > 0; h--, row += surface_stride(ds)) {
+        hash = mux_qemu_hash_buf(row, len, hash);
+    }
+    return hash | 1;
+}
+
+static void mux_qemu_damage_reset(QemuMuxDisplay *d)
+{
+    pixman_region32_fini(&d->damage);
+    pixman_region32_init(&d->damage);
+    d->damage_count = 0;
+    g_free(d->tile_hash);
+    d->tile_hash = NULL;
+    d->tiles_x = d->tiles_y = 0;
+
+    if (d->ds) {
+        d->tiles_x = DIV_ROUND_UP(surface_width(d->ds), MUX_TILE_SIZE);
+        d->tiles_y = DIV_ROUND_UP(surface_height(d->ds), MUX_TILE_SIZE);
+        d->tile_hash = g_new0(uint64_t, d->tiles_x * d->tiles_y);
+    }
+}
+
+static void mux_qemu_damage_add(QemuMuxDisplay *d, int x, int y, int w, int h)
+{
+    if (!d->ds || w <= 0 || h <= 0) {
+        return;
+    }
+    d->rects_received++;
+    d->damage_count++;
+    pixman_region32_union_rect(&d->damage, &d->damage, x, y, w, h);
+}
+
+/*
+ * Send the damage accumulated since the last refresh. Overlapping and
+ * adjacent rectangles have already been merged by the region; tiles
+ * whose content hashes the same as what was last sent are dropped.
+ */
+static int mux_qemu_damage_flush(QemuMuxDisplay *d)
+{
+    pixman_region32_t changed;
+    pixman_box32_t *extents, *rects;
+    pixman_box32_t tile, bounds;
+    int nrects, tx, ty, i;
+    uint64_t hash, *slot;
+
+    if (!pixman_region32_not_empty(&d->damage)) {
+        return 0;
+    }
+
+    pixman_region32_intersect_rect(&d->damage, &d->damage, 0, 0,
+                                   surface_width(d->ds),
+                                   surface_height(d->ds));
+    extents = pixman_region32_extents(&d->damage);
+    if (pixman_region32_n_rects(&d->damage) > MUX_DAMAGE_MAX_RECTS) {
+        /* too fragmented to be worth sending piece by piece */
+        bounds = *extents;
+        pixman_region32_reset(&d->damage, &bounds);
+        extents = pixman_region32_extents(&d->damage);
+    }
+
+    pixman_region32_init(&changed);
+    for (ty = extents->y1 / MUX_TILE_SIZE;
+         ty * MUX_TILE_SIZE < extents->y2; ty++) {
+        for (tx = extents->x1 / MUX_TILE_SIZE;
+             tx * MUX_TILE_SIZE < extents->x2; tx++) {
+            tile.x1 = tx * MUX_TILE_SIZE;
+            tile.y1 = ty * MUX_TILE_SIZE;
+            tile.x2 = MIN(tile.x1 + MUX_TILE_SIZE, surface_width(d->ds));
+            tile.y2 = MIN(tile.y1 + MUX_TILE_SIZE, surface_height(d->ds));
+            if (pixman_region32_contains_rectangle(&d->damage, &tile) ==
+                PIXMAN_REGION_OUT) {
+                continue;
+            }
+
+            hash = mux_qemu_tile_hash(d->ds, tile.x1, tile.y1,
+                                      tile.x2 - tile.x1, tile.y2 - tile.y1);
+            slot = &d->tile_hash[ty * d->tiles_x + tx];
+            if (*slot == hash) {
+                d->rects_dropped++;
+                continue;
+            }
+            *slot = hash;
+            pixman_region32_union_rect(&changed, &changed, tile.x1, tile.y1,
+                                       tile.x2 - tile.x1, tile.y2 - tile.y1);
+        }
+    }
+    pixman_region32_intersect(&changed, &changed, &d->damage);
+
+    nrects = pixman_region32_n_rects(&d->damage);
+    if (d->damage_count > (unsigned int)nrects) {
+        d->rects_merged += d->damage_count - nrects;
+    }
+    d->damage_count = 0;
+
+    rects = pixman_region32_rectangles(&changed, &nrects);
+    for (i = 0; i < nrects; i++) {
+        mux_qemu_shm_copy(d, rects[i].x1, rects[i].y1,
+                          rects[i].x2 - rects[i].x1,
+                          rects[i].y2 - rects[i].y1);
+        MUX_HEAD_CALL(d, update, rects[i].x1, rects[i].y1,
+                      rects[i].x2 - rects[i].x1,
+                      rects[i].y2 - rects[i].y1);
+    }
+    d->rects_sent += nrects;
+
+    pixman_region32_fini(&changed);
+    pixman_region32_fini(&d->damage);
+    pixman_region32_init(&d->damage);
+    return nrects;
+}
+
 void mux_qemu_display_update(DisplayChangeListener *dcl,
         int x, int y, int w, int h)
 {
-    mux_display_update(x, y, w, h);
+    QemuMuxDisplay *d = container_of(dcl, QemuMuxDisplay, dcl);
+
+    mux_qemu_damage_add(d, x, y, w, h);
 }
 
 void mux_qemu_display_copy(DisplayChangeListener *dcl,
         int src_x, int src_y, int dest_x, int dest_y, int w, int h)
 {
-    mux_display_update(src_x, src_y, w, h);
-    mux_display_update(dest_x, dest_y, w, h);
+    QemuMuxDisplay *d = container_of(dcl, QemuMuxDisplay, dcl);
+
+    /* the source area is left untouched, only the destination changed */
+    mux_qemu_damage_add(d, dest_x, dest_y, w, h);
+}
+
+static void mux_qemu_layout_heads(QemuMux *m)
+{
+    int i, x = 0;
+
+    for (i = 0; i < m->nheads; i++) {
+        m->heads[i]->x_offset = x;
+        if (m->heads[i]->ds) {
+            x += surface_width(m->heads[i]->ds);
+        }
+    }
 }
 
 void mux_qemu_display_switch(DisplayChangeListener *dcl,
         DisplaySurface *ds)
 {
-    display->surface = ds->image;
-    mux_display_switch(ds->image);
+    QemuMuxDisplay *d = container_of(dcl, QemuMuxDisplay, dcl);
+
+    d->ds = ds;
+    d->surface = ds->image;
+    mux_qemu_layout_heads(d->mux);
+    mux_qemu_damage_reset(d);
+    if (!mux_qemu_shm_switch(d, ds)) {
+        MUX_HEAD_CALL(d, switch, ds->image);
+    }
 }
 
+#ifdef CONFIG_MUX_BACKPRESSURE
+static bool mux_qemu_backlogged(void)
+{
+    return mux_out_queue_full();
+}
+#else
+static bool mux_qemu_backlogged(void)
+{
+    return false;
+}
+#endif
+
+/*
+ * Frame pacing: back off while the surface is idle or the mux cannot keep
+ * up, ramp up as soon as something changes. Input from the mux kicks the
+ * refresh timer straight back to the base interval when it is drained, since
+ * a guest reacting to input is about to redraw.
+ *
+ * Each head runs its own refresh timer rather than the shared console
+ * refresh, so an idle head does not get scanned at the rate of a busy one.
+ */
 void mux_qemu_display_refresh(DisplayChangeListener *dcl)
 {
-    graphic_hw_update(display->dcl.con);
-    uint32_t framerate = mux_display_refresh();
-    if (framerate > MUX_MIN_REFRESH && framerate < MUX_MAX_REFRESH) {
-        display->dcl.update_interval = framerate;
+    QemuMuxDisplay *d = container_of(dcl, QemuMuxDisplay, dcl);
+    uint32_t framerate;
+    uint64_t interval = dcl->update_interval;
+    int rects;
+
+    framerate = mux_display_refresh();
+    if (framerate >= MUX_MIN_REFRESH && framerate <= MUX_MAX_REFRESH) {
+        d->refresh_base = 1000 / framerate;
+    }
+
+    if (mux_qemu_backlogged()) {
+        /* leave the damage in the dirty log until the consumer catches up */
+        d->frames_throttled++;
+        interval = MIN(interval * 2, MUX_REFRESH_INTERVAL_MAX);
+        dcl->update_interval = MAX(interval, d->refresh_base);
+        return;
+    }
+
+    graphic_hw_update(dcl->con);
+    rects = mux_qemu_damage_flush(d);
+
+    if (rects || d->input_kick) {
+        interval /= 2;
+    } else {
+        interval += MAX(interval / 2, MUX_REFRESH_INTERVAL_INC);
+    }
+    dcl->update_interval = MAX(MIN(interval, MUX_REFRESH_INTERVAL_MAX),
+                               d->refresh_base);
+    d->input_kick = false;
+}
+
+static void mux_qemu_refresh_timer(void *opaque)
+{
+    QemuMuxDisplay *d = opaque;
+
+    mux_qemu_display_refresh(&d->dcl);
+    timer_mod(d->refresh_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+              d->dcl.update_interval);
+}
+
+static void mux_qemu_refresh_kick(QemuMuxDisplay *d)
+{
+    d->input_kick = true;
+    if (d->dcl.update_interval > d->refresh_base) {
+        d->dcl.update_interval = d->refresh_base;
+        timer_mod(d->refresh_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
     }
-    update_displaychangelistener(&display->dcl, framerate);
 }
 
+#ifdef CONFIG_MUX_CURSOR
 void mux_qemu_mouse_set(DisplayChangeListener *dcl, int x, int y, int on)
 {
+    QemuMuxDisplay *d = container_of(dcl, QemuMuxDisplay, dcl);
 
+    if (x == d->cursor_x && y == d->cursor_y && on == d->cursor_on) {
+        return;
+    }
+    d->cursor_x = x;
+    d->cursor_y = y;
+    d->cursor_on = on;
+    MUX_HEAD_CALL(d, mouse_set, x, y, on);
 }
 
+/*
+ * Cursor images are kept by the mux in MUX_CURSOR_SLOTS slots. Each image
+ * is uploaded once into the least recently used slot, identified by a
+ * hash of its content; defining it again only selects the slot.
+ */
 void mux_qemu_cursor_define(DisplayChangeListener *dcl, QEMUCursor *c)
 {
+    QemuMuxDisplay *d = container_of(dcl, QemuMuxDisplay, dcl);
+    MuxCursorSlot *slot = &d->cursor_slot[0];
+    uint64_t hash;
+    int i;
 
+    hash = mux_qemu_hash_buf((uint8_t *)c->data,
+                             c->width * c->height * sizeof(uint32_t),
+                             MUX_HASH_SEED ^ c->width ^
+                             ((uint64_t)c->height << 16) ^
+                             ((uint64_t)c->hot_x << 32) ^
+                             ((uint64_t)c->hot_y << 48)) | 1;
+
+    d->cursor_clock++;
+    for (i = 0; i < MUX_CURSOR_SLOTS; i++) {
+        if (d->cursor_slot[i].hash == hash) {
+            slot = &d->cursor_slot[i];
+            slot->last_use = d->cursor_clock;
+            d->cursor_cache_hits++;
+            MUX_HEAD_CALL(d, cursor_select, i);
+            return;
+        }
+        if (d->cursor_slot[i].last_use < slot->last_use) {
+            slot = &d->cursor_slot[i];
+        }
+    }
+
+    slot->hash = hash;
+    slot->last_use = d->cursor_clock;
+    MUX_HEAD_CALL(d, cursor_define, slot - d->cursor_slot, c->width,
+                  c->height, c->hot_x, c->hot_y, c->data);
 }
+#else
+void mux_qemu_mouse_set(DisplayChangeListener *dcl, int x, int y, int on)
+{
 
-static void mux_qemu_mouse_move(uint32_t x, uint32_t y)
-{
-    QemuConsole *con = display->dcl.con;
-    qemu_input_queue_abs(con, INPUT_AXIS_X, x,
-            pixman_image_get_width(display->surface));
-    qemu_input_queue_abs(con, INPUT_AXIS_Y, y,
-            pixman_image_get_height(display->surface));
-    qemu_input_event_sync();
-}
-
-static void mux_qemu_mouse_buttons(uint32_t x, uint32_t y, uint32_t flags)
-{
-    QemuConsole *con = display->dcl.con;
-    switch (flags) {
-    case 0x9000: /* left mouse down */
-        qemu_input_queue_btn(con, INPUT_BUTTON_LEFT, 1);
-        break;
-    case 0x1000: /* left mouse up */
-        qemu_input_queue_btn(con, INPUT_BUTTON_LEFT, 0);
-        break;
-    case 0xA000: /* right mouse down */
-        qemu_input_queue_btn(con, INPUT_BUTTON_RIGHT, 1);
-        break;
-    case 0x2000: /* right mouse up */
-        qemu_input_queue_btn(con, INPUT_BUTTON_RIGHT, 0);
-        break;
-    case 0xC000: /* middle mouse down */
-        qemu_input_queue_btn(con, INPUT_BUTTON_MIDDLE, 1);
-        break;
-    case 0x4000: /* middle mouse up */
-        qemu_input_queue_btn(con, INPUT_BUTTON_MIDDLE, 0);
-        break;
-    default:
-        printf("ERROR: Invalid mouse button input: 0x%X\n", flags);
-        break;
+}
+
+void mux_qemu_cursor_define(DisplayChangeListener *dcl, QEMUCursor *c)
+{
+
+}
+#endif
+
+/*
+ * Input from the mux in-loop thread is pushed into a single-producer,
+ * single-consumer ring and drained by a bottom half in the main loop, so
+ * a burst of events is delivered to the input layer with one sync and
+ * one wakeup.
+ */
+
+/* RDP TS_POINTER_EVENT / TS_POINTERX_EVENT flags */
+#define MUX_PTR_FLAGS_HWHEEL          0x0400
+#define MUX_PTR_FLAGS_WHEEL           0x0200
+#define MUX_PTR_FLAGS_WHEEL_NEGATIVE  0x0100
+#define MUX_PTR_FLAGS_WHEEL_MASK      0x00ff
+#define MUX_PTR_FLAGS_MOVE            0x0800
+#define MUX_PTR_FLAGS_DOWN            0x8000
+#define MUX_PTR_FLAGS_BUTTON1         0x1000
+#define MUX_PTR_FLAGS_BUTTON2         0x2000
+#define MUX_PTR_FLAGS_BUTTON3         0x4000
+#define MUX_PTR_XFLAGS_BUTTON1        0x0001
+#define MUX_PTR_XFLAGS_BUTTON2        0x0002
+#define MUX_PTR_WHEEL_DELTA           120
+
+/* RDP TS_KEYBOARD_EVENT flags */
+#define MUX_KBD_FLAGS_EXTENDED        0x0100
+#define MUX_KBD_FLAGS_DOWN            0x4000
+#define MUX_KBD_FLAGS_RELEASE         0x8000
+
+static bool mux_qemu_input_push(QemuMux *d, MuxInputType type,
+                                uint32_t x, uint32_t y, uint32_t flags)
+{
+    unsigned int head = d->input_head;
+    MuxInputEvent *ev;
+
+    while (head - atomic_mb_read(&d->input_tail) >= MUX_INPUT_RING_SIZE) {
+        if (type == MUX_INPUT_MOUSE && flags == MUX_PTR_FLAGS_MOVE) {
+            /* a later position supersedes this one anyway */
+            atomic_inc(&d->input_dropped);
+            return false;
+        }
+        qemu_bh_schedule(d->input_bh);
+        g_usleep(1000);
     }
-    qemu_input_event_sync();
+
+    ev = &d->input_ring[head % MUX_INPUT_RING_SIZE];
+    ev->type = type;
+    ev->x = x;
+    ev->y = y;
+    ev->flags = flags;
+    smp_wmb();
+    atomic_set(&d->input_head, head + 1);
+    qemu_bh_schedule(d->input_bh);
+    return true;
 }
 
 void mux_qemu_receive_mouse(uint32_t mouse_x, uint32_t mouse_y, uint32_t flags)
 {
-    if (flags == 0x800) {
-        mux_qemu_mouse_move(mouse_x, mouse_y);
-    } else {
-        mux_qemu_mouse_buttons(mouse_x, mouse_y, flags);
-    }
+    mux_qemu_input_push(mux, MUX_INPUT_MOUSE, mouse_x, mouse_y, flags);
 }
 
 void mux_qemu_receive_kb(uint32_t keycode, uint32_t flags)
 {
-    printf("Received keyboard input - keycode: %#06x flags: %#06x\n",
-            keycode, flags);
-    if (flags == 0x4000 || flags == 0x4100) {
-        if (keycode == 0x5b || keycode == 0x5c) {
-            qemu_input_event_send_key_qcode(NULL, Q_KEY_CODE_META_L, true);
-        } else {
-            qemu_input_event_send_key_number(display->dcl.con, keycode, true);
-            qemu_input_event_send_key_delay(0);
+    mux_qemu_input_push(mux, MUX_INPUT_KB, keycode, 0, flags);
+}
+
+static void mux_qemu_input_sync(MuxInputBatch *b)
+{
+    if (b->move_pending) {
+        InputMoveEvent move = { .axis = INPUT_AXIS_X };
+        InputEvent evt = { .type = INPUT_EVENT_KIND_ABS, .u.abs = &move };
+
+        move.value = b->x;
+        qemu_input_event_send(b->head->dcl.con, &evt);
+        move.axis = INPUT_AXIS_Y;
+        move.value = b->y;
+        qemu_input_event_send(b->head->dcl.con, &evt);
+        b->move_pending = false;
+    }
+    if (b->events) {
+        qemu_input_event_sync();
+        b->events = 0;
+    }
+    b->buttons = 0;
+}
+
+static void mux_qemu_input_btn(MuxInputBatch *b, InputButton button,
+                               bool down)
+{
+    InputBtnEvent btn = { .button = button, .down = down };
+    InputEvent evt = { .type = INPUT_EVENT_KIND_BTN, .u.btn = &btn };
+
+    /* two transitions of one button in a single frame would be lost */
+    if (b->buttons & (1 << button)) {
+        mux_qemu_input_sync(b);
+    }
+    b->buttons |= 1 << button;
+
+    /* deliver the position the click happened at first */
+    if (b->move_pending) {
+        mux_qemu_input_sync(b);
+    }
+    qemu_input_event_send(b->head->dcl.con, &evt);
+    b->events++;
+}
+
+/* Find the head under desktop column @x, the last one if it is past all. */
+static QemuMuxDisplay *mux_qemu_head_at(QemuMux *m, uint32_t x)
+{
+    int i;
+
+    for (i = 0; i < m->nheads - 1; i++) {
+        if (x < m->heads[i + 1]->x_offset) {
+            break;
+        }
+    }
+    return m->heads[i];
+}
+
+static void mux_qemu_input_mouse(QemuMux *m, MuxInputBatch *b,
+                                 MuxInputEvent *ev)
+{
+    QemuMuxDisplay *d = mux_qemu_head_at(m, ev->x);
+    uint32_t flags = ev->flags;
+    bool down = flags & MUX_PTR_FLAGS_DOWN;
+    int rotation, steps;
+
+    if (flags & (MUX_PTR_FLAGS_WHEEL | MUX_PTR_FLAGS_HWHEEL)) {
+        if (flags & MUX_PTR_FLAGS_HWHEEL) {
+            /* no horizontal wheel in the QEMU input layer */
+            return;
+        }
+        rotation = flags & MUX_PTR_FLAGS_WHEEL_MASK;
+        if (flags & MUX_PTR_FLAGS_WHEEL_NEGATIVE) {
+            rotation -= 0x100;
+        }
+        steps = MAX(abs(rotation) / MUX_PTR_WHEEL_DELTA, 1);
+        while (steps--) {
+            mux_qemu_input_btn(b, rotation > 0 ? INPUT_BUTTON_WHEEL_UP
+                                               : INPUT_BUTTON_WHEEL_DOWN, true);
+            mux_qemu_input_btn(b, rotation > 0 ? INPUT_BUTTON_WHEEL_UP
+                                               : INPUT_BUTTON_WHEEL_DOWN, false);
+        }
+        return;
+    }
+
+    if (d != b->head) {
+        /* pointer moved to another monitor, finish the frame on the old one */
+        mux_qemu_input_sync(b);
+        b->head = d;
+    }
+
+    if (d->surface) {
+        b->x = qemu_input_scale_axis(ev->x - d->x_offset,
+                                     pixman_image_get_width(d->surface),
+                                     INPUT_EVENT_ABS_SIZE);
+        b->y = qemu_input_scale_axis(ev->y,
+                                     pixman_image_get_height(d->surface),
+                                     INPUT_EVENT_ABS_SIZE);
+        b->move_pending = true;
+        b->events++;
+    }
+
+    /*
+     * Extended (TS_POINTERX_EVENT) button events only carry the down flag
+     * and one of the XFLAGS buttons, which never occur together with the
+     * regular button, move or wheel flags.
+     */
+    if (!(flags & ~(MUX_PTR_FLAGS_DOWN | MUX_PTR_XFLAGS_BUTTON1 |
+                    MUX_PTR_XFLAGS_BUTTON2))) {
+        if (flags & MUX_PTR_XFLAGS_BUTTON1) {
+            mux_qemu_input_btn(b, INPUT_BUTTON_SIDE, down);
         }
-    } else if (flags == 0x8000 || flags == 0x8100) {
-        if (keycode == 0x5b || keycode == 0x5c) {
-            qemu_input_event_send_key_qcode(NULL, Q_KEY_CODE_META_L, false);
-        } else {
-            qemu_input_event_send_key_number(display->dcl.con, keycode, false);
-            qemu_input_event_send_key_delay(0);
+        if (flags & MUX_PTR_XFLAGS_BUTTON2) {
+            mux_qemu_input_btn(b, INPUT_BUTTON_EXTRA, down);
         }
+        return;
+    }
+
+    if (flags & MUX_PTR_FLAGS_BUTTON1) {
+        mux_qemu_input_btn(b, INPUT_BUTTON_LEFT, down);
+    }
+    if (flags & MUX_PTR_FLAGS_BUTTON2) {
+        mux_qemu_input_btn(b, INPUT_BUTTON_RIGHT, down);
+    }
+    if (flags & MUX_PTR_FLAGS_BUTTON3) {
+        mux_qemu_input_btn(b, INPUT_BUTTON_MIDDLE, down);
+    }
+}
+
+static void mux_qemu_input_kb(MuxInputBatch *b, MuxInputEvent *ev)
+{
+    KeyValue key = { .type = KEY_VALUE_KIND_NUMBER };
+    InputKeyEvent kev = { .key = &key };
+    InputEvent evt = { .type = INPUT_EVENT_KIND_KEY, .u.key = &kev };
+
+    if (ev->flags & MUX_KBD_FLAGS_RELEASE) {
+        kev.down = false;
+    } else if (ev->flags & MUX_KBD_FLAGS_DOWN) {
+        kev.down = true;
     } else {
-        printf("ERROR: Unknown kb msg 0x%X\n", keycode);
+        return;
+    }
+
+    /* QEMU key numbers mark E0-prefixed scancodes with bit 7 */
+    key.u.number = (ev->x & 0x7f) |
+        (ev->flags & MUX_KBD_FLAGS_EXTENDED ? 0x80 : 0);
+    qemu_input_event_send(b->head->dcl.con, &evt);
+    b->events++;
+}
+
+static void mux_qemu_input_drain(void *opaque)
+{
+    QemuMux *m = opaque;
+    MuxInputBatch b = { .head = m->focus };
+    unsigned int head = atomic_read(&m->input_head);
+    unsigned int tail = m->input_tail;
+    int i;
+
+    smp_rmb();
+    for (; tail != head; tail++) {
+        MuxInputEvent *ev = &m->input_ring[tail % MUX_INPUT_RING_SIZE];
+
+        switch (ev->type) {
+        case MUX_INPUT_MOUSE:
+            mux_qemu_input_mouse(m, &b, ev);
+            break;
+        case MUX_INPUT_KB:
+            mux_qemu_input_kb(&b, ev);
+            break;
+        }
+    }
+    atomic_mb_set(&m->input_tail, tail);
+    mux_qemu_input_sync(&b);
+    m->focus = b.head;
+
+    /* the guest is about to react to the input, refresh at full speed */
+    for (i = 0; i < m->nheads; i++) {
+        mux_qemu_refresh_kick(m->heads[i]);
     }
 }
 
@@ -227,21 +802,44 @@ void mux_qemu_init(void)
     int id = g_random_int_range(0, INT_MAX);
 
     QemuConsole *con;
+    QemuMuxDisplay *d;
     int i;
-    display = g_malloc0(sizeof(QemuMuxDisplay));
+    mux = g_malloc0(sizeof(QemuMux));
 
-    display->s = mux_init_display_struct(uuid_str);
-    mux_register_event_callbacks(mux_display_ops);
-
-    for (i = 0; ; i++) {
+    /* one head per graphic console */
+    for (i = 0; mux->nheads < MUX_MAX_HEADS; i++) {
         con = qemu_console_lookup_by_index(i);
-        if (con && qemu_console_is_graphic(con)) {
+        if (!con) {
             break;
         }
+        if (!qemu_console_is_graphic(con)) {
+            continue;
+        }
+
+        d = g_malloc0(sizeof(QemuMuxDisplay));
+        d->mux = mux;
+        d->head = mux->nheads;
+        pixman_region32_init(&d->damage);
+        d->refresh_base = MUX_REFRESH_INTERVAL_BASE;
+        d->refresh_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                        mux_qemu_refresh_timer, d);
+        d->cursor_on = -1;
+        d->dcl.ops = &mux_display_listener_ops;
+        d->dcl.con = con;
+        d->dcl.update_interval = MUX_REFRESH_INTERVAL_BASE;
+        mux->heads[mux->nheads++] = d;
+    }
+    if (!mux->nheads) {
+        printf("ERROR: no graphic console, bailing!\n");
+        g_free(mux);
+        mux = NULL;
+        return;
     }
+    mux->focus = mux->heads[0];
+    mux->input_bh = qemu_bh_new(mux_qemu_input_drain, mux);
 
-    display->dcl.ops = &mux_display_listener_ops;
-    display->dcl.con = con;
+    mux->s = mux_init_display_struct(uuid_str);
+    mux_register_event_callbacks(mux_display_ops);
 
     char *path = g_malloc0(sizeof(char) * 4096);
 
@@ -250,6 +848,12 @@ void mux_qemu_init(void)
     const char *dbus_obj_path = qemu_opt_get(opts, "dbus-path");
     const char *dbus_obj_name = qemu_opt_get(opts, "dbus-object");
 
+#ifdef CONFIG_MUX_SHM
+    mux->shm_enabled = qemu_opt_get_bool(opts, "shm", true) &&
+        qemu_memfd_check();
+    qemu_displaysurface_use_memfd(mux->shm_enabled);
+#endif
+
     if (mux_get_socket_path(dbus_obj_name, dbus_obj_path, &path, id) != true) {
         printf("ERROR: cannot get socket path, bailing!\n");
         goto socket_path_cleanup;
@@ -260,9 +864,13 @@ void mux_qemu_init(void)
         goto socket_path_cleanup;
     }
 
-    register_displaychangelistener(&display->dcl);
-    display->exit_notifier.notify = qemu_mux_cleanup;
-    qemu_add_exit_notifier(&display->exit_notifier);
+    for (i = 0; i < mux->nheads; i++) {
+        d = mux->heads[i];
+        register_displaychangelistener(&d->dcl);
+        timer_mod(d->refresh_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    }
+    mux->exit_notifier.notify = qemu_mux_cleanup;
+    qemu_add_exit_notifier(&mux->exit_notifier);
 
     qemu_thread_create(&threads[0], "mux_qemu_in_loop", mux_qemu_in_loop,
             NULL, QEMU_THREAD_DETACHED);
@@ -8,15 +8,100 @@
 #include "ui/console.h"
 #include "qemu/config-file.h"
 #include "qemu/thread.h"
+#include "qemu/timer.h"
 #include "ui/input.h"
 
+#ifdef CONFIG_MUX_MULTIHEAD
+#define MUX_MAX_HEADS 16
+#else
+#define MUX_MAX_HEADS 1
+#endif
+#define MUX_CURSOR_SLOTS 16
+#define MUX_INPUT_RING_SIZE 256
+
+typedef enum MuxInputType {
+    MUX_INPUT_MOUSE,
+    MUX_INPUT_KB,
+} MuxInputType;
+
+typedef struct MuxInputEvent {
+    MuxInputType type;
+    uint32_t x;         /* keycode for MUX_INPUT_KB */
+    uint32_t y;
+    uint32_t flags;
+} MuxInputEvent;
+
+/* state of one drain of the input ring */
+typedef struct MuxInputBatch {
+    struct mux_qemu_display *head;  /* head the pointer is on */
+    int x, y;
+    bool move_pending;
+    uint32_t buttons;   /* buttons that changed since the last sync */
+    int events;
+} MuxInputBatch;
+
+typedef struct MuxCursorSlot {
+    uint64_t hash;
+    uint64_t last_use;
+} MuxCursorSlot;
+
+typedef struct QemuMux QemuMux;
+
+/* One graphic console, shown by the mux as one monitor */
 typedef struct mux_qemu_display {
-    MuxDisplay *s;
+    QemuMux *mux;
+    uint32_t head;
     DisplayChangeListener dcl;
+    DisplaySurface *ds;
     pixman_image_t *surface;
-    Notifier exit_notifier;
+    int x_offset;                 /* left edge in the virtual desktop */
+
+    /* shared-memory framebuffer transport */
+    bool shm_active;
+    pixman_image_t *shm_shadow;   /* memfd mirror of a foreign surface */
+
+    /* damage accumulated since the last refresh */
+    pixman_region32_t damage;
+    unsigned int damage_count;
+    uint64_t *tile_hash;
+    int tiles_x, tiles_y;
+
+    uint64_t rects_received;
+    uint64_t rects_merged;
+    uint64_t rects_dropped;
+    uint64_t rects_sent;
+
+    /* frame pacing */
+    QEMUTimer *refresh_timer;
+    uint64_t refresh_base;
+    bool input_kick;
+    uint64_t frames_throttled;
+
+    /* cursor channel */
+    MuxCursorSlot cursor_slot[MUX_CURSOR_SLOTS];
+    uint64_t cursor_clock;
+    uint64_t cursor_cache_hits;
+    int cursor_x, cursor_y, cursor_on;
 } QemuMuxDisplay;
 
+/* The connection to the mux, shared by all heads */
+struct QemuMux {
+    MuxDisplay *s;
+    Notifier exit_notifier;
+    bool shm_enabled;
+
+    QemuMuxDisplay *heads[MUX_MAX_HEADS];
+    int nheads;
+    QemuMuxDisplay *focus;        /* head that gets keyboard input */
+
+    /* input ring, filled by the mux in-loop thread */
+    MuxInputEvent input_ring[MUX_INPUT_RING_SIZE];
+    unsigned int input_head;
+    unsigned int input_tail;
+    unsigned int input_dropped;
+    QEMUBH *input_bh;
+};
+
 void mux_qemu_display_update(DisplayChangeListener *dcl,
         int x, int y, int w, int h);
 void mux_qemu_display_switch(DisplayChangeListener *dcl,
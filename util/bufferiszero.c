@@ -0,0 +1,360 @@
+/*
+ * Simple C functions to supplement the C library
+ *
+ * Copyright (c) 2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+
+/*
+ * Generic version, for any length and alignment. The unaligned head and tail
+ * are loaded with the unaligned access helpers, the aligned middle is
+ * scanned in blocks of 64 bytes.
+ */
+static bool buffer_zero_int(const void *buf, size_t len)
+{
+    if (unlikely(len < 8)) {
+        /* For a very small buffer, simply accumulate all the bytes */
+        const unsigned char *p = buf;
+        const unsigned char *e = buf + len;
+        unsigned char t = 0;
+
+        while (p < e) {
+            t |= *p++;
+        }
+        return t == 0;
+    } else {
+        uint64_t t = ldq_he_p(buf);
+        const uint64_t *p = (uint64_t *)(((uintptr_t)buf + 8) & -8);
+        const uint64_t *e = (uint64_t *)(((uintptr_t)buf + len) & -8);
+
+        for (; p + 8 <= e; p += 8) {
+            __builtin_prefetch(p + 8);
+            if (t) {
+                return false;
+            }
+            t = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+        }
+        while (p < e) {
+            t |= *p++;
+        }
+        t |= ldq_he_p(buf + len - 8);
+
+        return t == 0;
+    }
+}
+
+/*
+ * The vector versions below all work the same way: the first vector is
+ * loaded unaligned, then the buffer is scanned in aligned blocks of four
+ * vectors, checking each block only while the next one is being loaded.
+ * The last four vectors are loaded unaligned again, so the buffer must be at
+ * least four vectors long.
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static bool buffer_zero_sse2(const void *buf, size_t len)
+{
+    __m128i t = _mm_loadu_si128(buf);
+    __m128i *p = (__m128i *)(((uintptr_t)buf + 5 * 16) & -16);
+    __m128i *e = (__m128i *)(((uintptr_t)buf + len) & -16);
+    __m128i zero = _mm_setzero_si128();
+
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        t = _mm_cmpeq_epi8(t, zero);
+        if (unlikely(_mm_movemask_epi8(t) != 0xFFFF)) {
+            return false;
+        }
+        t = p[-4] | p[-3] | p[-2] | p[-1];
+        p += 4;
+    }
+
+    t |= _mm_loadu_si128(buf + len - 4 * 16);
+    t |= _mm_loadu_si128(buf + len - 3 * 16);
+    t |= _mm_loadu_si128(buf + len - 2 * 16);
+    t |= _mm_loadu_si128(buf + len - 1 * 16);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) == 0xFFFF;
+}
+#endif
+
+/*
+ * GCC before version 4.9 has a bug which will cause the target
+ * attribute work incorrectly and failed to compile in some case,
+ * restrict the gcc version to 4.9+ to prevent the failure.
+ */
+
+#if defined(CONFIG_CPUID_H) && defined(CONFIG_AVX2_OPT) && \
+    QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static bool buffer_zero_avx2(const void *buf, size_t len)
+{
+    __m256i t = _mm256_loadu_si256(buf);
+    __m256i *p = (__m256i *)(((uintptr_t)buf + 5 * 32) & -32);
+    __m256i *e = (__m256i *)(((uintptr_t)buf + len) & -32);
+
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(!_mm256_testz_si256(t, t))) {
+            return false;
+        }
+        t = p[-4] | p[-3] | p[-2] | p[-1];
+        p += 4;
+    }
+
+    t |= _mm256_loadu_si256(buf + len - 4 * 32);
+    t |= _mm256_loadu_si256(buf + len - 3 * 32);
+    t |= _mm256_loadu_si256(buf + len - 2 * 32);
+    t |= _mm256_loadu_si256(buf + len - 1 * 32);
+
+    return _mm256_testz_si256(t, t);
+}
+#pragma GCC pop_options
+#define HAVE_BUFFER_ZERO_AVX2
+#endif
+
+#if defined(CONFIG_CPUID_H) && defined(CONFIG_AVX512F_OPT)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static bool buffer_zero_avx512(const void *buf, size_t len)
+{
+    __m512i t = _mm512_loadu_si512(buf);
+    __m512i *p = (__m512i *)(((uintptr_t)buf + 5 * 64) & -64);
+    __m512i *e = (__m512i *)(((uintptr_t)buf + len) & -64);
+
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(_mm512_test_epi64_mask(t, t))) {
+            return false;
+        }
+        t = p[-4] | p[-3] | p[-2] | p[-1];
+        p += 4;
+    }
+
+    t |= _mm512_loadu_si512(buf + len - 4 * 64);
+    t |= _mm512_loadu_si512(buf + len - 3 * 64);
+    t |= _mm512_loadu_si512(buf + len - 2 * 64);
+    t |= _mm512_loadu_si512(buf + len - 1 * 64);
+
+    return !_mm512_test_epi64_mask(t, t);
+}
+#pragma GCC pop_options
+#define HAVE_BUFFER_ZERO_AVX512
+#endif
+
+/*
+ * The accelerators usable on this host, best one first. The tests clear
+ * them one at a time with test_buffer_is_zero_next_accel() to exercise all
+ * of them.
+ */
+#define CACHE_AVX512F   1
+#define CACHE_AVX2      2
+#define CACHE_SSE2      4
+
+static unsigned cpuid_cache;
+static unsigned length_to_accel = 64;
+static bool (*buffer_accel)(const void *, size_t) = buffer_zero_int;
+static const char *buffer_accel_name = "int";
+
+static void init_accel(unsigned cache)
+{
+    bool (*fn)(const void *, size_t) = buffer_zero_int;
+    const char *name = "int";
+    unsigned len = 64;
+
+#ifdef __SSE2__
+    if (cache & CACHE_SSE2) {
+        fn = buffer_zero_sse2;
+        name = "sse2";
+        len = 64;
+    }
+#endif
+#ifdef HAVE_BUFFER_ZERO_AVX2
+    if (cache & CACHE_AVX2) {
+        fn = buffer_zero_avx2;
+        name = "avx2";
+        len = 128;
+    }
+#endif
+#ifdef HAVE_BUFFER_ZERO_AVX512
+    if (cache & CACHE_AVX512F) {
+        fn = buffer_zero_avx512;
+        name = "avx512f";
+        len = 256;
+    }
+#endif
+
+    buffer_accel = fn;
+    buffer_accel_name = name;
+    length_to_accel = len;
+}
+
+#if defined(HAVE_BUFFER_ZERO_AVX2) || defined(HAVE_BUFFER_ZERO_AVX512)
+#include <cpuid.h>
+
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+
+/* The OS must save the YMM (and for AVX-512, the ZMM and opmask) state */
+static uint64_t xgetbv_low(void)
+{
+    uint32_t eax, edx;
+
+    asm("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax;
+}
+
+static unsigned get_cpuid_cache(void)
+{
+    unsigned a, b, c, d, cache = 0;
+    int max = __get_cpuid_max(0, NULL);
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        if (max >= 7 && (c & bit_OSXSAVE)) {
+            uint64_t bv = xgetbv_low();
+
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
+                cache |= CACHE_AVX512F;
+            }
+        }
+    }
+
+    return cache;
+}
+#elif defined(__SSE2__)
+static unsigned get_cpuid_cache(void)
+{
+    return CACHE_SSE2;
+}
+#else
+static unsigned get_cpuid_cache(void)
+{
+    return 0;
+}
+#endif
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    cpuid_cache = get_cpuid_cache();
+    init_accel(cpuid_cache);
+}
+
+/*
+ * Switches to the next slower implementation, for tests and benchmarks.
+ * Once the generic version has been used, goes back to the best one and
+ * returns false, so that all implementations can be walked with a
+ * do { ... } while (test_buffer_is_zero_next_accel()) loop.
+ */
+bool test_buffer_is_zero_next_accel(void)
+{
+    if (cpuid_cache == 0) {
+        init_cpuid_cache();
+        return false;
+    }
+
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+/* Returns the name of the implementation currently in use */
+const char *test_buffer_is_zero_accel_name(void)
+{
+    return buffer_accel_name;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * The buffer may have any length and alignment; buffers that are long
+ * enough are scanned with the best vector instructions the host has.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    if (unlikely(len == 0)) {
+        return true;
+    }
+
+    /* Fetch the beginning of the buffer while we select the implementation */
+    __builtin_prefetch(buf);
+
+    if (len >= length_to_accel) {
+        return buffer_accel(buf, len);
+    }
+    return buffer_zero_int(buf, len);
+}
+
+/*
+ * Measures the run of blocks at the start of a buffer that share their zero
+ * status
+ *
+ * The buffer is split into blocks of @granularity bytes (the last one may be
+ * shorter). Scanning stops at the first block whose status differs from the
+ * first block's, so that data followed by a long zero area, or the other way
+ * round, is only scanned once by callers that walk the buffer run by run.
+ *
+ * *@is_zero is set to whether the run is all zeroes. The return value is the
+ * length of the run in bytes; it is 0 only if @len is 0.
+ */
+size_t buffer_zero_run(const void *buf, size_t len, size_t granularity,
+                       bool *is_zero)
+{
+    size_t run, n;
+    bool zero;
+
+    assert(granularity > 0);
+
+    if (len == 0) {
+        *is_zero = true;
+        return 0;
+    }
+
+    n = MIN(len, granularity);
+    zero = buffer_is_zero(buf, n);
+    for (run = n; run < len; run += n) {
+        n = MIN(len - run, granularity);
+        if (buffer_is_zero(buf + run, n) != zero) {
+            break;
+        }
+    }
+
+    *is_zero = zero;
+    return run;
+}